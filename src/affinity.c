@@ -0,0 +1,359 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+#include "debug.h"
+#include "affinity.h"
+
+/*
+ * CPU placement of the different roles. FUSE threads run on one set of
+ * CPUs and everything related to extraction (I/O threads and the
+ * extracting children) on another. The extraction CPUs are divided in
+ * groups sharing a last level cache, or if that is not known a physical
+ * package, and every stream is kept within one group. Since the I/O
+ * thread serving a stream is the first to write to its buffer, memory
+ * is also placed on the node of the group.
+ */
+
+#if defined ( HAVE_SCHED_SETAFFINITY ) && defined ( HAVE_CPU_SET_T )
+
+struct group {
+        cpu_set_t set;
+        int load;
+};
+
+static pthread_mutex_t affinity_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct group *groups = NULL;
+static int n_groups = 0;
+static cpu_set_t io_set;
+static cpu_set_t saved_set;
+static int active = 0;
+
+/*!
+ *****************************************************************************
+ * Parse a CPU list such as "0-3,8,10-11".
+ ****************************************************************************/
+static int __parse_cpulist(const char *s, cpu_set_t *set)
+{
+        CPU_ZERO(set);
+        while (*s) {
+                char *end;
+                long a = strtol(s, &end, 10);
+                long b = a;
+
+                if (end == s || a < 0)
+                        return -1;
+                s = end;
+                if (*s == '-') {
+                        b = strtol(s + 1, &end, 10);
+                        if (end == s + 1 || b < a)
+                                return -1;
+                        s = end;
+                }
+                for (; a <= b && a < CPU_SETSIZE; a++)
+                        CPU_SET(a, set);
+                if (*s == ',')
+                        ++s;
+                else if (*s && *s != '\n')
+                        return -1;
+                else
+                        break;
+        }
+        return CPU_COUNT(set) ? 0 : -1;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __read_cpulist(int cpu, const char *what, cpu_set_t *set)
+{
+        char path[128];
+        char buf[256];
+        FILE *fp;
+        int res = -1;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s",
+                 cpu, what);
+        fp = fopen(path, "r");
+        if (!fp)
+                return -1;
+        if (fgets(buf, sizeof(buf), fp))
+                res = __parse_cpulist(buf, set);
+        fclose(fp);
+        return res;
+}
+
+/*!
+ *****************************************************************************
+ * Split the extraction CPUs in groups sharing cache or package.
+ ****************************************************************************/
+static int __build_groups()
+{
+        cpu_set_t left = io_set;
+        int cpu;
+
+        groups = calloc(CPU_COUNT(&io_set), sizeof(struct group));
+        if (!groups)
+                return -1;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                cpu_set_t set;
+
+                if (!CPU_ISSET(cpu, &left))
+                        continue;
+                if (__read_cpulist(cpu, "cache/index3/shared_cpu_list",
+                                   &set) &&
+                    __read_cpulist(cpu, "topology/package_cpus_list", &set) &&
+                    __read_cpulist(cpu, "topology/core_siblings_list", &set))
+                        set = io_set;
+                CPU_AND(&set, &set, &left);
+                if (!CPU_COUNT(&set))
+                        CPU_SET(cpu, &set);
+                groups[n_groups++].set = set;
+                CPU_XOR(&left, &left, &set);
+        }
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Set up CPU placement. If neither set is given, nothing is changed.
+ * If only one of them is given the other one becomes the remaining
+ * CPUs, or all CPUs if there are no remaining ones.
+ ****************************************************************************/
+int affinity_init(const char *fuse_cpus, const char *io_cpus)
+{
+        cpu_set_t fuse_set;
+        cpu_set_t tmp;
+        int i;
+
+        if (!fuse_cpus && !io_cpus)
+                return 0;
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &saved_set)) {
+                perror("sched_getaffinity");
+                return -1;
+        }
+        if ((fuse_cpus && __parse_cpulist(fuse_cpus, &fuse_set)) ||
+            (io_cpus && __parse_cpulist(io_cpus, &io_set)))
+                return -1;
+
+        /* Ignore CPUs that are offline or not allowed */
+        if (fuse_cpus) {
+                CPU_AND(&fuse_set, &fuse_set, &saved_set);
+                if (!CPU_COUNT(&fuse_set))
+                        return -1;
+        }
+        if (io_cpus) {
+                CPU_AND(&io_set, &io_set, &saved_set);
+                if (!CPU_COUNT(&io_set))
+                        return -1;
+        }
+        if (!fuse_cpus) {
+                CPU_XOR(&tmp, &saved_set, &io_set);
+                CPU_AND(&fuse_set, &tmp, &saved_set);
+                if (!CPU_COUNT(&fuse_set))
+                        fuse_set = saved_set;
+        }
+        if (!io_cpus) {
+                CPU_XOR(&tmp, &saved_set, &fuse_set);
+                CPU_AND(&io_set, &tmp, &saved_set);
+                if (!CPU_COUNT(&io_set))
+                        io_set = saved_set;
+        }
+        if (__build_groups())
+                return -1;
+
+        /* Threads created later inherit this */
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &fuse_set))
+                perror("sched_setaffinity");
+        for (i = 0; i < n_groups; i++)
+                printd(3, "CPU group %d: %d CPUs\n", i,
+                       CPU_COUNT(&groups[i].set));
+        active = 1;
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void affinity_destroy()
+{
+        if (!active)
+                return;
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &saved_set))
+                perror("sched_setaffinity");
+        free(groups);
+        groups = NULL;
+        n_groups = 0;
+        active = 0;
+}
+
+/*!
+ *****************************************************************************
+ * Number of CPUs available for extraction.
+ ****************************************************************************/
+int affinity_n_io()
+{
+        if (!active)
+                return sysconf(_SC_NPROCESSORS_ONLN);
+        return CPU_COUNT(&io_set);
+}
+
+/*!
+ *****************************************************************************
+ * Bind calling I/O thread number |idx| to a group. Returns the group.
+ ****************************************************************************/
+int affinity_io_thread(int idx)
+{
+        int group;
+
+        if (!active)
+                return -1;
+        group = idx % n_groups;
+        affinity_bind_group(group);
+        return group;
+}
+
+/*!
+ *****************************************************************************
+ * Select group for a new stream.
+ ****************************************************************************/
+int affinity_get_group()
+{
+        int group = 0;
+        int i;
+
+        if (!active)
+                return -1;
+        pthread_mutex_lock(&affinity_lock);
+        for (i = 1; i < n_groups; i++) {
+                /* Load relative to group size */
+                if (groups[i].load * CPU_COUNT(&groups[group].set) <
+                    groups[group].load * CPU_COUNT(&groups[i].set))
+                        group = i;
+        }
+        ++groups[group].load;
+        pthread_mutex_unlock(&affinity_lock);
+        return group;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void affinity_put_group(int group)
+{
+        if (group < 0 || !active)
+                return;
+        pthread_mutex_lock(&affinity_lock);
+        --groups[group].load;
+        pthread_mutex_unlock(&affinity_lock);
+}
+
+/*!
+ *****************************************************************************
+ * Number of CPUs in |group| per stream assigned to it, at least 1.
+ * Returns -1 if there is no placement.
+ ****************************************************************************/
+int affinity_share(int group)
+{
+        int share;
+
+        if (group < 0 || !active)
+                return -1;
+        pthread_mutex_lock(&affinity_lock);
+        share = CPU_COUNT(&groups[group].set) /
+                        (groups[group].load ? groups[group].load : 1);
+        pthread_mutex_unlock(&affinity_lock);
+        return share ? share : 1;
+}
+
+/*!
+ *****************************************************************************
+ * Bind calling thread, or process if single threaded, to |group|.
+ ****************************************************************************/
+void affinity_bind_group(int group)
+{
+        if (group < 0 || !active)
+                return;
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &groups[group].set))
+                perror("sched_setaffinity");
+}
+
+#else
+
+int affinity_init(const char *fuse_cpus, const char *io_cpus)
+{
+        return fuse_cpus || io_cpus ? -1 : 0;
+}
+
+void affinity_destroy()
+{
+}
+
+int affinity_n_io()
+{
+        return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+int affinity_io_thread(int idx)
+{
+        (void)idx;
+        return -1;
+}
+
+int affinity_get_group()
+{
+        return -1;
+}
+
+void affinity_put_group(int group)
+{
+        (void)group;
+}
+
+int affinity_share(int group)
+{
+        (void)group;
+        return -1;
+}
+
+void affinity_bind_group(int group)
+{
+        (void)group;
+}
+
+#endif
@@ -0,0 +1,428 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+
+#include "platform.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dllwrapper.h"
+#include "hashtable.h"
+#include "arccache.h"
+
+#define ARCCACHE_SZ  (1024)
+
+/* Hash table handle */
+static void *ht = NULL;
+
+static pthread_mutex_t arc_access_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Results that are tied to a specific version of an archive. The identity
+ * (size and modification time) of every volume is recorded when the entry
+ * is updated and any mismatch on lookup will discard it.
+ */
+struct arccache_ident {
+        off_t size;
+        struct timespec mtim;
+        unsigned int vcnt;
+        uint64_t vsum;
+};
+
+struct arccache_entry {
+        struct arccache_ident id;
+        unsigned int dry_run_done:1;
+        /* Resolved password and, if read from file, the identity of the
+         * password file it was read from. */
+        void *password;
+        size_t password_size;
+        char *pwd_file;
+        off_t pwd_size;
+        struct timespec pwd_mtim;
+};
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void *__alloc()
+{
+        struct arccache_entry *e;
+        e = malloc(sizeof(struct arccache_entry));
+        if (e)
+                memset(e, 0, sizeof(struct arccache_entry));
+        return e;
+}
+
+/*!
+ *****************************************************************************
+ * Clear memory holding sensitive data in a way that can not be optimized
+ * away by the compiler.
+ ****************************************************************************/
+static void __wipe(void *p, size_t n)
+{
+#ifdef HAVE_EXPLICIT_BZERO
+        explicit_bzero(p, n);
+#else
+        volatile unsigned char *v = p;
+        while (n--)
+                *v++ = 0;
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __free_password(struct arccache_entry *e)
+{
+        if (e->password) {
+                __wipe(e->password, e->password_size);
+                free(e->password);
+        }
+        free(e->pwd_file);
+        e->password = NULL;
+        e->password_size = 0;
+        e->pwd_file = NULL;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __free(const char *key, void *data)
+{
+        (void)key;
+
+        struct arccache_entry *e = data;
+        if (e)
+                __free_password(e);
+        free(e);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __stat_file(const char *file, off_t *size, struct timespec *mtim)
+{
+        struct stat st;
+
+        if (stat(file, &st))
+                return -1;
+        *size = st.st_size;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+        *mtim = st.st_mtim;
+#else
+        mtim->tv_sec = st.st_mtime;
+        mtim->tv_nsec = 0;
+#endif
+        return 0;
+}
+
+#define MAX_VOLUMES 100000
+
+/*!
+ *****************************************************************************
+ * Collect the identity of |arch|. If |vtype| is not negative |arch| is the
+ * first volume of a multi-part archive using the given naming scheme and
+ * the size and modification time of each volume is folded into the
+ * identity. A later volume being replaced must invalidate the verdict too.
+ ****************************************************************************/
+static int __get_identity(const char *arch, int vtype,
+                struct arccache_ident *id)
+{
+        struct timespec mtim;
+        off_t size;
+        char *vol;
+
+        memset(id, 0, sizeof(struct arccache_ident));
+        if (__stat_file(arch, &id->size, &id->mtim))
+                return -1;
+        id->vcnt = 1;
+        if (vtype < 0)
+                return 0;
+
+        /* Leave room for the volume number to grow */
+        vol = malloc(strlen(arch) + 16);
+        if (!vol)
+                return -1;
+        strcpy(vol, arch);
+        id->vsum = 14695981039346656037ULL;
+        while (id->vcnt < MAX_VOLUMES) {
+                RARNextVolumeName(vol, !vtype);
+                if (__stat_file(vol, &size, &mtim))
+                        break;
+                id->vsum = (id->vsum ^ (uint64_t)size) * 1099511628211ULL;
+                id->vsum = (id->vsum ^ (uint64_t)mtim.tv_sec) * 1099511628211ULL;
+                id->vsum = (id->vsum ^ (uint64_t)mtim.tv_nsec) * 1099511628211ULL;
+                ++id->vcnt;
+        }
+        free(vol);
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static inline int __same_identity(const struct arccache_ident *a,
+                const struct arccache_ident *b)
+{
+        return a->size == b->size && a->mtim.tv_sec == b->mtim.tv_sec &&
+               a->mtim.tv_nsec == b->mtim.tv_nsec && a->vcnt == b->vcnt &&
+               a->vsum == b->vsum;
+}
+
+/*!
+ *****************************************************************************
+ * The key is the archive path followed by the name of the file in the
+ * archive. Since the archive path is never a directory this can not
+ * collide with a real path.
+ ****************************************************************************/
+static char *__get_key(const char *arch, const char *file)
+{
+        size_t len = strlen(arch) + strlen(file) + 2;
+        char *key = malloc(len);
+
+        if (key)
+                snprintf(key, len, "%s/%s", arch, file);
+        return key;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __clear_dry_run(struct hash_table_entry *hte, void *arg)
+{
+        const char *prefix = arg;
+        size_t len = strlen(prefix);
+
+        if (hte->user_data && !strncmp(hte->key, prefix, len) &&
+            hte->key[len] == '/')
+                ((struct arccache_entry *)hte->user_data)->dry_run_done = 0;
+}
+
+/*!
+ *****************************************************************************
+ * Check if the password file the cached password for |arch| was read from
+ * has changed since. If so the password is dropped together with all dry
+ * run verdicts for files in |arch| since those were reached using the old
+ * password. Must be called with arc_access_lock held.
+ ****************************************************************************/
+static int __check_pwd_file(const char *arch, struct arccache_entry *e)
+{
+        struct timespec mtim;
+        off_t pwd_size;
+
+        if (!e->pwd_file)
+                return 0;
+        if (!__stat_file(e->pwd_file, &pwd_size, &mtim) &&
+            pwd_size == e->pwd_size &&
+            mtim.tv_sec == e->pwd_mtim.tv_sec &&
+            mtim.tv_nsec == e->pwd_mtim.tv_nsec)
+                return 0;
+        __free_password(e);
+        hashtable_foreach(ht, __clear_dry_run, (void *)arch);
+        return 1;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+int arccache_dry_run_done(const char *arch, const char *file, int vtype)
+{
+        struct hash_table_entry *hte;
+        struct arccache_entry *e;
+        struct arccache_ident id;
+        char *key;
+        int done = 0;
+
+        if (__get_identity(arch, vtype, &id))
+                return 0;
+        key = __get_key(arch, file);
+        if (!key)
+                return 0;
+
+        pthread_mutex_lock(&arc_access_lock);
+        hte = hashtable_entry_get(ht, arch);
+        if (hte)
+                (void)__check_pwd_file(arch, hte->user_data);
+        hte = hashtable_entry_get(ht, key);
+        if (hte) {
+                e = hte->user_data;
+                if (__same_identity(&e->id, &id))
+                        done = e->dry_run_done;
+                else
+                        hashtable_entry_delete(ht, key);
+        }
+        pthread_mutex_unlock(&arc_access_lock);
+
+        free(key);
+        return done;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void arccache_set_dry_run_done(const char *arch, const char *file,
+                int vtype)
+{
+        struct hash_table_entry *hte;
+        struct arccache_entry *e;
+        struct arccache_ident id;
+        char *key;
+
+        if (__get_identity(arch, vtype, &id))
+                return;
+        key = __get_key(arch, file);
+        if (!key)
+                return;
+
+        pthread_mutex_lock(&arc_access_lock);
+        hte = hashtable_entry_alloc(ht, key);
+        if (hte && hte->user_data) {
+                e = hte->user_data;
+                e->id = id;
+                e->dry_run_done = 1;
+        }
+        pthread_mutex_unlock(&arc_access_lock);
+
+        free(key);
+}
+
+/*!
+ *****************************************************************************
+ * Copy the cached password for |arch| to |buf|. If the password was read
+ * from a password file that has changed since, the password and the dry
+ * run verdicts for |arch| are dropped.
+ * Returns 1 on hit, 0 otherwise.
+ ****************************************************************************/
+int arccache_get_password(const char *arch, void *buf, size_t size)
+{
+        struct hash_table_entry *hte;
+        struct arccache_entry *e;
+        int hit = 0;
+
+        pthread_mutex_lock(&arc_access_lock);
+        hte = hashtable_entry_get(ht, arch);
+        if (hte) {
+                e = hte->user_data;
+                if (!e->password || __check_pwd_file(arch, e))
+                        goto out;
+                if (e->password_size <= size) {
+                        memcpy(buf, e->password, e->password_size);
+                        hit = 1;
+                }
+        }
+
+out:
+        pthread_mutex_unlock(&arc_access_lock);
+        return hit;
+}
+
+/*!
+ *****************************************************************************
+ * Store the password resolved for |arch|. |pwd_file| is the password file
+ * it was read from, or NULL if it came from the configuration file.
+ ****************************************************************************/
+void arccache_set_password(const char *arch, const void *password,
+                size_t size, const char *pwd_file)
+{
+        struct hash_table_entry *hte;
+        struct arccache_entry *e;
+        struct timespec mtim;
+        off_t pwd_size = 0;
+
+        if (pwd_file && __stat_file(pwd_file, &pwd_size, &mtim))
+                return;
+
+        pthread_mutex_lock(&arc_access_lock);
+        hte = hashtable_entry_alloc(ht, arch);
+        if (hte && hte->user_data) {
+                e = hte->user_data;
+                __free_password(e);
+                e->password = malloc(size);
+                if (!e->password)
+                        goto out;
+                memcpy(e->password, password, size);
+                e->password_size = size;
+                if (pwd_file) {
+                        e->pwd_file = strdup(pwd_file);
+                        if (!e->pwd_file) {
+                                __free_password(e);
+                                goto out;
+                        }
+                        e->pwd_size = pwd_size;
+                        e->pwd_mtim = mtim;
+                }
+        }
+
+out:
+        pthread_mutex_unlock(&arc_access_lock);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void arccache_invalidate(const char *arch)
+{
+        pthread_mutex_lock(&arc_access_lock);
+        hashtable_entry_delete(ht, arch);
+        pthread_mutex_unlock(&arc_access_lock);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void arccache_init()
+{
+        struct hash_table_ops ops = {
+                .alloc = __alloc,
+                .free = __free,
+        };
+
+        ht = hashtable_init(ARCCACHE_SZ, &ops);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void arccache_destroy()
+{
+        hashtable_destroy(ht);
+        ht = NULL;
+}
@@ -27,6 +27,7 @@
 */
 
 #include <iostream>
+#include <new>
 #include "version.hpp"
 #include "rar.hpp"
 #include "dllext.hpp"
@@ -258,6 +259,33 @@ void PASCAL RARVolNameToFirstName(char *arch, bool oldstylevolume)
 #endif
 }
 
+// Number of threads used by the RAR5 unpacker is read from the command
+// data when the extraction context is created, ie. already during
+// RAROpenArchiveEx(). Recreate the context using the new setting. This is
+// only valid before the first call to RARReadHeader*() on this handle.
+int PASCAL RARSetUnpackThreads(HANDLE hArcData, unsigned int Threads)
+{
+#if defined(RAR_SMP) && RARVER_MAJOR > 4
+  DataSet *Data = (DataSet *)hArcData;
+
+  if (!Data || Data->OpenMode != RAR_OM_EXTRACT)
+    return -1;
+  if (Threads < 1)
+    Threads = 1;
+  if (Threads > MaxPoolThreads)
+    Threads = MaxPoolThreads;
+  Data->Cmd.Threads = Threads;
+  Data->Extract.~CmdExtract();
+  new (&Data->Extract) CmdExtract(&Data->Cmd);
+  Data->Extract.ExtractArchiveInit(Data->Arc);
+  return (int)Threads;
+#else
+  (void)hArcData;
+  (void)Threads;
+  return -1;
+#endif
+}
+
 #if RARVER_MAJOR > 4
 static size_t ListFileHeader(wchar *,Archive &);
 #endif
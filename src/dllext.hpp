@@ -141,6 +141,7 @@ void         PASCAL RARFreeArchiveDataEx(RARArchiveDataEx **);
 void         PASCAL RARNextVolumeName(char *, bool);
 void         PASCAL RARVolNameToFirstName(char *, bool);
 void         PASCAL RARGetFileInfo(HANDLE hArcData, const char *FileName, struct RARWcb *wcb);
+int          PASCAL RARSetUnpackThreads(HANDLE hArcData, unsigned int Threads);
 
 #ifdef __cplusplus
 }
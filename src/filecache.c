@@ -57,10 +57,13 @@ pthread_rwlock_t file_access_lock;
  ****************************************************************************/
 static void *__alloc()
 {
+        static unsigned int gen = 0;
         struct filecache_entry *e;
         e = malloc(sizeof(struct filecache_entry));
-        if (e)
+        if (e) {
                 memset(e, 0, sizeof(struct filecache_entry));
+                e->gen = ++gen;  /* file_access_lock is held */
+        }
         return e;
 }
 
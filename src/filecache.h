@@ -50,6 +50,7 @@ struct filecache_entry {
         short vlen;
         short vpos;
         short vtype;
+        unsigned int gen;            /* unique for each allocated entry */
         union {
                 struct {
 #ifndef WORDS_BIGENDIAN
@@ -59,7 +60,8 @@ struct filecache_entry {
                         unsigned int vsize_fixup_needed:1;
                         unsigned int encrypted:1;
                         unsigned int vsize_resolved:1;
-                        unsigned int :21;
+                        unsigned int solid:1;
+                        unsigned int :20;
                         unsigned int unresolved:1;
                         unsigned int dry_run_done:1;
                         unsigned int check_atime:1;
@@ -73,7 +75,8 @@ struct filecache_entry {
                         unsigned int check_atime:1;
                         unsigned int dry_run_done:1;
                         unsigned int unresolved:1;
-                        unsigned int :21;
+                        unsigned int :20;
+                        unsigned int solid:1;
                         unsigned int vsize_resolved:1;
                         unsigned int encrypted:1;
                         unsigned int vsize_fixup_needed:1;
@@ -278,6 +278,29 @@ void hashtable_entry_delete_subkeys(void *h, const char *key, uint32_t hash)
         }
 }
 
+/*!
+ *****************************************************************************
+ * Call |fn| for each entry in the table. The table must not be modified
+ * by |fn|.
+ ****************************************************************************/
+void hashtable_foreach(void *h, void (*fn)(struct hash_table_entry *, void *),
+                       void *arg)
+{
+        struct hash_table *ht = h;
+        struct hash_table_entry *p;
+        size_t i;
+
+        for (i = 0; i < ht->size; i++) {
+                p = &ht->bucket[i];
+                if (!p->key)
+                        continue;
+                while (p) {
+                        fn(p, arg);
+                        p = p->next;
+                }
+        }
+}
+
 /*!
  *****************************************************************************
  *
@@ -53,6 +53,8 @@ struct hash_table_entry *hashtable_entry_get(void *h, const char *key);
 struct hash_table_entry *hashtable_entry_get_hash(void *h, const char *key, uint32_t hash);
 void hashtable_entry_delete(void *h, const char *key);
 void hashtable_entry_delete_subkeys(void *h, const char *key, uint32_t hash);
+void hashtable_foreach(void *h, void (*fn)(struct hash_table_entry *, void *),
+                       void *arg);
 
 #endif
 
@@ -0,0 +1,425 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+
+#include "platform.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "debug.h"
+#include "hashtable.h"
+#include "headcache.h"
+
+/*
+ * Store of the first part of compressed files, used to serve reads near
+ * the start of a file without spawning a decoder. Entries are validated
+ * against the modification time and size of the file and of the archive
+ * it is in, since the path alone does not tell that the archive was
+ * replaced while the store was on disk. Entries are evicted in LRU
+ * order when the memory cap is reached. The store is optionally loaded
+ * from and saved to file.
+ */
+
+#define HEADCACHE_SZ (1024)
+#define HEADCACHE_MAGIC "rar2fs-head-2\n"
+
+struct headcache_entry {
+        const char *key;
+        char *arch;
+        time_t arch_mtime;
+        off_t arch_size;
+        time_t mtime;
+        off_t size;
+        size_t len;
+        char *data;
+        struct headcache_entry *prev;
+        struct headcache_entry *next;
+};
+
+/* Hash table handle */
+static void *ht = NULL;
+static char *headcache_file = NULL;
+static pthread_mutex_t headcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t total = 0;
+static size_t max_total = 0;
+
+/* Most recently used first */
+static struct headcache_entry *lru_head = NULL;
+static struct headcache_entry *lru_tail = NULL;
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __unlink(struct headcache_entry *e)
+{
+        if (e->prev)
+                e->prev->next = e->next;
+        else if (lru_head == e)
+                lru_head = e->next;
+        if (e->next)
+                e->next->prev = e->prev;
+        else if (lru_tail == e)
+                lru_tail = e->prev;
+        e->prev = NULL;
+        e->next = NULL;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __link(struct headcache_entry *e)
+{
+        e->prev = NULL;
+        e->next = lru_head;
+        if (lru_head)
+                lru_head->prev = e;
+        lru_head = e;
+        if (!lru_tail)
+                lru_tail = e;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void *__alloc()
+{
+        return calloc(1, sizeof(struct headcache_entry));
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __free(const char *key, void *data)
+{
+        struct headcache_entry *e = data;
+
+        (void)key;
+
+        __unlink(e);
+        total -= e->len;
+        free(e->arch);
+        free(e->data);
+        free(e);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __put(const char *path, const struct headcache_ident *id,
+                  char *data, size_t len)
+{
+        struct hash_table_entry *hte;
+        struct headcache_entry *e;
+        char *arch;
+
+        hashtable_entry_delete(ht, path);
+        while (lru_tail && total + len > max_total)
+                hashtable_entry_delete(ht, lru_tail->key);
+
+        arch = strdup(id->arch);
+        hte = arch ? hashtable_entry_alloc(ht, path) : NULL;
+        if (!hte || !hte->user_data) {
+                if (hte)
+                        hashtable_entry_delete(ht, path);
+                free(arch);
+                free(data);
+                return;
+        }
+        e = hte->user_data;
+        e->key = hte->key;
+        e->arch = arch;
+        e->arch_mtime = id->arch_mtime;
+        e->arch_size = id->arch_size;
+        e->mtime = id->mtime;
+        e->size = id->size;
+        e->len = len;
+        e->data = data;
+        total += len;
+        __link(e);
+}
+
+/*!
+ *****************************************************************************
+ * Look up a valid entry for |path|. Stale entries are dropped.
+ ****************************************************************************/
+static struct headcache_entry *__get(const char *path,
+                                     const struct headcache_ident *id)
+{
+        struct hash_table_entry *hte;
+        struct headcache_entry *e;
+
+        hte = hashtable_entry_get(ht, path);
+        if (!hte || !hte->user_data)
+                return NULL;
+        e = hte->user_data;
+        if (e->mtime != id->mtime || e->size != id->size ||
+            e->arch_mtime != id->arch_mtime ||
+            e->arch_size != id->arch_size || strcmp(e->arch, id->arch)) {
+                hashtable_entry_delete(ht, path);
+                return NULL;
+        }
+        return e;
+}
+
+/*!
+ *****************************************************************************
+ * Store the first |len| bytes of |path|.
+ ****************************************************************************/
+void headcache_put(const char *path, const struct headcache_ident *id,
+                   const char *data, size_t len)
+{
+        char *tmp;
+
+        if (!ht || !len || len > max_total)
+                return;
+
+        tmp = malloc(len);
+        if (!tmp)
+                return;
+        memcpy(tmp, data, len);
+
+        pthread_mutex_lock(&headcache_lock);
+        __put(path, id, tmp, len);
+        pthread_mutex_unlock(&headcache_lock);
+        printd(3, "Head of %s cached, %zu bytes\n", path, len);
+}
+
+/*!
+ *****************************************************************************
+ * Copy |len| bytes at |offset| of |path| to |buf|. Returns the number of
+ * bytes copied or -1 if the range is not entirely covered.
+ ****************************************************************************/
+int headcache_read(const char *path, const struct headcache_ident *id,
+                   char *buf, size_t len, off_t offset)
+{
+        struct headcache_entry *e;
+        int res = -1;
+
+        if (!ht)
+                return -1;
+
+        pthread_mutex_lock(&headcache_lock);
+        e = __get(path, id);
+        if (e && offset >= 0 && (off_t)(offset + len) <= (off_t)e->len) {
+                memcpy(buf, e->data + offset, len);
+                __unlink(e);
+                __link(e);
+                res = len;
+        }
+        pthread_mutex_unlock(&headcache_lock);
+        return res;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+int headcache_has(const char *path, const struct headcache_ident *id)
+{
+        int res;
+
+        if (!ht)
+                return 0;
+
+        pthread_mutex_lock(&headcache_lock);
+        res = __get(path, id) != NULL;
+        pthread_mutex_unlock(&headcache_lock);
+        return res;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __load(const char *file)
+{
+        FILE *fp;
+        char magic[sizeof(HEADCACHE_MAGIC) - 1];
+
+        fp = fopen(file, "r");
+        if (!fp)
+                return errno == ENOENT ? 0 : -1;
+
+        if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+            memcmp(magic, HEADCACHE_MAGIC, sizeof(magic))) {
+                fclose(fp);
+                return -1;
+        }
+
+        /* Oldest entry first, the LRU order is restored as they are added */
+        for (;;) {
+                struct headcache_ident id;
+                uint32_t klen;
+                uint32_t alen;
+                uint32_t len;
+                int64_t v[4];
+                char *key;
+                char *arch;
+                char *data;
+
+                if (fread(&klen, sizeof(klen), 1, fp) != 1 ||
+                    !klen || klen >= 4096 ||
+                    fread(&alen, sizeof(alen), 1, fp) != 1 ||
+                    !alen || alen >= 4096)
+                        break;
+                key = malloc(klen + 1);
+                arch = malloc(alen + 1);
+                if (!key || !arch ||
+                    fread(key, klen, 1, fp) != 1 ||
+                    fread(arch, alen, 1, fp) != 1 ||
+                    fread(v, sizeof(v), 1, fp) != 1 ||
+                    fread(&len, sizeof(len), 1, fp) != 1 ||
+                    !len || len > max_total) {
+                        free(arch);
+                        free(key);
+                        break;
+                }
+                key[klen] = 0;
+                arch[alen] = 0;
+                data = malloc(len);
+                if (!data || fread(data, len, 1, fp) != 1) {
+                        free(data);
+                        free(arch);
+                        free(key);
+                        break;
+                }
+                id.arch = arch;
+                id.arch_mtime = v[0];
+                id.arch_size = v[1];
+                id.mtime = v[2];
+                id.size = v[3];
+                __put(key, &id, data, len);
+                free(arch);
+                free(key);
+        }
+        fclose(fp);
+
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Write the store to file, least recently used entry first. The file is
+ * replaced atomically to not lose the store if interrupted.
+ ****************************************************************************/
+int headcache_save()
+{
+        struct headcache_entry *e;
+        char *tmp_file = NULL;
+        FILE *fp = NULL;
+        int ret = -1;
+
+        if (!ht || !headcache_file)
+                return 0;
+
+        pthread_mutex_lock(&headcache_lock);
+        tmp_file = malloc(strlen(headcache_file) + 5);
+        if (!tmp_file)
+                goto out;
+        sprintf(tmp_file, "%s.tmp", headcache_file);
+        fp = fopen(tmp_file, "w");
+        if (!fp)
+                goto out;
+        fwrite(HEADCACHE_MAGIC, sizeof(HEADCACHE_MAGIC) - 1, 1, fp);
+        for (e = lru_tail; e; e = e->prev) {
+                uint32_t klen = strlen(e->key);
+                uint32_t alen = strlen(e->arch);
+                uint32_t len = e->len;
+                int64_t v[4] = {e->arch_mtime, e->arch_size,
+                                e->mtime, e->size};
+
+                fwrite(&klen, sizeof(klen), 1, fp);
+                fwrite(&alen, sizeof(alen), 1, fp);
+                fwrite(e->key, klen, 1, fp);
+                fwrite(e->arch, alen, 1, fp);
+                fwrite(v, sizeof(v), 1, fp);
+                fwrite(&len, sizeof(len), 1, fp);
+                fwrite(e->data, len, 1, fp);
+        }
+        if (!ferror(fp) && fclose(fp) == 0 &&
+            rename(tmp_file, headcache_file) == 0) {
+                ret = 0;
+        } else {
+                unlink(tmp_file);
+        }
+
+out:
+        pthread_mutex_unlock(&headcache_lock);
+        if (ret)
+                printd(1, "Failed to save head cache to %s\n",
+                       headcache_file);
+        free(tmp_file);
+        return ret;
+}
+
+/*!
+ *****************************************************************************
+ * Initialize a store of at most |max| bytes, optionally persisted in
+ * |file|.
+ ****************************************************************************/
+void headcache_init(size_t max, const char *file)
+{
+        struct hash_table_ops ops = {
+                .alloc = __alloc,
+                .free = __free,
+        };
+
+        if (!max)
+                return;
+        max_total = max;
+        ht = hashtable_init(HEADCACHE_SZ, &ops);
+        if (!ht || !file)
+                return;
+        headcache_file = strdup(file);
+        if (headcache_file && __load(file))
+                printd(1, "Failed to load head cache from %s\n", file);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void headcache_destroy()
+{
+        if (ht)
+                hashtable_destroy(ht);
+        ht = NULL;
+        lru_head = NULL;
+        lru_tail = NULL;
+        total = 0;
+        free(headcache_file);
+        headcache_file = NULL;
+}
@@ -0,0 +1,380 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+
+#include "platform.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "debug.h"
+#include "hashtable.h"
+#include "history.h"
+
+/*
+ * Access history of directories, used to prioritize cache warmup.
+ * Each path is given a score that is incremented at every access. When
+ * the history is loaded from file the score is halved, so that paths
+ * that are no longer accessed will eventually fall out of the history.
+ * When the history is full the lowest scoring paths are evicted.
+ * Only the HISTORY_MAX highest scoring paths are saved.
+ */
+
+#define HISTORY_SZ  (1024)
+#define HISTORY_MAX (1024)
+#define HISTORY_MAX_ENTRIES (8 * HISTORY_MAX)
+
+struct history_entry {
+        unsigned int score;
+};
+
+/* Hash table handle */
+static void *ht = NULL;
+static char *history_file = NULL;
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static int n_entries = 0;
+
+/* Paths loaded at init, in order of descending score */
+static char **loaded = NULL;
+static int n_loaded = 0;
+
+struct scored_path {
+        char *path;
+        unsigned int score;
+};
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void *__alloc()
+{
+        return calloc(1, sizeof(struct history_entry));
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __free(const char *key, void *data)
+{
+        (void)key;
+
+        free(data);
+}
+
+static void __prune();
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __add(const char *path, unsigned int score)
+{
+        struct hash_table_entry *hte;
+        struct history_entry *e;
+
+        hte = hashtable_entry_get(ht, path);
+        if (!hte) {
+                if (n_entries >= HISTORY_MAX_ENTRIES) {
+                        __prune();
+                        if (n_entries >= HISTORY_MAX_ENTRIES)
+                                return;
+                }
+                hte = hashtable_entry_alloc(ht, path);
+                if (!hte || !hte->user_data)
+                        return;
+                ++n_entries;
+        }
+        e = hte->user_data;
+        if (e->score < ~0U - score)
+                e->score += score;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __cmp(const void *a, const void *b)
+{
+        const struct scored_path *pa = a;
+        const struct scored_path *pb = b;
+
+        if (pa->score == pb->score)
+                return strcmp(pa->path, pb->path);
+        return pa->score < pb->score ? 1 : -1;
+}
+
+/*!
+ *****************************************************************************
+ * Record an access to |path|, relative to the source folder.
+ ****************************************************************************/
+void history_add(const char *path)
+{
+        if (!ht || !path || strchr(path, '\n'))
+                return;
+
+        pthread_mutex_lock(&history_lock);
+        __add(path, 1);
+        pthread_mutex_unlock(&history_lock);
+}
+
+/*!
+ *****************************************************************************
+ * Get a copy of the paths loaded from file, hottest first. The returned
+ * array should be freed using history_free().
+ ****************************************************************************/
+int history_get(char ***paths)
+{
+        int i;
+        int n = 0;
+
+        *paths = NULL;
+        pthread_mutex_lock(&history_lock);
+        if (n_loaded) {
+                *paths = malloc(n_loaded * sizeof(char *));
+                if (*paths) {
+                        for (i = 0; i < n_loaded; i++) {
+                                (*paths)[n] = strdup(loaded[i]);
+                                if ((*paths)[n])
+                                        ++n;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&history_lock);
+        return n;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void history_free(char **paths, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+                free(paths[i]);
+        free(paths);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __load(const char *file)
+{
+        FILE *fp;
+        char *line = NULL;
+        size_t len = 0;
+        ssize_t n;
+        int max = 0;
+
+        fp = fopen(file, "r");
+        if (!fp)
+                return errno == ENOENT ? 0 : -1;
+
+        while ((n = getline(&line, &len, fp)) != -1) {
+                unsigned int score;
+                char *path;
+
+                if (n && line[n - 1] == '\n')
+                        line[n - 1] = 0;
+                score = strtoul(line, &path, 10);
+                if (*path != ' ' || *(++path) != '/')
+                        continue;
+                score /= 2;
+                if (!score)
+                        continue;
+                if (n_loaded == max) {
+                        char **tmp;
+                        max = max ? max * 2 : 64;
+                        tmp = realloc(loaded, max * sizeof(char *));
+                        if (!tmp)
+                                break;
+                        loaded = tmp;
+                }
+                loaded[n_loaded] = strdup(path);
+                if (!loaded[n_loaded])
+                        break;
+                ++n_loaded;
+                __add(path, score);
+        }
+        free(line);
+        fclose(fp);
+
+        return 0;
+}
+
+struct collect_arg {
+        struct scored_path *sp;
+        int n;
+        int max;
+};
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __collect(struct hash_table_entry *p, void *arg)
+{
+        struct collect_arg *c = arg;
+        struct history_entry *e = p->user_data;
+
+        if (c->n < c->max && e) {
+                c->sp[c->n].path = p->key;
+                c->sp[c->n].score = e->score;
+                ++c->n;
+        }
+}
+
+/*!
+ *****************************************************************************
+ * Make room for new paths by evicting the lowest scoring quarter of the
+ * history. Evicting in batches keeps the cost of sorting the history
+ * away from every single access once it is full.
+ ****************************************************************************/
+static void __prune()
+{
+        struct scored_path *sp;
+        struct collect_arg collect;
+        int i;
+
+        sp = malloc(n_entries * sizeof(struct scored_path));
+        if (!sp)
+                return;
+        collect.sp = sp;
+        collect.n = 0;
+        collect.max = n_entries;
+        hashtable_foreach(ht, __collect, &collect);
+        qsort(sp, collect.n, sizeof(struct scored_path), __cmp);
+
+        /* Keys are owned by the hash table, copy before deleting */
+        for (i = collect.n - HISTORY_MAX_ENTRIES / 4; i < collect.n; i++)
+                sp[i].path = strdup(sp[i].path);
+        for (i = collect.n - HISTORY_MAX_ENTRIES / 4; i < collect.n; i++) {
+                if (sp[i].path) {
+                        hashtable_entry_delete(ht, sp[i].path);
+                        free(sp[i].path);
+                        --n_entries;
+                }
+        }
+        free(sp);
+}
+
+/*!
+ *****************************************************************************
+ * Write the highest scoring paths to the history file. The file is
+ * replaced atomically to not lose the history if interrupted.
+ ****************************************************************************/
+int history_save()
+{
+        struct scored_path *sp = NULL;
+        struct collect_arg collect;
+        char *tmp_file = NULL;
+        FILE *fp = NULL;
+        size_t i;
+        int n = 0;
+        int ret = -1;
+
+        if (!ht || !history_file)
+                return 0;
+
+        pthread_mutex_lock(&history_lock);
+        sp = malloc((n_entries ? n_entries : 1) * sizeof(struct scored_path));
+        if (!sp)
+                goto out;
+        collect.sp = sp;
+        collect.n = 0;
+        collect.max = n_entries;
+        hashtable_foreach(ht, __collect, &collect);
+        n = collect.n;
+        qsort(sp, n, sizeof(struct scored_path), __cmp);
+
+        tmp_file = malloc(strlen(history_file) + 5);
+        if (!tmp_file)
+                goto out;
+        sprintf(tmp_file, "%s.tmp", history_file);
+        fp = fopen(tmp_file, "w");
+        if (!fp)
+                goto out;
+        for (i = 0; i < (size_t)n && i < HISTORY_MAX; i++)
+                fprintf(fp, "%u %s\n", sp[i].score, sp[i].path);
+        if (fclose(fp) == 0 && rename(tmp_file, history_file) == 0)
+                ret = 0;
+        else
+                unlink(tmp_file);
+
+out:
+        pthread_mutex_unlock(&history_lock);
+        if (ret)
+                printd(1, "Failed to save access history to %s\n",
+                       history_file);
+        free(tmp_file);
+        free(sp);
+        return ret;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void history_init(const char *file)
+{
+        struct hash_table_ops ops = {
+                .alloc = __alloc,
+                .free = __free,
+        };
+
+        if (!file)
+                return;
+        history_file = strdup(file);
+        if (!history_file)
+                return;
+        ht = hashtable_init(HISTORY_SZ, &ops);
+        if (__load(file))
+                printd(1, "Failed to load access history from %s\n", file);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void history_destroy()
+{
+        if (ht)
+                hashtable_destroy(ht);
+        ht = NULL;
+        history_free(loaded, n_loaded);
+        loaded = NULL;
+        n_loaded = 0;
+        n_entries = 0;
+        free(history_file);
+        history_file = NULL;
+}
@@ -29,6 +29,12 @@
 #include <platform.h>
 #include <memory.h>
 #include <pthread.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include "debug.h"
 #include "iobuffer.h"
 #include "optdb.h"
@@ -36,14 +42,30 @@
 size_t iob_hist_sz = 0;
 size_t iob_sz = 0;
 
+/*
+ * Released buffers are kept in a small pool and handed out again on the
+ * next open. This avoids mapping, faulting in and zeroing several MiB of
+ * memory for every file that is opened.
+ */
+#define IOB_POOL_DEFAULT 2
+#define IOB_HPAGE_SZ (2 * 1024 * 1024)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iob **pool = NULL;
+static int pool_n = 0;
+static int pool_max = 0;
+static int pool_hugetlb = 0;
+static struct iob_stats pool_stats;
+
 #define SPACE_LEFT(ri, wi) (IOB_SZ - SPACE_USED((ri), (wi)))
 #define SPACE_USED(ri, wi) (((wi) - (ri)) & (IOB_SZ-1))
 
 /*!
  *****************************************************************************
- *
+ * Fill buffer from |fd|. For a non-blocking descriptor this may return
+ * before the buffer is filled, in which case |status| is set to IOB_AGAIN.
  ****************************************************************************/
-size_t iob_write(struct iob *iob, FILE *fp, int hist)
+size_t iob_write(struct iob *iob, int fd, int hist, int *status)
 {
         unsigned tot = 0;
         pthread_mutex_lock(&iob->lock);
@@ -51,6 +73,7 @@ size_t iob_write(struct iob *iob, FILE *fp, int hist)
         unsigned int lri = iob->ri;
         pthread_mutex_unlock(&iob->lock);
         size_t left = SPACE_LEFT(lri, lwi) - 1;   /* -1 to avoid wi = ri */
+        *status = IOB_DONE;
         if (IOB_HIST_SZ && hist == IOB_SAVE_HIST) {
                 left = left > IOB_HIST_SZ ? left - IOB_HIST_SZ : 0;
                 if (!left) {
@@ -60,14 +83,21 @@ size_t iob_write(struct iob *iob, FILE *fp, int hist)
         unsigned int chunk = IOB_SZ - lwi;   /* assume one large chunk */
         chunk = chunk < left ? chunk : left; /* reconsider assumption */
         while (left > 0) {
-                size_t n = fread(iob->data_p + lwi, 1, chunk, fp);
-                if (n != chunk) {
-                        if (ferror(fp)) {
-                                perror("read");
+                ssize_t n = read(fd, iob->data_p + lwi, chunk);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                *status = IOB_AGAIN;
                                 break;
                         }
-                        if (!n)
-                                break;
+                        perror("read");
+                        *status = IOB_EOF;
+                        break;
+                }
+                if (!n) {
+                        *status = IOB_EOF;
+                        break;
                 }
                 left -= n;
                 lwi = (lwi + n) & (IOB_SZ - 1);
@@ -143,6 +173,64 @@ size_t iob_copy(char *dest, struct iob *iob, size_t size, size_t pos)
         return tot;
 }
 
+/*!
+ *****************************************************************************
+ * Map memory for a buffer of |size| bytes. Explicit huge pages are used if
+ * requested and available, otherwise the mapping is aligned so that it can
+ * be backed by transparent huge pages.
+ ****************************************************************************/
+static void *__iob_map(size_t size, size_t *map_sz)
+{
+#ifdef HAVE_MMAP
+        uint8_t *p;
+        size_t head;
+
+#ifdef MAP_HUGETLB
+        if (pool_hugetlb) {
+                size_t sz = (size + IOB_HPAGE_SZ - 1) & ~(IOB_HPAGE_SZ - 1);
+                p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (p != MAP_FAILED) {
+                        *map_sz = sz;
+                        return p;
+                }
+                printd(3, "MAP_HUGETLB failed, using normal pages\n");
+        }
+#endif
+        p = mmap(NULL, size + IOB_HPAGE_SZ, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+                return NULL;
+        head = (IOB_HPAGE_SZ - ((uintptr_t)p & (IOB_HPAGE_SZ - 1))) &
+                        (IOB_HPAGE_SZ - 1);
+        if (head)
+                munmap(p, head);
+        munmap(p + head + size, IOB_HPAGE_SZ - head);
+        p += head;
+#ifdef MADV_HUGEPAGE
+        (void)madvise(p, size, MADV_HUGEPAGE);
+#endif
+        *map_sz = size;
+        return p;
+#else
+        *map_sz = size;
+        return malloc(size);
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __iob_unmap(struct iob *iob)
+{
+#ifdef HAVE_MMAP
+        munmap(iob, iob->map_sz);
+#else
+        free(iob);
+#endif
+}
+
 /*!
  *****************************************************************************
  *
@@ -153,6 +241,15 @@ void iob_init()
         iob_sz = bsz ? (bsz * 1024 * 1024) : IOB_SZ_DEFAULT;
         int hsz = OPT_SET(OPT_KEY_HIST_SIZE) ? OPT_INT(OPT_KEY_HIST_SIZE, 0) : 50;
         iob_hist_sz = IOB_SZ * (hsz / 100.0);
+
+        pool_max = OPT_SET(OPT_KEY_IOB_POOL) ?
+                        OPT_INT(OPT_KEY_IOB_POOL, 0) : IOB_POOL_DEFAULT;
+        pool_hugetlb = OPT_SET(OPT_KEY_IOB_HUGETLB);
+        pool_n = 0;
+        memset(&pool_stats, 0, sizeof(pool_stats));
+        pool = pool_max ? malloc(pool_max * sizeof(struct iob *)) : NULL;
+        if (!pool)
+                pool_max = 0;
 }
 
 /*!
@@ -161,20 +258,55 @@ void iob_init()
  ****************************************************************************/
 void iob_destroy()
 {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_n)
+                __iob_unmap(pool[--pool_n]);
+        free(pool);
+        pool = NULL;
+        pool_max = 0;
+        syslog(LOG_DEBUG, "I/O buffer pool: %" PRIu64 " hits, "
+               "%" PRIu64 " misses", pool_stats.hits, pool_stats.misses);
+        pthread_mutex_unlock(&pool_lock);
 }
 
 /*!
  *****************************************************************************
- *
+ * Get a buffer of at least |size| bytes. The data area is not cleared.
+ * Memory is placed where it is first written, so pooled buffers are only
+ * reused within the same CPU |group| unless it is -1.
  ****************************************************************************/
-struct iob *iob_alloc(size_t size)
+struct iob *iob_alloc(size_t size, int group)
 {
-        struct iob *iob;
+        struct iob *iob = NULL;
+        size_t map_sz;
+        int i;
 
-        iob = calloc(1, size);
-        if (!iob)
-                return NULL;
+        pthread_mutex_lock(&pool_lock);
+        for (i = pool_n - 1; i >= 0; i--) {
+                if (pool[i]->map_sz >= size &&
+                    (group == -1 || pool[i]->group == group)) {
+                        iob = pool[i];
+                        pool[i] = pool[--pool_n];
+                        break;
+                }
+        }
+        if (iob)
+                ++pool_stats.hits;
+        else
+                ++pool_stats.misses;
+        pthread_mutex_unlock(&pool_lock);
+
+        if (iob) {
+                map_sz = iob->map_sz;
+        } else {
+                iob = __iob_map(size, &map_sz);
+                if (!iob)
+                        return NULL;
+        }
 
+        memset(iob, 0, sizeof(struct iob));
+        iob->map_sz = map_sz;
+        iob->group = group;
         pthread_mutex_init(&iob->lock, NULL);
 
         return iob;
@@ -188,10 +320,38 @@ void iob_free(struct iob *iob)
 {
         if (iob) {
                 pthread_mutex_destroy(&iob->lock);
-                free(iob);
+                pthread_mutex_lock(&pool_lock);
+                if (pool_max) {
+                        struct iob *tmp = iob;
+                        if (pool_n == pool_max) {
+                                /* Make room by dropping the oldest entry */
+                                iob = pool[0];
+                                memmove(pool, pool + 1,
+                                        --pool_n * sizeof(struct iob *));
+                        } else {
+                                iob = NULL;
+                        }
+                        pool[pool_n++] = tmp;
+                }
+                pthread_mutex_unlock(&pool_lock);
+                if (iob)
+                        __iob_unmap(iob);
 	}
 }
 
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void iob_get_stats(struct iob_stats *stats)
+{
+        pthread_mutex_lock(&pool_lock);
+        *stats = pool_stats;
+        stats->pooled = pool_n;
+        stats->max = pool_max;
+        pthread_mutex_unlock(&pool_lock);
+}
+
 /*!
  *****************************************************************************
  *
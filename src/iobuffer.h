@@ -44,6 +44,11 @@
 #define IOB_NO_HIST 0
 #define IOB_SAVE_HIST 1
 
+/* Status from iob_write() */
+#define IOB_DONE  0     /* buffer filled up to limit */
+#define IOB_EOF   1     /* end of stream or error */
+#define IOB_AGAIN 2     /* no more data available right now */
+
 struct idx_info {
         int fd;
         int mmap;
@@ -57,11 +62,20 @@ struct iob {
         volatile size_t wi;
         size_t used;
         pthread_mutex_t lock;
+        size_t map_sz;
+        int group;              /* CPU group of first user */
         uint8_t data_p[];
 };
 
+struct iob_stats {
+        int pooled;
+        int max;
+        uint64_t hits;
+        uint64_t misses;
+};
+
 size_t
-iob_write(struct iob *dest, FILE *fp, int hist);
+iob_write(struct iob *dest, int fd, int hist, int *status);
 
 size_t
 iob_read(char *dest, struct iob *src, size_t size, size_t off);
@@ -79,7 +93,7 @@ void
 iob_destroy();
 
 struct iob *
-iob_alloc(size_t size);
+iob_alloc(size_t size, int group);
 
 void
 iob_free(struct iob *iob);
@@ -87,5 +101,8 @@ iob_free(struct iob *iob);
 int
 iob_full(struct iob *iob);
 
+void
+iob_get_stats(struct iob_stats *stats);
+
 #endif
 
@@ -0,0 +1,585 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined ( HAVE_EPOLL_CREATE1 ) && defined ( HAVE_EVENTFD )
+#define USE_EPOLL_
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
+#include "debug.h"
+#include "ioloop.h"
+
+/*
+ * A small fixed set of I/O threads serving any number of handles.
+ * A handle is bound to one thread for its whole life time, so its
+ * callback never runs concurrently with itself. Each handle has a
+ * wakeup descriptor (an eventfd, or a pipe where not available) that is
+ * always watched, and a data descriptor that is only watched while the
+ * handle is armed.
+ */
+
+#define IOLOOP_MAX_EVENTS 64
+
+/* Values of 'dead' */
+#define H_ALIVE    0
+#define H_DELETE   1    /* removal requested */
+#define H_UNLINKED 2    /* removed from thread, batch still in progress */
+#define H_GONE     3    /* safe to free */
+
+struct handle;
+
+struct source {
+        struct handle *h;
+        int events;
+};
+
+struct handle {
+        struct source src[2];   /* wakeup, data */
+        int fd;
+        int wfd[2];             /* [0] is watched, [1] is written */
+        int armed;
+        int dead;
+        ioloop_fn fn;
+        void *arg;
+        struct loop *loop;
+        struct handle *next;
+};
+
+struct loop {
+        pthread_t t;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct handle *handles;
+        int n_handles;
+        int running;
+        int idx;
+        int group;              /* as reported by init callback */
+        int ready;
+        int ctl[2];             /* wakes the thread on add and stop */
+#ifdef USE_EPOLL_
+        int epfd;
+#else
+        struct pollfd *pfds;
+        struct source **srcs;
+        int n_max;
+#endif
+};
+
+static struct loop *loops = NULL;
+static int n_loops = 0;
+static volatile int stop = 0;
+static int (*loop_init)(int idx) = NULL;
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __wfd_open(int wfd[2])
+{
+#ifdef USE_EPOLL_
+        wfd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        wfd[1] = wfd[0];
+        return wfd[0] == -1 ? -1 : 0;
+#else
+        int i;
+
+        if (pipe(wfd))
+                return -1;
+        for (i = 0; i < 2; i++) {
+                (void)fcntl(wfd[i], F_SETFL, O_NONBLOCK);
+                (void)fcntl(wfd[i], F_SETFD, FD_CLOEXEC);
+        }
+        return 0;
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __wfd_close(int wfd[2])
+{
+        close(wfd[0]);
+        if (wfd[1] != wfd[0])
+                close(wfd[1]);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __wfd_signal(int wfd[2])
+{
+#ifdef USE_EPOLL_
+        uint64_t v = 1;
+#else
+        char v = 0;
+#endif
+        /* A full pipe or counter means a wakeup is pending already */
+        NO_UNUSED_RESULT write(wfd[1], &v, sizeof(v));
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __wfd_drain(int wfd[2])
+{
+        char buf[64];
+
+        while (read(wfd[0], buf, sizeof(buf)) > 0)
+                ;
+}
+
+/*!
+ *****************************************************************************
+ * Remove handle from its thread. Only called by the thread itself.
+ ****************************************************************************/
+static void __unlink(struct loop *l, struct handle *h)
+{
+        struct handle **pp;
+
+#ifdef USE_EPOLL_
+        (void)epoll_ctl(l->epfd, EPOLL_CTL_DEL, h->wfd[0], NULL);
+        if (h->armed)
+                (void)epoll_ctl(l->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+#endif
+        h->armed = 0;
+        pthread_mutex_lock(&l->lock);
+        for (pp = &l->handles; *pp; pp = &(*pp)->next) {
+                if (*pp == h) {
+                        *pp = h->next;
+                        break;
+                }
+        }
+        --l->n_handles;
+        h->dead = H_UNLINKED;
+        pthread_mutex_unlock(&l->lock);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __dispatch(struct loop *l, struct source *src,
+                struct handle **removed)
+{
+        struct handle *h = src->h;
+        int dead;
+
+        pthread_mutex_lock(&l->lock);
+        dead = h->dead;
+        pthread_mutex_unlock(&l->lock);
+
+        if (dead == H_UNLINKED)
+                return;         /* more events in same batch */
+        if (src->events & IOLOOP_WAKE)
+                __wfd_drain(h->wfd);
+        if (dead == H_DELETE) {
+                __unlink(l, h);
+                h->next = *removed;
+                *removed = h;
+                return;
+        }
+        h->fn(h->arg, src->events);
+}
+
+/*!
+ *****************************************************************************
+ * Release handles removed in the last batch of events. This can not be
+ * done until all events of the batch have been looked at.
+ ****************************************************************************/
+static void __reap(struct loop *l, struct handle *removed)
+{
+        pthread_mutex_lock(&l->lock);
+        while (removed) {
+                struct handle *next = removed->next;
+                removed->dead = H_GONE;
+                removed = next;
+        }
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+}
+
+#ifndef USE_EPOLL_
+/*!
+ *****************************************************************************
+ * Build the poll(2) set from the current list of handles.
+ ****************************************************************************/
+static int __build_pollset(struct loop *l)
+{
+        struct handle *h;
+        int n = 0;
+
+        pthread_mutex_lock(&l->lock);
+        if (1 + 2 * l->n_handles > l->n_max) {
+                int n_max = 2 * (1 + 2 * l->n_handles);
+                void *p1 = realloc(l->pfds, n_max * sizeof(struct pollfd));
+                void *p2;
+                if (p1)
+                        l->pfds = p1;
+                p2 = realloc(l->srcs, n_max * sizeof(struct source *));
+                if (p2)
+                        l->srcs = p2;
+                if (!p1 || !p2) {
+                        pthread_mutex_unlock(&l->lock);
+                        return -1;
+                }
+                l->n_max = n_max;
+        }
+        l->pfds[n].fd = l->ctl[0];
+        l->pfds[n].events = POLLIN;
+        l->srcs[n++] = NULL;
+        for (h = l->handles; h; h = h->next) {
+                l->pfds[n].fd = h->wfd[0];
+                l->pfds[n].events = POLLIN;
+                l->srcs[n++] = &h->src[0];
+                if (h->armed) {
+                        l->pfds[n].fd = h->fd;
+                        l->pfds[n].events = POLLIN;
+                        l->srcs[n++] = &h->src[1];
+                }
+        }
+        pthread_mutex_unlock(&l->lock);
+        return n;
+}
+#endif
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void *__loop_task(void *arg)
+{
+        struct loop *l = arg;
+        int group = loop_init ? loop_init(l->idx) : -1;
+
+        pthread_mutex_lock(&l->lock);
+        l->group = group;
+        l->ready = 1;
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+
+        while (!stop) {
+                struct handle *removed = NULL;
+                int n;
+                int i;
+#ifdef USE_EPOLL_
+                struct epoll_event ev[IOLOOP_MAX_EVENTS];
+
+                n = epoll_wait(l->epfd, ev, IOLOOP_MAX_EVENTS, -1);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("epoll_wait");
+                        break;
+                }
+                for (i = 0; i < n; i++) {
+                        if (!ev[i].data.ptr)
+                                __wfd_drain(l->ctl);
+                        else
+                                __dispatch(l, ev[i].data.ptr, &removed);
+                }
+#else
+                int n_fds = __build_pollset(l);
+
+                if (n_fds == -1) {
+                        sleep(1);
+                        continue;
+                }
+                n = poll(l->pfds, n_fds, -1);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("poll");
+                        break;
+                }
+                for (i = 0; i < n_fds; i++) {
+                        if (!l->pfds[i].revents)
+                                continue;
+                        if (!l->srcs[i])
+                                __wfd_drain(l->ctl);
+                        else
+                                __dispatch(l, l->srcs[i], &removed);
+                }
+#endif
+                if (removed)
+                        __reap(l, removed);
+        }
+
+        pthread_mutex_lock(&l->lock);
+        l->running = 0;
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+        return NULL;
+}
+
+/*!
+ *****************************************************************************
+ * Register |fd| and its callback |fn|. The callback is invoked from an I/O
+ * thread when the handle is woken up or when |fd| is readable while the
+ * handle is armed. A thread in |group| is preferred unless it is -1.
+ * Returns an opaque handle or NULL on failure.
+ ****************************************************************************/
+void *ioloop_add(int fd, ioloop_fn fn, void *arg, int group)
+{
+        struct handle *h;
+        struct loop *l;
+        int i;
+
+        if (!n_loops)
+                return NULL;
+        h = calloc(1, sizeof(struct handle));
+        if (!h)
+                return NULL;
+        if (__wfd_open(h->wfd)) {
+                free(h);
+                return NULL;
+        }
+        h->fd = fd;
+        h->fn = fn;
+        h->arg = arg;
+        h->src[0].h = h;
+        h->src[0].events = IOLOOP_WAKE;
+        h->src[1].h = h;
+        h->src[1].events = IOLOOP_READABLE;
+
+        /* Pick the least loaded thread, within group if possible */
+        l = NULL;
+        for (i = 0; i < n_loops; i++) {
+                if (group != -1 && loops[i].group != group)
+                        continue;
+                if (!l || loops[i].n_handles < l->n_handles)
+                        l = &loops[i];
+        }
+        if (!l) {
+                l = &loops[0];
+                for (i = 1; i < n_loops; i++) {
+                        if (loops[i].n_handles < l->n_handles)
+                                l = &loops[i];
+                }
+        }
+        h->loop = l;
+
+        pthread_mutex_lock(&l->lock);
+        h->next = l->handles;
+        l->handles = h;
+        ++l->n_handles;
+        pthread_mutex_unlock(&l->lock);
+
+#ifdef USE_EPOLL_
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &h->src[0];
+        if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, h->wfd[0], &ev) == -1) {
+                perror("epoll_ctl");
+                pthread_mutex_lock(&l->lock);
+                l->handles = h->next;   /* nothing can be in front */
+                --l->n_handles;
+                pthread_mutex_unlock(&l->lock);
+                __wfd_close(h->wfd);
+                free(h);
+                return NULL;
+        }
+#else
+        __wfd_signal(l->ctl);
+#endif
+        return h;
+}
+
+/*!
+ *****************************************************************************
+ * Start or stop watching the data descriptor. Must only be called from
+ * within the callback of the handle.
+ ****************************************************************************/
+void ioloop_arm(void *h_, int on)
+{
+        struct handle *h = h_;
+
+        on = !!on;
+        if (h->armed == on)
+                return;
+#ifdef USE_EPOLL_
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &h->src[1];
+        if (epoll_ctl(h->loop->epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                      h->fd, &ev) == -1) {
+                perror("epoll_ctl");
+                return;
+        }
+#endif
+        h->armed = on;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void ioloop_wake(void *h_)
+{
+        struct handle *h = h_;
+        __wfd_signal(h->wfd);
+}
+
+/*!
+ *****************************************************************************
+ * Remove handle. When this function returns the callback is guaranteed
+ * to not be running and will never be invoked again. Must not be called
+ * from within the callback.
+ ****************************************************************************/
+void ioloop_del(void *h_)
+{
+        struct handle *h = h_;
+        struct loop *l = h->loop;
+
+        pthread_mutex_lock(&l->lock);
+        if (l->running) {
+                h->dead = H_DELETE;
+                __wfd_signal(h->wfd);
+                while (h->dead != H_GONE && l->running)
+                        pthread_cond_wait(&l->cond, &l->lock);
+        }
+        if (h->dead != H_GONE) {
+                /* Thread is gone, unlink here */
+                struct handle **pp;
+                for (pp = &l->handles; *pp; pp = &(*pp)->next) {
+                        if (*pp == h) {
+                                *pp = h->next;
+                                --l->n_handles;
+                                break;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&l->lock);
+        __wfd_close(h->wfd);
+        free(h);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+int ioloop_init(int n_threads, int (*init)(int idx))
+{
+        int i;
+
+        if (n_threads < 1)
+                n_threads = 1;
+        loops = calloc(n_threads, sizeof(struct loop));
+        if (!loops)
+                return -1;
+        stop = 0;
+        loop_init = init;
+        for (i = 0; i < n_threads; i++) {
+                struct loop *l = &loops[n_loops];
+
+                if (__wfd_open(l->ctl))
+                        break;
+#ifdef USE_EPOLL_
+                struct epoll_event ev;
+                l->epfd = epoll_create1(EPOLL_CLOEXEC);
+                if (l->epfd == -1) {
+                        __wfd_close(l->ctl);
+                        break;
+                }
+                ev.events = EPOLLIN;
+                ev.data.ptr = NULL;
+                if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->ctl[0], &ev) == -1) {
+                        close(l->epfd);
+                        __wfd_close(l->ctl);
+                        break;
+                }
+#endif
+                pthread_mutex_init(&l->lock, NULL);
+                pthread_cond_init(&l->cond, NULL);
+                l->running = 1;
+                l->idx = n_loops;
+                if (pthread_create(&l->t, NULL, __loop_task, l)) {
+                        pthread_cond_destroy(&l->cond);
+                        pthread_mutex_destroy(&l->lock);
+#ifdef USE_EPOLL_
+                        close(l->epfd);
+#endif
+                        __wfd_close(l->ctl);
+                        break;
+                }
+                pthread_mutex_lock(&l->lock);
+                while (!l->ready)
+                        pthread_cond_wait(&l->cond, &l->lock);
+                pthread_mutex_unlock(&l->lock);
+                ++n_loops;
+        }
+        printd(3, "Started %d I/O threads\n", n_loops);
+        return n_loops ? 0 : -1;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void ioloop_destroy()
+{
+        int i;
+
+        stop = 1;
+        for (i = 0; i < n_loops; i++)
+                __wfd_signal(loops[i].ctl);
+        for (i = 0; i < n_loops; i++) {
+                struct loop *l = &loops[i];
+
+                pthread_join(l->t, NULL);
+                /* Handles not deleted by their owners */
+                while (l->handles) {
+                        struct handle *h = l->handles;
+                        l->handles = h->next;
+                        __wfd_close(h->wfd);
+                        free(h);
+                }
+                pthread_cond_destroy(&l->cond);
+                pthread_mutex_destroy(&l->lock);
+#ifdef USE_EPOLL_
+                close(l->epfd);
+#else
+                free(l->pfds);
+                free(l->srcs);
+#endif
+                __wfd_close(l->ctl);
+        }
+        free(loops);
+        loops = NULL;
+        n_loops = 0;
+}
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <libgen.h>
 #include "debug.h"
@@ -51,6 +52,22 @@ static struct opt_entry opt_entry_[] = {
         {{NULL,}, 0, 0, 0, 0, 0},
         {{NULL,}, 0, 0, 0, 0, 0},
         {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 1},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 1},
+        {{NULL,}, 0, 0, 0, 0, 1},
+        {{NULL,}, 0, 0, 0, 0, 1},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 0},
+        {{NULL,}, 0, 0, 0, 0, 1},
+        {{NULL,}, 0, 0, 0, 0, 1},
+        {{NULL,}, 0, 0, 0, 0, 1},
         {{NULL,}, 0, 0, 0, 0, 0}
 };
 
@@ -133,6 +150,13 @@ int optdb_save(int opt, const char *s)
         case OPT_KEY_SEEK_LENGTH:
         case OPT_KEY_HIST_SIZE:
         case OPT_KEY_BUF_SIZE:
+        case OPT_KEY_IOB_POOL:
+        case OPT_KEY_UNPACK_THREADS:
+        case OPT_KEY_HEAD_CACHE:
+        case OPT_KEY_HEAD_CACHE_SIZE:
+        case OPT_KEY_MAX_STREAMS:
+        case OPT_KEY_MAX_IOB_MEM:
+        case OPT_KEY_ADMIT_TIMEOUT:
         {
                 NO_UNUSED_RESULT strtoul(s1, &endptr, 10);
                 if (*endptr)
@@ -143,6 +167,9 @@ int optdb_save(int opt, const char *s)
         }
         case OPT_KEY_SRC:
         case OPT_KEY_DST:
+        case OPT_KEY_FUSE_CPUS:
+        case OPT_KEY_IO_CPUS:
+        case OPT_KEY_HEAD_CACHE_FILE:
                 CLR_OPT_(opt);
                 ADD_OPT_(opt, s1, OPT_STR_);
                 break;
@@ -246,6 +273,19 @@ int optdb_find(int opt, char *path)
                         free(safe_path);
                         ++i;
                 }
+        } else if (opt == OPT_KEY_HEAD_CACHE_EXT) {
+                size_t len = strlen(path);
+                while (i != OPT_CNT(opt)) {
+                        char *tmp = OPT_STR(OPT_KEY_HEAD_CACHE_EXT, i);
+                        size_t n;
+                        if (tmp && *tmp == '.')
+                                ++tmp;
+                        n = tmp ? strlen(tmp) : 0;
+                        if (n && n < len && path[len - n - 1] == '.' &&
+                            !strcasecmp(path + len - n, tmp))
+                                return 1;
+                        ++i;
+                }
         }
         return 0;
 }
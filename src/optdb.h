@@ -52,6 +52,22 @@ enum {
         OPT_KEY_DATE_RAR,
         OPT_KEY_CONFIG,
         OPT_KEY_NO_INHERIT_PERM,
+        OPT_KEY_NO_NATIVE_LIST,
+        OPT_KEY_WARMUP_HISTORY,
+        OPT_KEY_IOB_POOL,
+        OPT_KEY_IOB_HUGETLB,
+        OPT_KEY_FUSE_CPUS,
+        OPT_KEY_IO_CPUS,
+        OPT_KEY_SOLID_DECODER,
+        OPT_KEY_UNPACK_THREADS,
+        OPT_KEY_HEAD_CACHE,
+        OPT_KEY_HEAD_CACHE_SIZE,
+        OPT_KEY_HEAD_CACHE_EXT,
+        OPT_KEY_HEAD_CACHE_FILE,
+        OPT_KEY_MAX_STREAMS,
+        OPT_KEY_MAX_IOB_MEM,
+        OPT_KEY_ADMIT_TIMEOUT,
+        OPT_KEY_PREWARM,
         OPT_KEY_END, /* Must *always* be last key */
         OPT_KEY_LAST = (OPT_KEY_END - 1)
 };
@@ -0,0 +1,412 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include "debug.h"
+#include "qos.h"
+
+/*
+ * Book keeping and scheduling of concurrent decompression streams.
+ *
+ * Every stream reports how much data its reader consumes and how much
+ * is buffered ahead of it. From that the time left until the buffer
+ * runs dry is estimated. When there are more streams wanting to
+ * decompress than there are slots (CPUs), the extracting children of
+ * the streams that are least at risk are stopped for a while, giving
+ * CPU time to the others. Streams consuming more than a fair share of
+ * the total throughput, eg. a bulk copy, are only considered urgent
+ * once all streams within their share have enough data buffered.
+ * Stopping and continuing a child requires no privileges and, unlike
+ * a nice value, can always be undone.
+ */
+
+#define QOS_PERIOD_MS 100
+#define QOS_HORIZON_US (2 * 1000000)    /* a stream is at risk below this */
+
+struct stream {
+        char *path;
+        pid_t pid;
+        double weight;
+        uint64_t consumed;      /* bytes since last tick */
+        double rate;            /* bytes/s, moving average */
+        size_t buffered;
+        int want;
+        int stopped;
+        int bg;                 /* background, runs only on spare slots */
+        uint64_t key;
+        struct qos_stats stats;
+        struct stream *next;
+};
+
+static pthread_mutex_t qos_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qos_cond = PTHREAD_COND_INITIALIZER;
+static struct stream *streams = NULL;
+static int n_streams = 0;
+static struct qos_stats closed;         /* streams no longer open */
+static pthread_t sched_thread;
+static int sched_running = 0;
+static int sched_slots = 1;
+
+/*!
+ *****************************************************************************
+ * Relative weight from a nice value, 20% per step as for CFS.
+ ****************************************************************************/
+static double __nice_weight(int nice)
+{
+        double w = 1.0;
+
+        if (nice > 19)
+                nice = 19;
+        if (nice < -20)
+                nice = -20;
+        for (; nice > 0; nice--)
+                w *= 0.8;
+        for (; nice < 0; nice++)
+                w *= 1.25;
+        return w;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __stats_add(struct qos_stats *dst, const struct qos_stats *src)
+{
+        dst->reads += src->reads;
+        dst->bytes += src->bytes;
+        dst->underruns += src->underruns;
+        dst->wait_us += src->wait_us;
+        if (src->wait_max_us > dst->wait_max_us)
+                dst->wait_max_us = src->wait_max_us;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __set_stopped(struct stream *s, int stop)
+{
+        /* Streams fed by a shared decoder (no own child) are never gated */
+        if (s->stopped == stop || !s->pid)
+                return;
+        if (!killpg(s->pid, stop ? SIGSTOP : SIGCONT))
+                s->stopped = stop;
+        else if (!stop)
+                s->stopped = 0;         /* child is gone */
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __key_cmp(const void *a, const void *b)
+{
+        const struct stream *s1 = *(const struct stream **)a;
+        const struct stream *s2 = *(const struct stream **)b;
+
+        return s1->key < s2->key ? -1 : s1->key > s2->key;
+}
+
+/*!
+ *****************************************************************************
+ * Decide which streams may run until the next tick. Called with lock held.
+ ****************************************************************************/
+static void __schedule(struct stream **v)
+{
+        struct stream *s;
+        double total = 0.0;
+        double fair;
+        int n_want = 0;
+        int i;
+
+        for (s = streams; s; s = s->next) {
+                s->rate = 0.7 * s->rate +
+                          0.3 * (s->consumed * (1000.0 / QOS_PERIOD_MS));
+                s->consumed = 0;
+                total += s->rate / s->weight;
+                if (s->want)
+                        v[n_want++] = s;
+                else
+                        __set_stopped(s, 0);
+        }
+        if (n_want <= sched_slots) {
+                for (i = 0; i < n_want; i++)
+                        __set_stopped(v[i], 0);
+                return;
+        }
+
+        fair = total / n_streams;
+        for (i = 0; i < n_want; i++) {
+                double left;
+
+                s = v[i];
+                left = s->rate > 1.0 ?
+                        (s->buffered / s->rate) * 1000000.0 : 0.0;
+                left /= s->weight;
+                if (left > QOS_HORIZON_US * 64.0)
+                        left = QOS_HORIZON_US * 64.0;
+                s->key = (uint64_t)left;
+                /* Streams above their share go last unless others are
+                 * safe anyway */
+                if (s->rate / s->weight > fair || left >= QOS_HORIZON_US)
+                        s->key += (uint64_t)QOS_HORIZON_US * 64;
+                /* Nobody is waiting for background streams */
+                if (s->bg)
+                        s->key = (uint64_t)QOS_HORIZON_US * 256;
+        }
+        qsort(v, n_want, sizeof(struct stream *), __key_cmp);
+        for (i = 0; i < n_want; i++)
+                __set_stopped(v[i], i >= sched_slots);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void *__sched_task(void *arg)
+{
+        struct stream **v = NULL;
+        int v_max = 0;
+
+        (void)arg;
+
+        pthread_mutex_lock(&qos_lock);
+        while (sched_running) {
+                struct timespec ts;
+
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += QOS_PERIOD_MS * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                        ts.tv_nsec -= 1000000000L;
+                        ts.tv_sec += 1;
+                }
+                pthread_cond_timedwait(&qos_cond, &qos_lock, &ts);
+                if (!sched_running)
+                        break;
+
+                if (n_streams > v_max) {
+                        void *p = realloc(v, 2 * n_streams *
+                                          sizeof(struct stream *));
+                        if (!p)
+                                continue;
+                        v = p;
+                        v_max = 2 * n_streams;
+                }
+                if (n_streams)
+                        __schedule(v);
+        }
+        pthread_mutex_unlock(&qos_lock);
+        free(v);
+        return NULL;
+}
+
+/*!
+ *****************************************************************************
+ * Register a new stream fed by child process |pid|, or 0 if the child
+ * is shared with other streams. The |nice| value of the client is used to
+ * weight the stream.
+ ****************************************************************************/
+void *qos_register(const char *path, pid_t pid, int nice)
+{
+        struct stream *s = calloc(1, sizeof(struct stream));
+
+        if (!s)
+                return NULL;
+        s->path = strdup(path);
+        if (!s->path) {
+                free(s);
+                return NULL;
+        }
+        s->pid = pid;
+        s->weight = __nice_weight(nice);
+        s->want = 1;
+
+        pthread_mutex_lock(&qos_lock);
+        s->next = streams;
+        streams = s;
+        ++n_streams;
+        pthread_mutex_unlock(&qos_lock);
+        return s;
+}
+
+/*!
+ *****************************************************************************
+ * Register a background stream fed by child process |pid|. It is stopped
+ * whenever its slot is wanted by any other stream.
+ ****************************************************************************/
+void *qos_register_bg(const char *path, pid_t pid)
+{
+        struct stream *s = qos_register(path, pid, 19);
+
+        if (s) {
+                pthread_mutex_lock(&qos_lock);
+                s->bg = 1;
+                pthread_mutex_unlock(&qos_lock);
+        }
+        return s;
+}
+
+/*!
+ *****************************************************************************
+ * Remove stream. The child is continued if it was stopped and the final
+ * statistics are returned in |stats| unless NULL.
+ ****************************************************************************/
+void qos_unregister(void *h, struct qos_stats *stats)
+{
+        struct stream *s = h;
+        struct stream **pp;
+
+        if (!s)
+                return;
+        pthread_mutex_lock(&qos_lock);
+        for (pp = &streams; *pp; pp = &(*pp)->next) {
+                if (*pp == s) {
+                        *pp = s->next;
+                        --n_streams;
+                        break;
+                }
+        }
+        __set_stopped(s, 0);
+        __stats_add(&closed, &s->stats);
+        pthread_mutex_unlock(&qos_lock);
+        if (stats)
+                *stats = s->stats;
+        free(s->path);
+        free(s);
+}
+
+/*!
+ *****************************************************************************
+ * Report that |bytes| were consumed from the stream, that |buffered| bytes
+ * are ready ahead of the reader and if decompression needs to continue.
+ ****************************************************************************/
+void qos_update(void *h, size_t bytes, size_t buffered, int want)
+{
+        struct stream *s = h;
+
+        if (!s)
+                return;
+        pthread_mutex_lock(&qos_lock);
+        if (bytes) {
+                s->consumed += bytes;
+                s->stats.bytes += bytes;
+                ++s->stats.reads;
+        }
+        s->buffered = buffered;
+        s->want = want;
+        pthread_mutex_unlock(&qos_lock);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void qos_underrun(void *h, uint64_t wait_us)
+{
+        struct stream *s = h;
+
+        if (!s)
+                return;
+        pthread_mutex_lock(&qos_lock);
+        ++s->stats.underruns;
+        s->stats.wait_us += wait_us;
+        if (wait_us > s->stats.wait_max_us)
+                s->stats.wait_max_us = wait_us;
+        pthread_mutex_unlock(&qos_lock);
+}
+
+/*!
+ *****************************************************************************
+ * Collect statistics for open streams of |path|, or for all streams
+ * including closed ones if |path| is NULL. Returns number of open
+ * streams included.
+ ****************************************************************************/
+int qos_get_stats(const char *path, struct qos_stats *stats)
+{
+        struct stream *s;
+        int n = 0;
+
+        memset(stats, 0, sizeof(struct qos_stats));
+        pthread_mutex_lock(&qos_lock);
+        if (!path)
+                __stats_add(stats, &closed);
+        for (s = streams; s; s = s->next) {
+                if (!path || !strcmp(path, s->path)) {
+                        __stats_add(stats, &s->stats);
+                        ++n;
+                }
+        }
+        pthread_mutex_unlock(&qos_lock);
+        return n;
+}
+
+/*!
+ *****************************************************************************
+ * Statistics are always collected. Scheduling is only performed if
+ * |sched| is set, with |slots| streams allowed to run concurrently.
+ ****************************************************************************/
+int qos_init(int sched, int slots)
+{
+        memset(&closed, 0, sizeof(struct qos_stats));
+        if (!sched)
+                return 0;
+        sched_slots = slots > 0 ? slots : 1;
+        sched_running = 1;
+        if (pthread_create(&sched_thread, NULL, __sched_task, NULL)) {
+                sched_running = 0;
+                return -1;
+        }
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void qos_destroy()
+{
+        struct stream *s;
+
+        pthread_mutex_lock(&qos_lock);
+        if (sched_running) {
+                sched_running = 0;
+                pthread_cond_signal(&qos_cond);
+                pthread_mutex_unlock(&qos_lock);
+                pthread_join(sched_thread, NULL);
+                pthread_mutex_lock(&qos_lock);
+        }
+        /* Never leave a child stopped behind */
+        for (s = streams; s; s = s->next)
+                __set_stopped(s, 0);
+        pthread_mutex_unlock(&qos_lock);
+}
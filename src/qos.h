@@ -0,0 +1,52 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+#ifndef QOS_H_
+#define QOS_H_
+
+#include <platform.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct qos_stats {
+        uint64_t reads;
+        uint64_t bytes;
+        uint64_t underruns;     /* reads that had to wait for data */
+        uint64_t wait_us;       /* total time spent waiting */
+        uint64_t wait_max_us;
+};
+
+int qos_init(int sched, int slots);
+void qos_destroy();
+void *qos_register(const char *path, pid_t pid, int nice);
+void *qos_register_bg(const char *path, pid_t pid);
+void qos_unregister(void *h, struct qos_stats *stats);
+void qos_update(void *h, size_t bytes, size_t buffered, int want);
+void qos_underrun(void *h, uint64_t wait_us);
+int qos_get_stats(const char *path, struct qos_stats *stats);
+
+#endif
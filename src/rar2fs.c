@@ -31,6 +31,8 @@
 #include <sys/statvfs.h>
 #include <sys/select.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <string.h>
@@ -59,12 +61,19 @@
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>
 #endif
+#ifdef HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
+#ifdef HAVE_SYS_RESOURCE_H
+# include <sys/resource.h>
+#endif
 #include <assert.h>
 #include "version.h"
 #include "debug.h"
 #include "index.h"
 #include "dllwrapper.h"
 #include "filecache.h"
+#include "arccache.h"
 #include "dircache.h"
 #include "iobuffer.h"
 #include "optdb.h"
@@ -73,12 +82,19 @@
 #include "rarconfig.h"
 #include "common.h"
 #include "dirname.h"
+#include "rarhdr.h"
+#include "threadpool.h"
+#include "history.h"
+#include "headcache.h"
+#include "rawio.h"
+#include "ioloop.h"
+#include "qos.h"
+#include "affinity.h"
 
 #define MOUNT_FOLDER  0
 #define MOUNT_ARCHIVE 1
 
 #define RD_IDLE 0
-#define RD_TERM 1
 #define RD_SYNC_NOREAD 2
 #define RD_SYNC_READ 3
 #define RD_ASYNC_READ 4
@@ -90,8 +106,32 @@ struct volume_handle {
         off_t pos;
 };
 
+/* Secondary stream serving early reads far ahead of the primary stream */
+struct tail_stream {
+        int pfd;
+        pid_t pid;
+        int eof;
+        void *qos;
+        off_t base;             /* file offset of data[0] */
+        size_t len;
+        char *data;
+};
+
 struct io_context {
-        FILE* fp;
+        int pfd;
+        int eof;
+        void *ioh;
+        void *rio;
+        void *qos;
+        int cpu_group;
+        struct tail_stream *tail;
+        char *head;             /* head of file being collected */
+        size_t head_len;
+        struct headcache_ident head_id;
+        off_t consumed;
+        int prewarmed;
+        pthread_mutex_t start_mutex;
+        int start_failed;
         off_t pos;
         struct iob *buf;
         pid_t pid;
@@ -99,7 +139,6 @@ struct io_context {
         short vno;
         short vno_max;
         struct filecache_entry *entry_p;
-        pthread_t thread;
         pthread_mutex_t raw_read_mutex;
         pthread_mutex_t rd_req_mutex;
         pthread_cond_t rd_req_cond;
@@ -154,7 +193,6 @@ static struct dir_entry_list arch_list_root;        /* internal list root */
 static struct dir_entry_list *arch_list = &arch_list_root;
 static pthread_attr_t thread_attr;
 static unsigned int rar2_ticks;
-static int fs_terminated = 0;
 static int warmup_cancelled = 0;
 static int fs_loop = 0;
 static char *fs_loop_mp_root = NULL;
@@ -163,18 +201,51 @@ static size_t fs_loop_mp_base_len = 0;
 static struct stat fs_loop_mp_stat;
 static int64_t blkdev_size = -1;
 static mode_t umask_ = 0022;
-static volatile int warmup_threads = 0;
+static volatile int warmup_active = 0;
+static void *warmup_pool = NULL;
+static size_t warmup_src_len = 0;
+static struct {
+        unsigned int dirs_found;
+        unsigned int dirs_synced;
+        unsigned int backoffs;
+} warmup_progress;
 static pthread_mutex_t warmup_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t warmup_cond = PTHREAD_COND_INITIALIZER;
 static char *src_path_full = NULL;
+static size_t head_sz = 0;
+static void *bg_pool = NULL;
+static int head_pending = 0;
+static int bg_cancelled = 0;
+static pthread_mutex_t head_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Listing statistics */
+#define LIST_LIBUNRAR   0
+#define LIST_NATIVE     1
+#define LIST_QUICK_OPEN 2
+struct list_stats {
+        unsigned long archives;
+        unsigned long long headers;
+        unsigned long long usec;
+};
+static struct list_stats list_stats[3];
+static pthread_mutex_t list_stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define P_ALIGN_(a) (((a)+page_size_)&~(page_size_-1))
 
-static int extract_rar(char *arch, const char *file, void *arg);
+#define TV_DIFF_US(t2, t1) \
+        (((int64_t)(t2).tv_sec - (t1).tv_sec) * 1000000 + \
+                ((t2).tv_usec - (t1).tv_usec))
+
+static int extract_rar(char *arch, const char *file, void *arg, int threads,
+                       off_t skip);
+static void solid_decode(char *arch, int sock, int threads);
 static int get_vformat(const char *s, int t, int *l, int *p);
 static int CALLBACK list_callback_noswitch(UINT, LPARAM UserData, LPARAM, LPARAM);
 static int CALLBACK list_callback(UINT, LPARAM UserData, LPARAM, LPARAM);
-static void *warmup_task(void *data);
+static void warmup_start();
+static void __warmup_fg_update(const struct timeval *t1);
+static int __admit_try();
+static void __admit_put();
 
 struct eof_cb_arg {
         off_t toff;
@@ -188,10 +259,12 @@ struct extract_cb_arg {
         char *arch;
         void *arg;
         int dry_run;
+        off_t skip;             /* bytes to drop before writing */
 };
 
 static int extract_index(const char *, const struct filecache_entry *, off_t);
 static int preload_index(struct iob *, const char *);
+static int stream_start(struct io_context *, const char *, off_t);
 
 #if RARVER_MAJOR > 4
 static const char *file_cmd[] = {
@@ -204,6 +277,11 @@ static const char *file_cmd[] = {
 struct rar2fs_mount_opts {
      char *locale;
      int warmup;
+     int warmup_rate;
+     int warmup_io;
+     int warmup_cpu;
+     int qos;
+     int qos_client;
 };
 
 #define RAR2FS_MOUNT_OPT(t, p, v) \
@@ -307,6 +385,49 @@ static int get_seek_length(char *rar)
         return OPT_INT(OPT_KEY_SEEK_LENGTH, 0);
 }
 
+/*!
+ *****************************************************************************
+ * Number of RAR5 unpack threads for a stream placed in CPU |group|, or -1
+ * to use the library default. The configured value is an upper limit
+ * that is reduced to the fair share of the extraction CPUs. A value of 0
+ * means the fair share.
+ ****************************************************************************/
+static int get_unpack_threads(char *rar, int group)
+{
+        int threads = -1;
+        int share;
+
+        if (rar) {
+                char *s = OPT_STR(OPT_KEY_SRC, 0);
+
+                if (strstr(rar, s))
+                        rar += strlen(s);
+                threads = rarconfig_getprop(int, rar,
+                                            RAR_UNPACK_THREADS_PROP);
+                if (threads < 0)
+                        threads = rarconfig_getprop(int, basename(rar),
+                                                    RAR_UNPACK_THREADS_PROP);
+        }
+        if (threads < 0) {
+                if (!OPT_SET(OPT_KEY_UNPACK_THREADS))
+                        return -1;
+                threads = OPT_INT(OPT_KEY_UNPACK_THREADS, 0);
+        }
+
+        share = affinity_share(group);
+        if (share < 0) {
+                struct qos_stats st;
+                /* Streams already open plus this one */
+                share = affinity_n_io() / (qos_get_stats(NULL, &st) + 1);
+                if (share < 1)
+                        share = 1;
+        }
+        if (!threads || threads > share)
+                threads = share;
+        printd(3, "Using %d unpack thread(s)\n", threads);
+        return threads;
+}
+
 /*!
  *****************************************************************************
  *
@@ -340,12 +461,10 @@ __attribute__((visibility("hidden")))
 #endif
 void __handle_sigusr1()
 {
-        pthread_t t;
-
         if (mount_type == MOUNT_FOLDER && rar2fs_mount_opts.warmup > 0) {
                 pthread_mutex_lock(&warmup_lock);
                 warmup_cancelled = 1;
-                while (warmup_threads)
+                while (warmup_active)
                         pthread_cond_wait(&warmup_cond, &warmup_lock);
                 pthread_mutex_unlock(&warmup_lock);
                 warmup_cancelled = 0;
@@ -356,7 +475,7 @@ void __handle_sigusr1()
         pthread_rwlock_unlock(&file_access_lock);
         __dircache_invalidate(NULL);
         if (mount_type == MOUNT_FOLDER && rar2fs_mount_opts.warmup > 0)
-                pthread_create(&t, NULL, warmup_task, NULL);
+                warmup_start();
 }
 
 /*!
@@ -368,6 +487,7 @@ __attribute__((visibility("hidden")))
 #endif
 void __handle_sighup()
 {
+        arccache_invalidate(NULL);
         rarconfig_destroy();
         rarconfig_init(OPT_STR(OPT_KEY_SRC, 0),
                        OPT_STR(OPT_KEY_CONFIG, 0));
@@ -398,8 +518,8 @@ static int __wake_thread(struct io_context *op, int req)
                         pthread_cond_wait(&op->rd_req_cond, &op->rd_req_mutex);
         }
         op->rd_req = req;
-        pthread_cond_signal(&op->rd_req_cond);
         pthread_mutex_unlock(&op->rd_req_mutex);
+        ioloop_wake(op->ioh);
         return 0;
 }
 
@@ -445,10 +565,16 @@ static inline int is_nnn_vol(const char *name)
                         !strcasecmp((s)+(strlen(s)-4), ".cbr"))
 #define IS_RXX(s) (is_rxx_vol(s))
 #define IS_NNN(s) (is_nnn_vol(s))
+#define IS_HEAD(s) (head_sz && (!OPT_CNT(OPT_KEY_HEAD_CACHE_EXT) || \
+                        optdb_find(OPT_KEY_HEAD_CACHE_EXT, (char *)(s))))
 
 #define VTYPE(flags) \
         ((flags & ROADF_NEWNUMBERING) ? 1 : 0)
 
+/* Volume naming scheme passed to the archive cache, -1 if not multi-part */
+#define DRY_RUN_VTYPE(e) \
+        ((e)->flags.multipart ? (e)->vtype : -1)
+
 /*!
  *****************************************************************************
  *
@@ -457,11 +583,13 @@ static inline int is_nnn_vol(const char *name)
 #define prop_type_ wchar
 #define prop_alloc_type_ wchar_t
 #define prop_memcpy_ wmemcpy
+#define prop_strlen_ wcslen
 static wchar_t *get_password(const char *file, wchar_t *buf, size_t len)
 #else
 #define prop_type_ char
 #define prop_alloc_type_ char
 #define prop_memcpy_ memcpy
+#define prop_strlen_ strlen
 static char *get_password(const char *file, char *buf, size_t len)
 #endif
 {
@@ -472,11 +600,15 @@ static char *get_password(const char *file, char *buf, size_t len)
         char *rar;
         char *tmp;
         char *s;
+        char *pwd_file = NULL;
         const prop_alloc_type_ *password;
 
         if (!file)
                 return NULL;
 
+        if (arccache_get_password(file, buf, len * sizeof(*buf)))
+                return buf;
+
         rar = strdup(file);
         tmp = rar;
         s = OPT_STR(OPT_KEY_SRC, 0);
@@ -488,14 +620,14 @@ static char *get_password(const char *file, char *buf, size_t len)
         if (password) {
                 prop_memcpy_(buf, password, len);
                 free(tmp);
-                return buf;
+                goto out;
         }
         password = rarconfig_getprop(prop_type_, basename(rar),
                                 RAR_PASSWORD_PROP);
         if (password) {
                 prop_memcpy_(buf, password, len);
                 free(tmp);
-                return buf;
+                goto out;
         }
         free(tmp);
 
@@ -531,7 +663,12 @@ static char *get_password(const char *file, char *buf, size_t len)
                                 free(tmp1);
                                 free(tmp2);
                                 fp = fopen(F, "r");
-                                free(F);
+                                if (fp)
+                                        pwd_file = F;
+                                else
+                                        free(F);
+                        } else {
+                                pwd_file = strdup(F);
                         }
                         if (fp) {
 #if RARVER_MAJOR > 4 || ( RARVER_MAJOR == 4 && RARVER_MINOR >= 20 )
@@ -547,7 +684,7 @@ static char *get_password(const char *file, char *buf, size_t len)
                                 fclose(fp);
                                 free(f[0]);
                                 free(f[1]);
-                                return buf;
+                                goto out;
                         }
                 }
         }
@@ -556,11 +693,22 @@ static char *get_password(const char *file, char *buf, size_t len)
         free(f[1]);
 
         return NULL;
+
+out:
+        /* Cache the result to avoid repeated look-ups in the configuration
+         * and file system each time libunrar asks for the password. */
+        if (buf) {
+                len = prop_strlen_(buf) + 1;
+                arccache_set_password(file, buf, len * sizeof(*buf), pwd_file);
+        }
+        free(pwd_file);
+        return buf;
 }
 
 #undef prop_type_
 #undef prop_alloc_type_
 #undef prop_memcpy_
+#undef prop_strlen_
 
 /*!
  *****************************************************************************
@@ -703,21 +851,33 @@ static int __stop_child(pid_t pid)
  *****************************************************************************
  *
  ****************************************************************************/
-static FILE *popen_(struct filecache_entry *entry_p, pid_t *cpid)
+static int popen_(struct filecache_entry *entry_p, pid_t *cpid, int group)
 {
         int fd = -1;
         int pfd[2] = {-1,};
+        int threads = get_unpack_threads(entry_p->rar_p, group);
 
         pid_t pid;
         int ret;
 
         /* For folder mounts we need to perform an additional dummy
          * extraction attempt to avoid feeding the file descriptor
-         * with garbage data in case of wrong password or CRC errors. */
+         * with garbage data in case of wrong password or CRC errors.
+         * The verdict is kept per archive version so that it survives
+         * cache invalidation. Only the flag of |entry_p| is updated since
+         * it is a private copy, the caller is responsible for publishing
+         * it to the cache entry. */
         if (!entry_p->flags.dry_run_done && mount_type == MOUNT_FOLDER) {
-                ret = extract_rar(entry_p->rar_p, entry_p->file_p, NULL);
-                if (ret && ret != ERAR_UNKNOWN)
-                        goto error;
+                if (!arccache_dry_run_done(entry_p->rar_p, entry_p->file_p,
+                                           DRY_RUN_VTYPE(entry_p))) {
+                        ret = extract_rar(entry_p->rar_p, entry_p->file_p,
+                                          NULL, -1, 0);
+                        if (ret && ret != ERAR_UNKNOWN)
+                                goto error;
+                        arccache_set_dry_run_done(entry_p->rar_p,
+                                                  entry_p->file_p,
+                                                  DRY_RUN_VTYPE(entry_p));
+                }
                 entry_p->flags.dry_run_done = 1;
         }
 
@@ -729,9 +889,10 @@ static FILE *popen_(struct filecache_entry *entry_p, pid_t *cpid)
         pid = fork();
         if (pid == 0) {
                 setpgid(getpid(), 0);
+                affinity_bind_group(group);
                 close(pfd[0]);  /* Close unused read end */
                 ret = extract_rar(entry_p->rar_p, entry_p->file_p,
-                                  (void *)(uintptr_t)pfd[1]);
+                                  (void *)(uintptr_t)pfd[1], threads, 0);
                 close(pfd[1]);
                 _exit(ret);
         } else if (pid < 0) {
@@ -742,7 +903,9 @@ static FILE *popen_(struct filecache_entry *entry_p, pid_t *cpid)
         /* This is the parent process. */
         close(pfd[1]);          /* Close unused write end */
         *cpid = pid;
-        return fdopen(pfd[0], "r");
+        /* Served by the I/O threads, which must never block */
+        (void)fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+        return pfd[0];
 
 error:
         if (fd >= 0)
@@ -752,17 +915,292 @@ error:
         if (pfd[1] >= 0)
                 close(pfd[1]);
 
+        return -1;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int pclose_(int fd, pid_t pid)
+{
+        close(fd);
+        /* A shared solid decoder is not owned by the stream */
+        return pid ? __stop_child(pid) : 0;
+}
+
+/* Seconds before an unused solid decoder is stopped */
+#define SOLID_IDLE_TMO 60
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* One long-lived decoder per solid archive */
+struct solid_dec {
+        char *arch;
+        int sock;
+        time_t last;
+        unsigned int outstanding;       /* requests not yet completed */
+        struct solid_dec *next;
+};
+
+static struct solid_dec *solid_decs = NULL;
+static pthread_mutex_t solid_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*!
+ *****************************************************************************
+ * Pass request for |file| to decoder. The decoder writes the file data
+ * to |fd| and closes it when done. A NULL |file| asks the decoder to
+ * terminate once all pending requests are served.
+ ****************************************************************************/
+static int __solid_send(int sock, const char *file, int fd)
+{
+        uint32_t len = file ? strlen(file) : 0;
+        struct iovec iov[2];
+        struct msghdr msg;
+        union {
+                struct cmsghdr hdr;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } cmsg;
+
+        memset(&msg, 0, sizeof(msg));
+        iov[0].iov_base = &len;
+        iov[0].iov_len = sizeof(len);
+        iov[1].iov_base = (void *)file;
+        iov[1].iov_len = len;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = len ? 2 : 1;
+        if (fd != -1) {
+                memset(&cmsg, 0, sizeof(cmsg));
+                msg.msg_control = cmsg.buf;
+                msg.msg_controllen = sizeof(cmsg.buf);
+                cmsg.hdr.cmsg_level = SOL_SOCKET;
+                cmsg.hdr.cmsg_type = SCM_RIGHTS;
+                cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+        }
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)(sizeof(len) + len))
+                return -1;
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __solid_stop(struct solid_dec *s)
+{
+        printd(3, "Stopping solid decoder for %s\n", s->arch);
+        (void)__solid_send(s->sock, NULL, -1);
+        close(s->sock);
+        free(s->arch);
+        free(s);
+}
+
+/*!
+ *****************************************************************************
+ * The decoder outlives the streams that were open when it was forked.
+ * Any pipe ends it inherited would keep those streams from seeing EOF.
+ ****************************************************************************/
+static void __solid_close_fds(int keep)
+{
+        DIR *dp = opendir("/proc/self/fd");
+        long max;
+        int fd;
+
+        if (dp) {
+                struct dirent *ent;
+                while ((ent = readdir(dp))) {
+                        fd = atoi(ent->d_name);
+                        if (fd > 2 && fd != keep && fd != dirfd(dp))
+                                close(fd);
+                }
+                closedir(dp);
+                return;
+        }
+        max = sysconf(_SC_OPEN_MAX);
+        if (max < 0 || max > 65536)
+                max = 65536;
+        for (fd = 3; fd < max; fd++) {
+                if (fd != keep)
+                        close(fd);
+        }
+}
+
+/*!
+ *****************************************************************************
+ * Start decoder for |arch|. The decoder is detached from rar2fs (double
+ * fork) so that it is reaped by init whenever it decides to terminate.
+ ****************************************************************************/
+static struct solid_dec *__solid_start(char *arch)
+{
+        struct solid_dec *s;
+        int threads = get_unpack_threads(arch, -1);
+        int sv[2];
+        pid_t pid;
+
+        s = malloc(sizeof(struct solid_dec));
+        if (!s)
+                return NULL;
+        s->arch = strdup(arch);
+        if (!s->arch)
+                goto error;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+                perror("socketpair");
+                goto error;
+        }
+
+        pid = fork();
+        if (pid == 0) {
+                close(sv[0]);
+                if (fork() == 0) {
+                        setpgid(getpid(), 0);
+                        __solid_close_fds(sv[1]);
+                        solid_decode(arch, sv[1], threads);
+                }
+                _exit(0);
+        }
+        close(sv[1]);
+        if (pid < 0) {
+                close(sv[0]);
+                goto error;
+        }
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+                ;
+        printd(3, "Started solid decoder for %s\n", arch);
+        s->sock = sv[0];
+        s->outstanding = 0;
+        return s;
+
+error:
+        free(s->arch);
+        free(s);
         return NULL;
 }
 
+/*!
+ *****************************************************************************
+ * Collect the completion notices sent by the decoder, one byte per
+ * request. Returns non-zero if it is still working on a request.
+ ****************************************************************************/
+static int __solid_busy(struct solid_dec *s)
+{
+        char buf[64];
+        ssize_t n;
+
+        while (s->outstanding) {
+                n = recv(s->sock, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n == 0) {
+                        /* Decoder is gone, the next request restarts it */
+                        s->outstanding = 0;
+                        break;
+                }
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+                s->outstanding -= (unsigned int)n > s->outstanding ?
+                                        s->outstanding : (unsigned int)n;
+        }
+        return s->outstanding != 0;
+}
+
+/*!
+ *****************************************************************************
+ * Open a stream for a member of a solid archive. The stream is fed by the
+ * decoder of the archive, which continues from where the previous request
+ * left off if the member is found further ahead.
+ *   The decoder writes to one reader at a time and blocks until that
+ * reader has drained its pipe. A reader that is waiting for a member
+ * queued behind another would then depend on the first reader making
+ * progress, which it might never do (e.g. a player opening a subtitle
+ * before reading the video). So if the decoder is busy -1 is returned
+ * and the caller falls back to a private child for this open.
+ ****************************************************************************/
+static int popen_solid_(struct filecache_entry *entry_p)
+{
+        struct solid_dec *s = NULL;
+        struct solid_dec **pp;
+        time_t now = time(NULL);
+        int pfd[2] = {-1, -1};
+        int retry = 1;
+
+        pthread_mutex_lock(&solid_lock);
+        pp = &solid_decs;
+        while (*pp) {
+                struct solid_dec *t = *pp;
+                if (!s && !strcmp(t->arch, entry_p->rar_p)) {
+                        *pp = t->next;
+                        s = t;
+                } else if (now - t->last > SOLID_IDLE_TMO) {
+                        *pp = t->next;
+                        __solid_stop(t);
+                } else {
+                        pp = &t->next;
+                }
+        }
+        if (s && __solid_busy(s)) {
+                printd(3, "Solid decoder for %s is busy\n", s->arch);
+                s->next = solid_decs;
+                solid_decs = s;
+                pthread_mutex_unlock(&solid_lock);
+                return -1;
+        }
+        if (!s) {
+                s = __solid_start(entry_p->rar_p);
+                retry = 0;
+        }
+        /* The pipe must not be created before the decoder is forked */
+        if (s && pipe(pfd) == -1) {
+                perror("pipe");
+                __solid_stop(s);
+                s = NULL;
+        }
+        while (s && __solid_send(s->sock, entry_p->file_p, pfd[1])) {
+                /* The decoder might have terminated on its own */
+                __solid_stop(s);
+                s = NULL;
+                close(pfd[0]);
+                close(pfd[1]);
+                if (!retry--)
+                        break;
+                s = __solid_start(entry_p->rar_p);
+                if (s && pipe(pfd) == -1) {
+                        __solid_stop(s);
+                        s = NULL;
+                }
+        }
+        if (s) {
+                s->last = now;
+                ++s->outstanding;
+                s->next = solid_decs;
+                solid_decs = s;
+                close(pfd[1]);  /* The decoder has its own copy */
+        }
+        pthread_mutex_unlock(&solid_lock);
+
+        if (!s)
+                return -1;
+        /* Served by the I/O threads, which must never block */
+        (void)fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+        return pfd[0];
+}
+
 /*!
  *****************************************************************************
  *
  ****************************************************************************/
-static int pclose_(FILE *fp, pid_t pid)
+static void solid_destroy()
 {
-        fclose(fp);
-        return __stop_child(pid);
+        pthread_mutex_lock(&solid_lock);
+        while (solid_decs) {
+                struct solid_dec *s = solid_decs;
+                solid_decs = s->next;
+                __solid_stop(s);
+        }
+        pthread_mutex_unlock(&solid_lock);
 }
 
 /* Size of file in first volume number in which it exists */
@@ -1117,6 +1555,100 @@ static void __get_vol_and_chunk_raw(struct io_context *op, off_t offset,
                 VOL_NEXT_SZ - ((offset - VOL_FIRST_SZ) % VOL_NEXT_SZ);
 }
 
+/*!
+ ****************************************************************************
+ * Open callback for the raw I/O layer, |vol| is relative to the volume in
+ * which the file starts.
+ ****************************************************************************/
+static int __rawio_open_vol(void *ctx, int vol)
+{
+        struct io_context *op = ctx;
+        char *tmp;
+        int fd;
+
+        if (!op->entry_p->flags.multipart)
+                return open(op->entry_p->rar_p, O_RDONLY);
+
+        tmp = get_vname(op->entry_p->vtype, op->entry_p->rar_p,
+                        vol + op->entry_p->vno_base, op->entry_p->vlen,
+                        op->entry_p->vpos);
+        if (!tmp) {
+                errno = EINVAL;
+                return -1;
+        }
+        printd(3, "Opening %s\n", tmp);
+        fd = open(tmp, O_RDONLY);
+        if (fd == -1)
+                perror("open");
+        free(tmp);
+        return fd;
+}
+
+/*!
+ ****************************************************************************
+ * Map |size| bytes at |offset| in the file to a location in a volume file.
+ ****************************************************************************/
+static void __get_raw_seg(struct io_context *op, off_t offset, size_t size,
+                struct rawio_seg *seg)
+{
+        size_t chunk;
+
+        if (op->entry_p->flags.multipart) {
+                __get_vol_and_chunk_raw(op, offset, &seg->vol, &chunk);
+                seg->off = VOL_REAL_SZ(seg->vol) - chunk;
+                printd(3, "SEEK src_off = %" PRIu64 ", "
+                                "VOL_REAL_SZ = %" PRIu64 "\n",
+                                seg->off, VOL_REAL_SZ(seg->vol));
+                seg->len = size < chunk ? size : chunk;
+        } else {
+                seg->vol = 0;
+                seg->off = offset + op->entry_p->offset;
+                seg->len = size;
+        }
+}
+
+#define RAW_SEGS_MAX 4
+#define RAW_LEAD_SZ (4 * 1024 * 1024)
+
+/*!
+ ****************************************************************************
+ * Describe where the data following |end| is located. If the current
+ * volume is about to run out, also point out the start of the next one
+ * so that it can be opened and read ahead before the boundary is hit.
+ ****************************************************************************/
+static int __get_raw_next(struct io_context *op, off_t end, size_t req_size,
+                struct rawio_seg *next)
+{
+        off_t st_size = op->entry_p->stat.st_size;
+        size_t left;
+        int n = 0;
+
+        if (end >= st_size)
+                return 0;
+        left = st_size - end;
+        __get_raw_seg(op, end, left < req_size ? left : req_size, &next[n]);
+        end += next[n].len;
+        left -= next[n].len;
+        ++n;
+
+        if (op->entry_p->flags.multipart && left) {
+                struct rawio_seg tmp;
+
+                /* Distance to the next volume boundary */
+                __get_raw_seg(op, end, left, &tmp);
+                if (tmp.vol == next[0].vol) {
+                        if (tmp.len > RAW_LEAD_SZ || tmp.len == left)
+                                return n;
+                        end += tmp.len;
+                        left -= tmp.len;
+                }
+                __get_raw_seg(op, end, left < RAW_LEAD_SZ ?
+                              left : RAW_LEAD_SZ, &next[n]);
+                ++n;
+        }
+        return n;
+}
+
 /*!
  ****************************************************************************
  *
@@ -1124,12 +1656,12 @@ static void __get_vol_and_chunk_raw(struct io_context *op, off_t offset,
 static int lread_raw(char *buf, size_t size, off_t offset,
                 struct fuse_file_info *fi)
 {
-        FILE *fp = NULL;
-        ssize_t n = 0;
         struct io_context *op = FH_TOCONTEXT(fi->fh);
-        size_t chunk;
+        struct rawio_seg segs[RAW_SEGS_MAX];
+        struct rawio_seg next[2];
+        size_t req_size = size;
+        ssize_t n;
         int tot = 0;
-        int force_seek = 0;
 
         pthread_mutex_lock(&op->raw_read_mutex);
 
@@ -1161,148 +1693,535 @@ static int lread_raw(char *buf, size_t size, off_t offset,
         }
 
         while (size) {
-                off_t src_off = 0;
-                struct volume_handle *vh = NULL;
-                if (op->entry_p->flags.multipart) {
-                        int vol;
-
-                        __get_vol_and_chunk_raw(op, offset, &vol, &chunk);
-
-                        /* keep current open file */
-                        if (vol != op->vno) {
-                                /* close/open */
-                                op->vno = vol;
-                                char *tmp =
-                                    get_vname(op->entry_p->vtype,
-                                                op->entry_p->rar_p,
-                                                op->vno + op->entry_p->vno_base,
-                                                op->entry_p->vlen,
-                                                op->entry_p->vpos);
-                                if (tmp) {
-                                        printd(3, "Opening %s\n", tmp);
-                                        fp = fopen(tmp, "r");
-                                        free(tmp);
-                                        if (fp == NULL) {
-                                                perror("open");
-                                                goto read_error;
-                                        }
-                                        fclose(op->fp);
-                                        op->fp = fp;
-                                        force_seek = 1;
-                                } else {
-                                        pthread_mutex_unlock(&op->raw_read_mutex);
-                                        return -EINVAL;
-                                }
-                        } else {
-                                fp = op->fp;
-                        }
-
-                        if (force_seek || offset != op->pos) {
-                                src_off = VOL_REAL_SZ(vol) - chunk;
-                                printd(3, "SEEK src_off = %" PRIu64 ", "
-                                                "VOL_REAL_SZ = %" PRIu64 "\n",
-                                                src_off, VOL_REAL_SZ(vol));
-                                if (fseeko(fp, src_off, SEEK_SET))
-                                        goto read_error;
-                                force_seek = 0;
-                        }
-                        printd(3, "size = %zu, chunk = %zu\n", size, chunk);
-                        chunk = size < chunk ? size : chunk;
-                } else {
-                        fp = op->fp;
-                        chunk = size;
-                        if (!offset || offset != op->pos) {
-                                src_off = offset + op->entry_p->offset;
-                                printd(3, "SEEK src_off = %" PRIu64 "\n", src_off);
-                                if (fseeko(fp, src_off, SEEK_SET))
-                                        goto read_error;
-                        }
+                size_t seg_tot = 0;
+                off_t end;
+                int i = 0;
+                int j;
+
+                /* Split request at volume boundaries */
+                while (size > seg_tot && i < RAW_SEGS_MAX) {
+                        __get_raw_seg(op, offset + seg_tot, size - seg_tot,
+                                      &segs[i]);
+                        segs[i].buf = buf + seg_tot;
+                        seg_tot += segs[i].len;
+                        ++i;
                 }
-                n = fread(buf, 1, chunk, fp);
-                if (ferror(fp))
+
+                /* Let the I/O layer know where the next request is likely
+                 * to be located. */
+                end = offset + seg_tot;
+                j = __get_raw_next(op, end, req_size, next);
+
+                n = rawio_read(op->rio, offset, segs, i, next, j);
+                if (n < 0)
                         goto read_error;
-                printd(3, "Read %zu bytes from vol=%d, base=%d\n", n, op->vno,
-                       op->entry_p->vno_base);
-                if (n != (ssize_t)chunk)
-                        size = n;
+                printd(3, "Read %zd bytes from vol=%d, base=%d\n", n,
+                       segs[0].vol, op->entry_p->vno_base);
 
                 size -= n;
                 offset += n;
                 buf += n;
                 tot += n;
-                op->pos = offset;
-                if (vh)
-                        vh->pos += n;
+                if ((size_t)n != seg_tot)
+                        break;
         }
         pthread_mutex_unlock(&op->raw_read_mutex);
         return tot;
 
 read_error:
-        if (fp)
-                clearerr(fp);
         pthread_mutex_unlock(&op->raw_read_mutex);
         memset(buf, 0, size);
         return tot + size;
 }
 
+#if FUSE_MAJOR_VERSION > 2 || (FUSE_MAJOR_VERSION == 2 && FUSE_MINOR_VERSION >= 9)
+
+/*
+ * Volume file descriptors handed over to FUSE by the last read_buf() call
+ * of a thread. FUSE is done with them once the same thread gets to serve
+ * another request, at which point they are closed. Private duplicates
+ * are used since the descriptors of the raw I/O handle might be closed
+ * by a concurrent read before FUSE has copied the data. A thread that
+ * goes idle would keep its last descriptors open, pinning volumes that
+ * might since have been removed or replaced, so they are also closed
+ * when the file they were read from is released.
+ */
+struct raw_fds {
+        int n;
+        int max;
+        struct {
+                int fd;
+                const void *owner;
+        } *fds;
+        struct raw_fds *next;
+};
+
+static struct raw_fds *raw_fds_list = NULL;
+static pthread_mutex_t raw_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t raw_fds_key;
+static pthread_once_t raw_fds_once = PTHREAD_ONCE_INIT;
+
+/*!
+ *****************************************************************************
+ * Caller must hold raw_fds_lock.
+ ****************************************************************************/
+static void __raw_fds_close(struct raw_fds *r)
+{
+        while (r->n)
+                close(r->fds[--r->n].fd);
+}
+
 /*!
  *****************************************************************************
  *
  ****************************************************************************/
-static int lread_info(char *buf, size_t size, off_t offset,
-                struct fuse_file_info *fi)
+static void __raw_fds_free(void *data)
 {
-        /* Only allow reading from start of file in 'cat'-like fashion */
-        if (!offset) {
-            struct RARWcb *wcb = FH_TOBUF(fi->fh);
-            int c = wide_to_utf8(wcb->data, buf, size);
-            if (c > 0)
-                    return c;
+        struct raw_fds *r = data;
+        struct raw_fds **pp;
+
+        pthread_mutex_lock(&raw_fds_lock);
+        for (pp = &raw_fds_list; *pp; pp = &(*pp)->next) {
+                if (*pp == r) {
+                        *pp = r->next;
+                        break;
+                }
         }
-        /* Nothing to output (EOF) */
-        return 0;
+        __raw_fds_close(r);
+        pthread_mutex_unlock(&raw_fds_lock);
+        free(r->fds);
+        free(r);
 }
 
 /*!
  *****************************************************************************
  *
  ****************************************************************************/
-static int sync_thread_read(struct io_context* op)
+static void __raw_fds_init()
 {
-        if (__wake_thread(op, RD_SYNC_READ))
-                return -errno;
-        if (__wait_thread(op))
-                return -errno;
-        return 0;
+        (void)pthread_key_create(&raw_fds_key, __raw_fds_free);
 }
 
-static int sync_thread_noread(struct io_context* op)
+/*!
+ *****************************************************************************
+ * Get the descriptor list of the calling thread, emptied.
+ ****************************************************************************/
+static struct raw_fds *__raw_fds_get()
 {
-        if (__wake_thread(op, RD_SYNC_NOREAD))
-                return -errno;
-        if (__wait_thread(op))
-                return -errno;
-        return 0;
+        struct raw_fds *r;
+
+        pthread_once(&raw_fds_once, __raw_fds_init);
+        r = pthread_getspecific(raw_fds_key);
+        if (!r) {
+                r = calloc(1, sizeof(struct raw_fds));
+                if (!r || pthread_setspecific(raw_fds_key, r)) {
+                        free(r);
+                        return NULL;
+                }
+                pthread_mutex_lock(&raw_fds_lock);
+                r->next = raw_fds_list;
+                raw_fds_list = r;
+                pthread_mutex_unlock(&raw_fds_lock);
+        }
+        pthread_mutex_lock(&raw_fds_lock);
+        __raw_fds_close(r);
+        pthread_mutex_unlock(&raw_fds_lock);
+        return r;
 }
 
-
 /*!
  *****************************************************************************
- *
+ * Add |n| descriptors read from |owner| to the list of the calling thread.
  ****************************************************************************/
-static int lread_rar_idx(char *buf, size_t size, off_t offset,
-                struct io_context *op)
+static int __raw_fds_add(struct raw_fds *r, const int *fds, int n,
+                const void *owner)
 {
-        int res;
-        uint64_t o = ntoh64(op->buf->idx.data_p->head.offset);
-        uint64_t s = ntoh64(op->buf->idx.data_p->head.size);
-        off_t off = (offset - o);
-
-        if (off >= (off_t)s)
-                return -EIO;
+        int res = 0;
 
-        size = (off + size) > s
-                ? size - ((off + size) - s)
+        pthread_mutex_lock(&raw_fds_lock);
+        if (r->n + n > r->max) {
+                void *tmp = realloc(r->fds, (r->n + n + 4) *
+                                    sizeof(*r->fds));
+                if (!tmp) {
+                        res = -1;
+                        goto out;
+                }
+                r->fds = tmp;
+                r->max = r->n + n + 4;
+        }
+        while (n--) {
+                r->fds[r->n].fd = *fds++;
+                r->fds[r->n].owner = owner;
+                ++r->n;
+        }
+out:
+        pthread_mutex_unlock(&raw_fds_lock);
+        return res;
+}
+
+/*!
+ *****************************************************************************
+ * Close any descriptors still held on behalf of |owner|. Called when the
+ * file is released, at which point FUSE has replied to all its reads.
+ ****************************************************************************/
+static void raw_fds_release(const void *owner)
+{
+        struct raw_fds *r;
+        int i;
+        int j;
+
+        pthread_mutex_lock(&raw_fds_lock);
+        for (r = raw_fds_list; r; r = r->next) {
+                for (i = 0, j = 0; i < r->n; i++) {
+                        if (r->fds[i].owner == owner)
+                                close(r->fds[i].fd);
+                        else
+                                r->fds[j++] = r->fds[i];
+                }
+                r->n = j;
+        }
+        pthread_mutex_unlock(&raw_fds_lock);
+}
+
+/*!
+ *****************************************************************************
+ * Map a read request onto the volume files. Instead of copying the data
+ * a buffer vector referring to the volume files is returned, which FUSE
+ * can splice directly to the kernel. Read-ahead of the following data,
+ * including the start of the next volume, and release of consumed
+ * volumes are handled by the raw I/O layer as for lread_raw().
+ ****************************************************************************/
+static int lread_raw_buf(struct fuse_bufvec **bufp, size_t size, off_t offset,
+                struct fuse_file_info *fi)
+{
+        struct io_context *op = FH_TOCONTEXT(fi->fh);
+        struct raw_fds *r = __raw_fds_get();
+        struct rawio_seg segs[RAW_SEGS_MAX];
+        struct rawio_seg next[2];
+        int fds[RAW_SEGS_MAX];
+        struct fuse_bufvec *src;
+        size_t req_size = size;
+        size_t tot = 0;
+        int n = 0;
+        int i;
+
+        if (!r)
+                return -ENOMEM;
+        src = malloc(sizeof(struct fuse_bufvec) +
+                     (RAW_SEGS_MAX - 1) * sizeof(struct fuse_buf));
+        if (!src)
+                return -ENOMEM;
+        *src = FUSE_BUFVEC_INIT(0);
+
+        pthread_mutex_lock(&op->raw_read_mutex);
+
+        op->seq++;
+
+        printd(3, "PID %05d calling %s(), seq = %d, offset=%" PRIu64 "\n",
+               getpid(), __func__, op->seq, offset);
+
+        if ((off_t)(offset + size) >= op->entry_p->stat.st_size) {
+                if (offset > op->entry_p->stat.st_size)
+                        size = 0;       /* EOF */
+                else
+                        size = op->entry_p->stat.st_size - offset;
+        }
+
+        if (op->entry_p->flags.check_atime)
+                check_atime(FH_TOPATH(fi->fh), op->entry_p);
+
+        if (!op->entry_p->flags.vsize_resolved)
+                goto read_error;
+
+        /* Split request at volume boundaries */
+        while (tot < size && n < RAW_SEGS_MAX) {
+                __get_raw_seg(op, offset + tot, size - tot, &segs[n]);
+                if (!segs[n].len)
+                        break;
+                tot += segs[n].len;
+                ++n;
+        }
+        if (n) {
+                i = __get_raw_next(op, offset + tot, req_size, next);
+                if (rawio_map(op->rio, offset, segs, n, fds, next, i))
+                        goto read_error;
+                if (__raw_fds_add(r, fds, n, op)) {
+                        while (n--)
+                                close(fds[n]);
+                        goto read_error;
+                }
+        }
+        for (i = 0; i < n; i++) {
+                src->buf[i].size = segs[i].len;
+                src->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK |
+                                    FUSE_BUF_FD_RETRY;
+                src->buf[i].mem = NULL;
+                src->buf[i].fd = fds[i];
+                src->buf[i].pos = segs[i].off;
+        }
+        if (n)
+                src->count = n;
+
+        pthread_mutex_unlock(&op->raw_read_mutex);
+        *bufp = src;
+        return 0;
+
+read_error:
+        pthread_mutex_unlock(&op->raw_read_mutex);
+        free(src);
+        return -EIO;
+}
+
+#endif
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int lread_info(char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi)
+{
+        /* Only allow reading from start of file in 'cat'-like fashion */
+        if (!offset) {
+            struct RARWcb *wcb = FH_TOBUF(fi->fh);
+            int c = wide_to_utf8(wcb->data, buf, size);
+            if (c > 0)
+                    return c;
+        }
+        /* Nothing to output (EOF) */
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int sync_thread_read(struct io_context* op)
+{
+        if (__wake_thread(op, RD_SYNC_READ))
+                return -errno;
+        if (__wait_thread(op))
+                return -errno;
+        return 0;
+}
+
+static int sync_thread_noread(struct io_context* op)
+{
+        if (__wake_thread(op, RD_SYNC_NOREAD))
+                return -errno;
+        if (__wait_thread(op))
+                return -errno;
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Fill I/O buffer from the calling thread. Caller must have taken control
+ * of the reader using sync_thread_noread().
+ ****************************************************************************/
+static void __fill_sync(struct io_context *op)
+{
+        struct pollfd pfd = {op->pfd, POLLIN, 0};
+        int status;
+
+        for (;;) {
+                (void)iob_write(op->buf, op->pfd, IOB_SAVE_HIST, &status);
+                if (status != IOB_AGAIN)
+                        break;
+                if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                        break;
+        }
+        if (status == IOB_EOF)
+                op->eof = 1;
+}
+
+/* Size of tail stream buffer */
+#define TAIL_SZ (4 * 1024 * 1024)
+
+/* Max time (ms) a read may wait for the tail stream to reach its offset */
+#define TAIL_TMO 5000
+
+/* Lowest decoding rate (bytes/s) assumed for a tail stream. Offsets that
+ * can not be reached within TAIL_TMO at this rate are not even tried. */
+#define TAIL_RATE (64 * 1024 * 1024)
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __tail_close(struct io_context *op)
+{
+        struct tail_stream *t = op->tail;
+
+        if (!t)
+                return;
+        printd(3, "Closing tail stream @ %" PRIu64 "\n", t->base);
+        qos_unregister(t->qos, NULL);
+        (void)pclose_(t->pfd, t->pid);
+        __admit_put();
+        free(t->data);
+        free(t);
+        op->tail = NULL;
+}
+
+/*!
+ *****************************************************************************
+ * Start a second decompression stream of the file, positioned a bit before
+ * |offset|. Everything before that is decoded by the child but never
+ * passed through the pipe. The stream runs in the background and takes
+ * a slot from admission control, it is not started if no slot is free.
+ ****************************************************************************/
+static struct tail_stream *__tail_open(struct io_context *op,
+                const char *path, off_t offset)
+{
+        struct tail_stream *t;
+        int pfd[2] = {-1, -1};
+        int threads;
+        off_t base;
+
+        /* Leave room for reads slightly before the first one */
+        base = offset > TAIL_SZ / 4 ? offset - TAIL_SZ / 4 : 0;
+        base &= ~(off_t)(page_size_ - 1);
+
+        /* Do not decode what can not be delivered in time anyway */
+        if (base > (off_t)TAIL_RATE * TAIL_TMO / 1000) {
+                printd(3, "Tail stream can not reach offset %" PRIu64 "\n",
+                       offset);
+                return NULL;
+        }
+        if (__admit_try())
+                return NULL;
+
+        t = calloc(1, sizeof(struct tail_stream));
+        if (!t) {
+                __admit_put();
+                return NULL;
+        }
+        t->data = malloc(TAIL_SZ);
+        if (!t->data || pipe(pfd) == -1)
+                goto error;
+        threads = get_unpack_threads(op->entry_p->rar_p, op->cpu_group);
+
+        t->pid = fork();
+        if (t->pid == 0) {
+                int ret;
+                setpgid(getpid(), 0);
+                affinity_bind_group(op->cpu_group);
+                close(pfd[0]);
+                ret = extract_rar(op->entry_p->rar_p, op->entry_p->file_p,
+                                  (void *)(uintptr_t)pfd[1], threads, base);
+                close(pfd[1]);
+                _exit(ret);
+        } else if (t->pid < 0) {
+                goto error;
+        }
+        close(pfd[1]);
+        (void)fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+        t->pfd = pfd[0];
+        t->base = base;
+        t->qos = qos_register_bg(path, t->pid);
+        printd(3, "Opened tail stream @ %" PRIu64 "\n", base);
+        return t;
+
+error:
+        if (pfd[0] != -1) {
+                close(pfd[0]);
+                close(pfd[1]);
+        }
+        __admit_put();
+        free(t->data);
+        free(t);
+        return NULL;
+}
+
+/*!
+ *****************************************************************************
+ * Serve a read far ahead of the primary stream from the tail stream,
+ * starting one if needed. Returns number of bytes read or -1 if the data
+ * did not become available in time. The tail stream is kept in the latter
+ * case so that a retry may still succeed.
+ ****************************************************************************/
+static int __tail_read(struct io_context *op, const char *path, char *buf,
+                size_t size, off_t offset)
+{
+        struct tail_stream *t = op->tail;
+        struct pollfd pfd;
+        struct timeval t1, t2;
+        size_t n;
+
+        /* Restart if the request is not reachable from current position */
+        if (t && (offset < t->base ||
+                  offset > (off_t)(t->base + t->len + TAIL_SZ)))
+                __tail_close(op);
+        if (!op->tail) {
+                op->tail = __tail_open(op, path, offset);
+                if (!op->tail)
+                        return -1;
+        }
+        t = op->tail;
+
+        gettimeofday(&t1, NULL);
+        pfd.fd = t->pfd;
+        pfd.events = POLLIN;
+        while ((off_t)(t->base + t->len) < (off_t)(offset + size) && !t->eof) {
+                ssize_t res;
+                int tmo;
+
+                /* Make room, but keep some data before the request */
+                if (t->len == TAIL_SZ) {
+                        off_t keep = offset - TAIL_SZ / 4;
+                        size_t drop = keep > t->base
+                                ? (size_t)(keep - t->base) : TAIL_SZ / 2;
+                        if (drop > t->len)
+                                drop = t->len;
+                        memmove(t->data, t->data + drop, t->len - drop);
+                        t->base += drop;
+                        t->len -= drop;
+                }
+                res = read(t->pfd, t->data + t->len, TAIL_SZ - t->len);
+                if (res > 0) {
+                        t->len += res;
+                        continue;
+                }
+                if (!res || (errno != EAGAIN && errno != EINTR)) {
+                        t->eof = 1;
+                        break;
+                }
+                gettimeofday(&t2, NULL);
+                tmo = TAIL_TMO - (int)(TV_DIFF_US(t2, t1) / 1000);
+                if (tmo <= 0 || !poll(&pfd, 1, tmo)) {
+                        printd(3, "Tail stream not ready for offset %" PRIu64
+                               "\n", offset);
+                        return -1;
+                }
+        }
+        if (offset < t->base || offset >= (off_t)(t->base + t->len))
+                return -1;
+        n = (t->base + t->len) - offset;
+        if (n > size)
+                n = size;
+        memcpy(buf, t->data + (offset - t->base), n);
+        return n;
+}
+
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int lread_rar_idx(char *buf, size_t size, off_t offset,
+                struct io_context *op)
+{
+        int res;
+        uint64_t o = ntoh64(op->buf->idx.data_p->head.offset);
+        uint64_t s = ntoh64(op->buf->idx.data_p->head.size);
+        off_t off = (offset - o);
+
+        if (off >= (off_t)s)
+                return -EIO;
+
+        size = (off + size) > s
+                ? size - ((off + size) - s)
                 : size;
         printd(3, "Copying %zu bytes from preloaded offset @ %" PRIu64 "\n",
                                                 size, offset);
@@ -1386,6 +2305,63 @@ static void dump_buf(int seq, FILE *fp, char *buf, off_t offset, size_t size)
 }
 #endif
 
+/*!
+ *****************************************************************************
+ * Get the identity of |e_p| as recorded by the head cache. Returns 0 on
+ * success.
+ ****************************************************************************/
+static int __head_ident(const struct filecache_entry *e_p,
+                        struct headcache_ident *id)
+{
+        struct stat st;
+
+        if (stat(e_p->rar_p, &st) == -1)
+                return -1;
+        id->arch = e_p->rar_p;
+        id->arch_mtime = st.st_mtime;
+        id->arch_size = st.st_size;
+        id->mtime = e_p->stat.st_mtime;
+        id->size = e_p->stat.st_size;
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Collect the first |head_sz| bytes of a file as they are read from the
+ * stream of |op|. Collection is abandoned as soon as the reads are not
+ * sequential.
+ ****************************************************************************/
+static void __head_fill(struct io_context *op, const char *path,
+                        const char *buf, size_t n, off_t offset)
+{
+        const struct filecache_entry *e_p = op->entry_p;
+        size_t len;
+
+        if (!op->head) {
+                if (offset || op->head_len || e_p->flags.encrypted ||
+                    !IS_HEAD(path) || __head_ident(e_p, &op->head_id) ||
+                    headcache_has(path, &op->head_id))
+                        return;
+                op->head = malloc(head_sz);
+                if (!op->head)
+                        return;
+        }
+        if (offset != (off_t)op->head_len) {
+                free(op->head);
+                op->head = NULL;
+                return;
+        }
+        len = n < head_sz - op->head_len ? n : head_sz - op->head_len;
+        memcpy(op->head + op->head_len, buf, len);
+        op->head_len += len;
+        if (op->head_len == head_sz ||
+            (off_t)op->head_len == e_p->stat.st_size) {
+                headcache_put(path, &op->head_id, op->head, op->head_len);
+                free(op->head);
+                op->head = NULL;
+        }
+}
+
 /*!
  *****************************************************************************
  *
@@ -1395,6 +2371,8 @@ static int lread_rar(char *buf, size_t size, off_t offset,
 {
         int n = 0;
         struct io_context* op = FH_TOCONTEXT(fi->fh);
+        char *head_buf = buf;
+        off_t head_off = offset;
 #ifdef DEBUG_READ
         char *buf_saved = buf;
         off_t offset_saved = offset;
@@ -1415,9 +2393,32 @@ static int lread_rar(char *buf, size_t size, off_t offset,
         if (!size)
                 goto out;
 
+        /* Reads within a cached head of the file need no stream */
+        if (head_sz && (!op->buf || offset < op->pos)) {
+                struct headcache_ident id;
+                if (!__head_ident(op->entry_p, &id)) {
+                        n = headcache_read(FH_TOPATH(fi->fh), &id,
+                                           buf, size, offset);
+                        if (n >= 0)
+                                goto out;
+                        n = 0;
+                }
+        }
+
+        /* Decompression is not started until needed */
+        if (!op->buf) {
+                n = stream_start(op, FH_TOPATH(fi->fh), offset);
+                if (n)
+                        return n;
+        }
+
         if (op->entry_p->flags.check_atime)
                 check_atime(FH_TOPATH(fi->fh), op->entry_p);
 
+        /* The tail stream is of no use once the primary stream gets there */
+        if (op->tail && op->pos >= op->tail->base)
+                __tail_close(op);
+
         /* Check for exception case */
         if (offset != op->pos) {
 check_idx:
@@ -1426,6 +2427,18 @@ check_idx:
                         n = lread_rar_idx(buf, size, offset, op);
                         goto out;
                 }
+                /* Further reads in the region covered by the tail stream */
+                if (op->tail && offset >= op->tail->base &&
+                    (off_t)(offset + size) - op->buf->offset >
+                                (off_t)(IOB_SZ - IOB_HIST_SZ)) {
+                        n = __tail_read(op, FH_TOPATH(fi->fh), buf, size,
+                                        offset);
+                        if (n >= 0) {
+                                op->seq--;      /* pretend it never happened */
+                                goto out;
+                        }
+                        n = 0;
+                }
                 /* Check for backward read */
                 if (offset < op->pos) {
                         printd(3, "seq=%d    history access    offset=%" PRIu64
@@ -1466,7 +2479,9 @@ check_idx:
 
                         /*
                          * If enabled, attempt to extract the index information
-                         * based on the offset. If that fails fall-back to best
+                         * based on the offset. Otherwise serve the read from a
+                         * second decompression stream positioned near the end
+                         * of the file. If that also fails fall-back to best
                          * effort. That is, return all zeros according to size.
                          * In the latter case also force direct I/O since
                          * otherwise the fake data might propagate incorrectly
@@ -1490,6 +2505,11 @@ check_idx:
                                         }
                                 }
                         }
+                        n = __tail_read(op, FH_TOPATH(fi->fh), buf, size,
+                                        offset);
+                        if (n >= 0)
+                                goto out;
+                        n = 0;
                         pthread_rwlock_wrlock(&file_access_lock);
                         e_p = filecache_get(FH_TOPATH(fi->fh));
                         if (e_p)
@@ -1509,8 +2529,12 @@ check_idx:
          */
         if ((off_t)(offset + size) > op->buf->offset) {
                 off_t offset_saved = op->buf->offset;
+                struct timeval t1, t2;
+                gettimeofday(&t1, NULL);
                 if (sync_thread_read(op))
                         return -EIO;
+                gettimeofday(&t2, NULL);
+                qos_underrun(op->qos, TV_DIFF_US(t2, t1));
                 /* If there is still no data assume something went wrong.
                  * I/O buffer might simply be full and cannot receive more
                  * data or otherwise most likely CRC errors or an invalid
@@ -1527,7 +2551,8 @@ check_idx:
                          * likely bogus. We can not blindly take the jump here
                          * since it would render the stream completely useless
                          * for continued playback. If the jump is too far off,
-                         * again fall-back to best effort. Also making sure
+                         * try the tail stream and as a last resort again
+                         * fall-back to best effort. Also making sure
                          * direct I/O is forced from now on to not cause any
                          * fake data to propagate in sub-sequent reads.
                          * This case is very likely for multi-part AVI 2.0.
@@ -1540,6 +2565,11 @@ check_idx:
                                                 op->seq, offset, size,
                                                 op->buf->offset);
                                 op->seq--;      /* pretend it never happened */
+                                n = __tail_read(op, FH_TOPATH(fi->fh),
+                                                buf, size, offset);
+                                if (n >= 0)
+                                        goto out;
+                                n = 0;
                                 pthread_rwlock_wrlock(&file_access_lock);
                                 e_p = filecache_get(FH_TOPATH(fi->fh));
                                 if (e_p)
@@ -1555,24 +2585,23 @@ check_idx:
                 /* Take control of reader thread */
                 if (sync_thread_noread(op))
                         return -EIO;
-                if (!feof(op->fp) && offset > op->buf->offset) {
+                if (!op->eof && offset > op->buf->offset) {
                         /* consume buffer */
                         op->pos += op->buf->used;
                         op->buf->ri = op->buf->wi;
                         op->buf->used = 0;
-                        (void)iob_write(op->buf, op->fp, IOB_SAVE_HIST);
+                        __fill_sync(op);
                         sched_yield();
                 }
 
-                if (!feof(op->fp)) {
+                if (!op->eof) {
                         op->buf->ri = offset & (IOB_SZ - 1);
                         op->buf->used -= (offset - op->pos);
                         op->pos = offset;
 
                         /* Pull in rest of data if needed */
                         if ((size_t)(op->buf->offset - offset) < size)
-                                (void)iob_write(op->buf, op->fp,
-                                                IOB_SAVE_HIST);
+                                __fill_sync(op);
                 }
         }
 
@@ -1580,11 +2609,16 @@ check_idx:
                 int off = offset - op->pos;
                 n += iob_read(buf, op->buf, size, off);
                 op->pos += (off + size);
+                qos_update(op->qos, size, op->buf->offset - op->pos,
+                           !op->eof);
                 if (__wake_thread(op, RD_ASYNC_READ))
                         return -EIO;
         }
 
 out:
+        /* Only data actually passed through the stream is collected */
+        if (n > 0 && head_sz && op->buf && head_off + n == op->pos)
+                __head_fill(op, FH_TOPATH(fi->fh), head_buf, n, head_off);
 
 #ifdef DEBUG_READ
         if (n > 0)
@@ -1829,7 +2863,7 @@ static int collect_files(const char *arch)
         if (d.Flags & ROADF_ENCHEADERS)
                 goto skip_file_check;
         if (arc->hdr.Flags & RHDF_ENCRYPTED) {
-                dll_result = extract_rar(arch_, arc->hdr.FileName, NULL);
+                dll_result = extract_rar(arch_, arc->hdr.FileName, NULL, -1, 0);
                 if (dll_result != ERAR_SUCCESS && dll_result != ERAR_UNKNOWN) {
                         RARFreeArchiveDataEx(&arc);
                         RARCloseArchive(h);
@@ -2026,6 +3060,16 @@ static int CALLBACK extract_callback(UINT msg, LPARAM UserData,
                         }
                         return -1;
                 }
+                /* Data before the requested offset is decoded but dropped */
+                if (cb_arg->skip) {
+                        if ((off_t)P2 <= cb_arg->skip) {
+                                cb_arg->skip -= P2;
+                                return 1;
+                        }
+                        P1 += cb_arg->skip;
+                        P2 -= cb_arg->skip;
+                        cb_arg->skip = 0;
+                }
                 /*
                  * We do not need to handle the case that not all data is
                  * written after return from write() since the pipe is not
@@ -2063,7 +3107,8 @@ static int CALLBACK extract_callback(UINT msg, LPARAM UserData,
  *****************************************************************************
  *
  ****************************************************************************/
-static int extract_rar(char *arch, const char *file, void *arg)
+static int extract_rar(char *arch, const char *file, void *arg, int threads,
+                       off_t skip)
 {
         int ret = 0;
         struct RAROpenArchiveDataEx d;
@@ -2075,6 +3120,7 @@ static int extract_rar(char *arch, const char *file, void *arg)
         cb_arg.arch = arch;
         cb_arg.arg = arg;
         cb_arg.dry_run = 0;
+        cb_arg.skip = skip;
 
         d.Callback = extract_callback;
         d.UserData = (LPARAM)&cb_arg;
@@ -2083,6 +3129,8 @@ static int extract_rar(char *arch, const char *file, void *arg)
         HANDLE hdl = RAROpenArchiveEx(&d);
         if (d.OpenResult)
                 goto extract_error;
+        if (threads > 0)
+                (void)RARSetUnpackThreads(hdl, threads);
 
         header.CmtBufSize = 0;
         while (1) {
@@ -2106,30 +3154,257 @@ extract_error:
         return ret;
 }
 
+/* Pending request towards a solid decoder */
+struct solid_req {
+        char *file;
+        int fd;
+        struct solid_req *next;
+};
+
 /*!
  *****************************************************************************
- * For setting high-precision timestamp, used by set_rarstats()
+ * Collect requests, appending them to |pending|. Waits at most |tmo| ms
+ * for the first one. Returns 1 if the decoder should terminate once the
+ * pending requests are served.
  ****************************************************************************/
-#if defined(HAVE_STRUCT_STAT_ST_MTIM) || defined(HAVE_STRUCT_STAT_ST_CTIM) || defined(HAVE_STRUCT_STAT_ST_ATIM)
-void set_high_precision_ts(struct timespec *spec, uint64_t stamp)
+static int __solid_recv(int sock, struct solid_req **pending, int tmo)
 {
-/* libunrar 5.5.x and later provides 1 ns resolution UNIX timestamp */
-#if RARVER_MAJOR > 5 || (RARVER_MAJOR == 5 && RARVER_MINOR >= 50)
-        spec->tv_sec  = (stamp / 1000000000);
-        spec->tv_nsec = (stamp % 1000000000);
-/* Earlier versions provide function GetRaw(), 100 ns resolution
- * Windows timestamp. */
-#else
-        spec->tv_sec  = (stamp / 10000000);
-        spec->tv_nsec = (stamp % 10000000) * 100;
-#endif
-}
-#endif
+        struct pollfd pfd = {sock, POLLIN, 0};
 
-/*!
- *****************************************************************************
- *
- ****************************************************************************/
+        while (*pending)
+                pending = &(*pending)->next;
+
+        while (1) {
+                struct solid_req *r;
+                struct iovec iov;
+                struct msghdr msg;
+                uint32_t len;
+                union {
+                        struct cmsghdr hdr;
+                        char buf[CMSG_SPACE(sizeof(int))];
+                } cmsg;
+                int res = poll(&pfd, 1, tmo);
+
+                if (res == -1 && errno == EINTR)
+                        continue;
+                if (res <= 0)
+                        return tmo != 0;        /* idle timeout */
+                tmo = 0;
+
+                memset(&msg, 0, sizeof(msg));
+                iov.iov_base = &len;
+                iov.iov_len = sizeof(len);
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = cmsg.buf;
+                msg.msg_controllen = sizeof(cmsg.buf);
+                if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(len) || !len)
+                        return 1;
+                r = calloc(1, sizeof(struct solid_req));
+                if (!r)
+                        return 1;
+                r->fd = -1;
+                if (msg.msg_controllen >= CMSG_LEN(sizeof(int)) &&
+                    cmsg.hdr.cmsg_type == SCM_RIGHTS)
+                        memcpy(&r->fd, CMSG_DATA(&cmsg.hdr), sizeof(int));
+                r->file = malloc(len + 1);
+                if (!r->file ||
+                    recv(sock, r->file, len, MSG_WAITALL) != (ssize_t)len ||
+                    r->fd == -1) {
+                        if (r->fd != -1)
+                                close(r->fd);
+                        free(r->file);
+                        free(r);
+                        return 1;
+                }
+                r->file[len] = 0;
+                *pending = r;
+                pending = &r->next;
+        }
+}
+
+/*!
+ *****************************************************************************
+ * Complete request |r| and tell rar2fs about it. The notice must never
+ * block the decoder, if it can not be sent rar2fs will consider the
+ * decoder busy and use private children instead.
+ ****************************************************************************/
+static void __solid_done(int sock, struct solid_req *r)
+{
+        char c = 0;
+
+        close(r->fd);
+        free(r->file);
+        free(r);
+        (void)send(sock, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __solid_seen(const char *file, char **seen, int n_seen)
+{
+        while (n_seen--) {
+                if (!strcmp(seen[n_seen], file))
+                        return 1;
+        }
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Decoder loop for solid archive |arch|, run in its own process. Headers
+ * are processed in archive order and the data of each requested member is
+ * written to the reader(s) waiting for it. Members that nobody asked for
+ * are decoded and discarded since a solid archive can not be entered in
+ * the middle. The archive is only reopened if all pending requests are
+ * for members that has already been passed.
+ ****************************************************************************/
+static void solid_decode(char *arch, int sock, int threads)
+{
+        struct RAROpenArchiveDataEx d;
+        struct RARHeaderDataEx header;
+        struct extract_cb_arg cb_arg;
+        struct solid_req *pending = NULL;
+        struct solid_req **pp;
+        char **seen = NULL;
+        int n_seen = 0;
+        int max_seen = 0;
+        int quit = 0;
+        HANDLE hdl = NULL;
+
+        cb_arg.arch = arch;
+        cb_arg.dry_run = 0;
+        cb_arg.skip = 0;
+        memset(&header, 0, sizeof(header));
+        header.CmtBufSize = 0;
+
+        while (pending || !quit) {
+                /* Normally stopped by rar2fs well before this timeout */
+                if (!quit)
+                        quit = __solid_recv(sock, &pending, pending ?
+                                            0 : SOLID_IDLE_TMO * 10000);
+                if (!pending)
+                        continue;
+
+                if (hdl) {
+                        struct solid_req *r = pending;
+                        while (r && __solid_seen(r->file, seen, n_seen))
+                                r = r->next;
+                        if (!r) {
+                                RARCloseArchive(hdl);
+                                hdl = NULL;
+                        }
+                }
+                if (!hdl) {
+                        while (n_seen)
+                                free(seen[--n_seen]);
+                        memset(&d, 0, sizeof(RAROpenArchiveDataEx));
+                        d.ArcName = arch;
+                        d.OpenMode = RAR_OM_EXTRACT;
+                        d.Callback = extract_callback;
+                        d.UserData = (LPARAM)&cb_arg;
+                        hdl = RAROpenArchiveEx(&d);
+                        if (!d.OpenResult && threads > 0)
+                                (void)RARSetUnpackThreads(hdl, threads);
+                        if (d.OpenResult) {
+                                if (hdl)
+                                        RARCloseArchive(hdl);
+                                hdl = NULL;
+                                while (pending) {
+                                        struct solid_req *r = pending;
+                                        pending = r->next;
+                                        __solid_done(sock, r);
+                                }
+                                continue;
+                        }
+                }
+
+                if (RARReadHeaderEx(hdl, &header)) {
+                        /* End of archive; anything not passed does not exist */
+                        pp = &pending;
+                        while (*pp) {
+                                struct solid_req *r = *pp;
+                                if (__solid_seen(r->file, seen, n_seen)) {
+                                        pp = &r->next;
+                                        continue;
+                                }
+                                *pp = r->next;
+                                __solid_done(sock, r);
+                        }
+                        RARCloseArchive(hdl);
+                        hdl = NULL;
+                        continue;
+                }
+
+                struct solid_req *r = NULL;
+                if (!IS_RAR_DIR(&header)) {
+                        if (n_seen == max_seen) {
+                                char **tmp;
+                                max_seen += 64;
+                                tmp = realloc(seen, max_seen * sizeof(char *));
+                                if (!tmp)
+                                        break;
+                                seen = tmp;
+                        }
+                        seen[n_seen] = strdup(header.FileName);
+                        if (!seen[n_seen])
+                                break;
+                        ++n_seen;
+                        for (pp = &pending; *pp; pp = &(*pp)->next) {
+                                if (!strcmp((*pp)->file, header.FileName)) {
+                                        r = *pp;
+                                        *pp = r->next;
+                                        break;
+                                }
+                        }
+                }
+                if (!r) {
+                        if (RARProcessFile(hdl, RAR_SKIP, NULL, NULL)) {
+                                RARCloseArchive(hdl);
+                                hdl = NULL;
+                        }
+                        continue;
+                }
+                cb_arg.arg = (void *)(uintptr_t)r->fd;
+                if (RARProcessFile(hdl, RAR_TEST, NULL, NULL)) {
+                        /* Reader gone or broken data, start over next time */
+                        RARCloseArchive(hdl);
+                        hdl = NULL;
+                }
+                __solid_done(sock, r);
+        }
+
+        if (hdl)
+                RARCloseArchive(hdl);
+        _exit(0);
+}
+
+/*!
+ *****************************************************************************
+ * For setting high-precision timestamp, used by set_rarstats()
+ ****************************************************************************/
+#if defined(HAVE_STRUCT_STAT_ST_MTIM) || defined(HAVE_STRUCT_STAT_ST_CTIM) || defined(HAVE_STRUCT_STAT_ST_ATIM)
+void set_high_precision_ts(struct timespec *spec, uint64_t stamp)
+{
+/* libunrar 5.5.x and later provides 1 ns resolution UNIX timestamp */
+#if RARVER_MAJOR > 5 || (RARVER_MAJOR == 5 && RARVER_MINOR >= 50)
+        spec->tv_sec  = (stamp / 1000000000);
+        spec->tv_nsec = (stamp % 1000000000);
+/* Earlier versions provide function GetRaw(), 100 ns resolution
+ * Windows timestamp. */
+#else
+        spec->tv_sec  = (stamp / 10000000);
+        spec->tv_nsec = (stamp % 10000000) * 100;
+#endif
+}
+#endif
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
 static uint64_t extract_file_size(char *arch, const char *file)
 {
         struct RAROpenArchiveDataEx d;
@@ -2503,6 +3778,275 @@ vsize_done:
         }
 }
 
+/* Max number of queued background head extractions */
+#define HEAD_QUEUE_MAX 256
+
+/*!
+ *****************************************************************************
+ * Extract the head of the file |path| into the head cache. The extraction
+ * takes a stream slot like any other, but only if one is free, and is
+ * scheduled behind all foreground streams. Without a slot the head is
+ * left to be filled on first access.
+ ****************************************************************************/
+static void __head_extract(const char *path)
+{
+        struct filecache_entry *entry_p;
+        struct filecache_entry *e_p = NULL;
+        struct headcache_ident id;
+        char *buf = NULL;
+        size_t want;
+        size_t len = 0;
+        pid_t pid = 0;
+        void *qos;
+        int pfd;
+
+        pthread_rwlock_rdlock(&file_access_lock);
+        entry_p = filecache_get(path);
+        if (entry_p)
+                e_p = filecache_clone(entry_p);
+        pthread_rwlock_unlock(&file_access_lock);
+        if (!e_p || __head_ident(e_p, &id) || headcache_has(path, &id))
+                goto out;
+
+        want = (off_t)head_sz < e_p->stat.st_size
+                ? head_sz : (size_t)e_p->stat.st_size;
+        buf = malloc(want);
+        if (!buf)
+                goto out;
+
+        if (__admit_try())
+                goto out;
+        /* The dry run, if needed, is performed just as for a regular open
+         * so that the head of a broken file is never cached. Its verdict
+         * is kept by the archive cache and spares the later open. */
+        pfd = popen_(e_p, &pid, -1);
+        if (pfd == -1) {
+                __admit_put();
+                goto out;
+        }
+        qos = qos_register_bg(path, pid);
+        (void)fcntl(pfd, F_SETFL, 0);
+        while (len < want && !bg_cancelled) {
+                ssize_t res = read(pfd, buf + len, want - len);
+                if (res == -1 && errno == EINTR)
+                        continue;
+                if (res <= 0)
+                        break;
+                len += res;
+        }
+        qos_unregister(qos, NULL);
+        (void)pclose_(pfd, pid);
+        __admit_put();
+        if (len == want)
+                headcache_put(path, &id, buf, len);
+
+out:
+        free(buf);
+        if (e_p)
+                filecache_freeclone(e_p);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __head_task(void *data)
+{
+        char *path = data;
+
+        pthread_mutex_lock(&head_lock);
+        --head_pending;
+        pthread_mutex_unlock(&head_lock);
+        if (!bg_cancelled)
+                __head_extract(path);
+        free(path);
+}
+
+/*!
+ *****************************************************************************
+ * Queue background extraction of the head of a newly listed file. Solid
+ * archives are left to be filled on first access since each member would
+ * require decompression of all members before it.
+ ****************************************************************************/
+static void __head_submit(const char *path,
+                          const struct filecache_entry *entry_p)
+{
+        char *tmp;
+
+        if (!bg_pool || entry_p->flags.raw || entry_p->flags.encrypted ||
+            entry_p->flags.solid || entry_p->flags.force_dir ||
+            !entry_p->stat.st_size || !IS_HEAD(path))
+                return;
+
+        pthread_mutex_lock(&head_lock);
+        if (head_pending >= HEAD_QUEUE_MAX) {
+                pthread_mutex_unlock(&head_lock);
+                return;
+        }
+        ++head_pending;
+        pthread_mutex_unlock(&head_lock);
+
+        tmp = strdup(path);
+        if (!tmp || threadpool_submit(bg_pool, __head_task, tmp)) {
+                free(tmp);
+                pthread_mutex_lock(&head_lock);
+                --head_pending;
+                pthread_mutex_unlock(&head_lock);
+        }
+}
+
+/* Amount of data of a stored file to read ahead when it is pre-warmed */
+#define PREWARM_RA_SZ (4 * 1024 * 1024)
+
+/*!
+ *****************************************************************************
+ * Find the sibling following |path| in the cached listing of its folder.
+ * Only archived files with the same extension are considered, so that
+ * e.g. a subtitle or an .nfo file in between is skipped. Names are
+ * compared using the collation of the current locale, as when folders
+ * are resolved and as most clients present them.
+ ****************************************************************************/
+static char *__prewarm_next(const char *path)
+{
+        struct dircache_entry *dce;
+        struct dir_entry_list *next;
+        const char *best = NULL;
+        const char *name;
+        const char *ext;
+        char *safe_path;
+        char *dir;
+        char *tmp = NULL;
+
+        safe_path = strdup(path);
+        if (!safe_path)
+                return NULL;
+        name = strrchr(path, '/') + 1;
+        ext = strrchr(name, '.');
+        if (!ext)
+                goto out;
+
+        dir = __gnu_dirname(safe_path);
+        pthread_rwlock_rdlock(&dir_access_lock);
+        dce = dircache_get(dir);
+        if (dce) {
+                next = dce->dir_entry_list.next;
+                while (next) {
+                        const char *n = next->entry.name;
+                        const char *e = strrchr(n, '.');
+                        if (next->entry.valid &&
+                            next->entry.type == DIR_E_RAR &&
+                            e && !strcasecmp(e, ext) &&
+                            strcoll(n, name) > 0 &&
+                            (!best || strcoll(n, best) < 0))
+                                best = n;
+                        next = next->next;
+                }
+        }
+        if (best) {
+                tmp = malloc(strlen(dir) + strlen(best) + 2);
+                if (tmp)
+                        sprintf(tmp, "%s%s%s", dir,
+                                strcmp(dir, "/") ? "/" : "", best);
+        }
+        pthread_rwlock_unlock(&dir_access_lock);
+
+out:
+        free(safe_path);
+        return tmp;
+}
+
+/*!
+ *****************************************************************************
+ * Prepare the file following |data| so that opening it is quick. The
+ * path is resolved, the dry run performed and the head cache filled for
+ * compressed files. For stored files the start of the data is read
+ * ahead into the page cache instead.
+ ****************************************************************************/
+static void __prewarm_task(void *data)
+{
+        char *path = __prewarm_next(data);
+        struct filecache_entry *entry_p;
+        struct filecache_entry *e_p = NULL;
+        int ret;
+
+        if (!path || bg_cancelled)
+                goto out;
+        printd(3, "Pre-warming %s\n", path);
+
+        pthread_rwlock_rdlock(&file_access_lock);
+        entry_p = path_lookup(path, NULL);
+        if (entry_p && entry_p != LOCAL_FS_ENTRY)
+                e_p = filecache_clone(entry_p);
+        pthread_rwlock_unlock(&file_access_lock);
+        if (!e_p || e_p->flags.force_dir)
+                goto out;
+
+        if (e_p->flags.raw) {
+                off_t off = e_p->offset;
+                char *vol = e_p->rar_p;
+                int fd;
+                if (e_p->flags.multipart) {
+                        vol = get_vname(e_p->vtype, e_p->rar_p, e_p->vno_base,
+                                        e_p->vlen, e_p->vpos);
+                        off = e_p->vsize_real_first - e_p->vsize_first;
+                }
+                fd = vol ? open(vol, O_RDONLY) : -1;
+                if (fd != -1) {
+                        (void)posix_fadvise(fd, off, PREWARM_RA_SZ,
+                                            POSIX_FADV_WILLNEED);
+                        close(fd);
+                }
+                if (vol != e_p->rar_p)
+                        free(vol);
+                goto out;
+        }
+
+        if (e_p->flags.encrypted)
+                goto out;
+        if (!e_p->flags.dry_run_done && mount_type == MOUNT_FOLDER &&
+            !arccache_dry_run_done(e_p->rar_p, e_p->file_p,
+                                   DRY_RUN_VTYPE(e_p))) {
+                ret = extract_rar(e_p->rar_p, e_p->file_p, NULL, -1, 0);
+                if (ret && ret != ERAR_UNKNOWN)
+                        goto out;
+                arccache_set_dry_run_done(e_p->rar_p, e_p->file_p,
+                                          DRY_RUN_VTYPE(e_p));
+                pthread_rwlock_wrlock(&file_access_lock);
+                entry_p = filecache_get(path);
+                if (entry_p && entry_p->gen == e_p->gen)
+                        entry_p->flags.dry_run_done = 1;
+                pthread_rwlock_unlock(&file_access_lock);
+        }
+        if (!bg_cancelled && !e_p->flags.solid && IS_HEAD(path))
+                __head_extract(path);
+
+out:
+        if (e_p)
+                filecache_freeclone(e_p);
+        free(path);
+        free(data);
+}
+
+/*!
+ *****************************************************************************
+ * Pre-warm the next file in the folder of |path| once half of the file
+ * behind |op| has been consumed, as that is a good sign that the next
+ * one will be requested shortly.
+ ****************************************************************************/
+static void __prewarm_check(struct io_context *op, const char *path, int n)
+{
+        char *tmp;
+
+        op->consumed += n;
+        if (op->prewarmed || op->consumed < op->entry_p->stat.st_size / 2)
+                return;
+        op->prewarmed = 1;
+
+        tmp = strdup(path);
+        if (tmp && threadpool_submit(bg_pool, __prewarm_task, tmp))
+                free(tmp);
+}
+
 /*!
  *****************************************************************************
  *
@@ -2584,6 +4128,8 @@ static struct filecache_entry *__listrar_tocache(char *file,
                         entry_p->flags.save_eof = get_save_eof(entry_p->rar_p);
                         if (arc->hdr.Flags & RHDF_ENCRYPTED)
                                 entry_p->flags.encrypted = 1;
+                        if (d->Flags & ROADF_SOLID)
+                                entry_p->flags.solid = 1;
                 }
         }
         entry_p->method = arc->hdr.Method;
@@ -2655,67 +4201,183 @@ static void __listrar_cachedirentry(const char *mp)
  *****************************************************************************
  *
  ****************************************************************************/
-static int listrar(const char *path, struct dir_entry_list **buffer,
-                const char *arch, char **first_arch, int *final)
+static HANDLE __listrar_open(const char *arch, RAROpenArchiveDataEx *d,
+                int *final)
 {
-        ENTER_("%s   arch=%s", path, arch);
-        RAROpenArchiveDataEx d;
-        memset(&d, 0, sizeof(RAROpenArchiveDataEx));
-        d.ArcName = (char *)arch;   /* Horrible cast! But hey... it is the API! */
-        d.OpenMode = RAR_OM_LIST_INCSPLIT;
-        d.Callback = list_callback_noswitch;
-        d.UserData = (LPARAM)arch;
-        HANDLE hdl = RAROpenArchiveEx(&d);
+        memset(d, 0, sizeof(RAROpenArchiveDataEx));
+        d->ArcName = (char *)arch;   /* Horrible cast! But hey... it is the API! */
+        d->OpenMode = RAR_OM_LIST_INCSPLIT;
+        d->Callback = list_callback_noswitch;
+        d->UserData = (LPARAM)arch;
+        HANDLE hdl = RAROpenArchiveEx(d);
 
         /* Check for fault */
-        if (d.OpenResult) {
+        if (d->OpenResult) {
                 if (hdl)
                         RARCloseArchive(hdl);
-                return d.OpenResult;
+                return NULL;
         }
 
-        if (d.Flags & ROADF_ENCHEADERS) {
+        if (d->Flags & ROADF_ENCHEADERS) {
                 RARCloseArchive(hdl);
-                d.Callback = list_callback;
-                hdl = RAROpenArchiveEx(&d);
+                d->Callback = list_callback;
+                hdl = RAROpenArchiveEx(d);
                 if (final)
                         *final = 1;
         }
+        return hdl;
+}
 
-        char *tmp1 = strdup(arch);
-        char *rar_root = strdup(__gnu_dirname(tmp1));
-        free(tmp1);
-        tmp1 = rar_root;
-        rar_root += strlen(OPT_STR2(OPT_KEY_SRC, 0));
-        int is_root_path = (!strcmp(rar_root, path) || !CHRCMP(path, '/'));
-        int ret = 0;
-        RARArchiveDataEx *arc = NULL;
-
-        if (*first_arch == NULL) {
-                /* The caller is responsible for freeing this! */
-                *first_arch = strdup(arch);
-
-                /* Make sure parent folders are always searched from the first
-                 * volume file since sub-folders might actually be placed
-                 * elsewhere. Also the alias function depends on this. */
-                if ((d.Flags & ROADF_VOLUME) && !(d.Flags & ROADF_FIRSTVOLUME)
-                                && __RARVolNameToFirstName(
-                                           *first_arch, !VTYPE(d.Flags))) {
-                        free(*first_arch);
-                        *first_arch = NULL;
-                        goto out;
+/*!
+ *****************************************************************************
+ * Take over a listing from the native header parser. Headers already
+ * processed are skipped.
+ ****************************************************************************/
+static HANDLE __listrar_takeover(const char *arch, RAROpenArchiveDataEx *d,
+                RARArchiveDataEx **arc, unsigned int n_hdr, int *final,
+                int *done)
+{
+        HANDLE hdl = __listrar_open(arch, d, final);
+        if (!hdl)
+                return NULL;
+        while (n_hdr--) {
+                int res = RARListArchiveEx(hdl, arc);
+                if (res) {
+                        /* ERAR_EOPEN means the last header already listed
+                         * continues in a volume that is not available.
+                         * The listing is complete, same as for libunrar. */
+                        *done = res == ERAR_EOPEN;
+                        RARFreeArchiveDataEx(arc);
+                        RARCloseArchive(hdl);
+                        return NULL;
                 }
         }
+        return hdl;
+}
 
-        int dll_result = ERAR_SUCCESS;
-        while (dll_result == ERAR_SUCCESS) {
-                if ((dll_result = RARListArchiveEx(hdl, &arc))) {
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __listrar_stats_update(int type, unsigned int n_hdr,
+                struct timeval *t1)
+{
+        struct timeval t2;
+
+        gettimeofday(&t2, NULL);
+        pthread_mutex_lock(&list_stats_lock);
+        list_stats[type].archives++;
+        list_stats[type].headers += n_hdr;
+        list_stats[type].usec += ((t2.tv_sec - t1->tv_sec) * 1000000ULL) +
+                                 (t2.tv_usec - t1->tv_usec);
+        pthread_mutex_unlock(&list_stats_lock);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __listrar_stats_report()
+{
+        static const char *name[] = {"libunrar", "native", "quick open"};
+        int i;
+
+        pthread_mutex_lock(&list_stats_lock);
+        for (i = 0; i < 3; i++) {
+                struct list_stats *ls = &list_stats[i];
+                if (!ls->archives)
+                        continue;
+                syslog(LOG_DEBUG,
+                       "listing (%s): %lu archives, %llu headers in %llu ms (%llu headers/s)",
+                       name[i], ls->archives, ls->headers,
+                       ls->usec / 1000,
+                       ls->usec ? (ls->headers * 1000000ULL) / ls->usec : 0);
+        }
+        pthread_mutex_unlock(&list_stats_lock);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int listrar(const char *path, struct dir_entry_list **buffer,
+                const char *arch, char **first_arch, int *final)
+{
+        ENTER_("%s   arch=%s", path, arch);
+        RAROpenArchiveDataEx d;
+        HANDLE hdl = NULL;
+        void *hp = NULL;
+        unsigned int n_hdr = 0;
+        struct timeval t1;
+
+        gettimeofday(&t1, NULL);
+        memset(&d, 0, sizeof(RAROpenArchiveDataEx));
+        if (!OPT_SET(OPT_KEY_NO_NATIVE_LIST))
+                hp = rarhdr_open(arch, &d.Flags);
+        if (!hp) {
+                hdl = __listrar_open(arch, &d, final);
+                if (!hdl)
+                        return d.OpenResult ? d.OpenResult : ERAR_EOPEN;
+        }
+
+        char *tmp1 = strdup(arch);
+        char *rar_root = strdup(__gnu_dirname(tmp1));
+        free(tmp1);
+        tmp1 = rar_root;
+        rar_root += strlen(OPT_STR2(OPT_KEY_SRC, 0));
+        int is_root_path = (!strcmp(rar_root, path) || !CHRCMP(path, '/'));
+        int ret = 0;
+        RARArchiveDataEx *arc = NULL;
+
+        if (*first_arch == NULL) {
+                /* The caller is responsible for freeing this! */
+                *first_arch = strdup(arch);
+
+                /* Make sure parent folders are always searched from the first
+                 * volume file since sub-folders might actually be placed
+                 * elsewhere. Also the alias function depends on this. */
+                if ((d.Flags & ROADF_VOLUME) && !(d.Flags & ROADF_FIRSTVOLUME)
+                                && __RARVolNameToFirstName(
+                                           *first_arch, !VTYPE(d.Flags))) {
+                        free(*first_arch);
+                        *first_arch = NULL;
+                        goto out;
+                }
+        }
+
+        int dll_result = ERAR_SUCCESS;
+        while (dll_result == ERAR_SUCCESS) {
+                if (hp) {
+                        dll_result = rarhdr_list(hp, &arc);
+                        if (dll_result != ERAR_SUCCESS &&
+                            dll_result != ERAR_END_ARCHIVE) {
+                                printd(2, "native listing of %s failed (%d)\n",
+                                       arch, dll_result);
+                                rarhdr_close(hp);
+                                hp = NULL;
+                                arc = NULL;
+                                int done = 0;
+                                hdl = __listrar_takeover(arch, &d, &arc,
+                                                         n_hdr, final, &done);
+                                if (!hdl) {
+                                        if (!done)
+                                                ret = 1;
+                                        break;
+                                }
+                                dll_result = ERAR_SUCCESS;
+                                continue;
+                        }
+                } else {
+                        dll_result = RARListArchiveEx(hdl, &arc);
+                }
+                if (dll_result) {
                         if (dll_result != ERAR_EOPEN) {
                                 if (dll_result != ERAR_END_ARCHIVE)
                                         ret = 1;
                                 continue;
                         }
                 }
+                ++n_hdr;
 
                 char *mp;
                 int display = 0;
@@ -2808,6 +4470,7 @@ static int listrar(const char *path, struct dir_entry_list **buffer,
                         free(mp);
                         continue;
                 }
+                __head_submit(mp, entry_p);
 
 cache_hit:
                 pthread_rwlock_unlock(&file_access_lock);
@@ -2819,8 +4482,16 @@ cache_hit:
         }
 
 out:
-        RARFreeArchiveDataEx(&arc);
-        RARCloseArchive(hdl);
+        __listrar_stats_update(!hp ? LIST_LIBUNRAR :
+                               rarhdr_quick_open(hp) ? LIST_QUICK_OPEN :
+                                                       LIST_NATIVE,
+                               n_hdr, &t1);
+        if (hp) {
+                rarhdr_close(hp);
+        } else {
+                RARFreeArchiveDataEx(&arc);
+                RARCloseArchive(hdl);
+        }
         free(tmp1);
 
         return ret;
@@ -2829,71 +4500,151 @@ out:
 #undef DOS_TO_UNIX_PATH
 #undef CHRCMP
 
+#define DIR_CLASS_NRM 0
+#define DIR_CLASS_RAR 1
+#define DIR_CLASS_RXX 2
+
 /*!
  *****************************************************************************
- *
+ * Classify a directory entry as a normal file, a RAR (first) volume or a
+ * .rNN volume. File type is only checked if provided by the file system,
+ * calling lstat() for each and every entry would be way too slow.
  ****************************************************************************/
-static int f0(SCANDIR_ARG3 e)
+static int __classify(const struct dirent *e)
 {
-        /*
-         * We could maybe fallback to using lstat() here if
-         * _DIRENT_HAVE_D_TYPE is not defined. But it is probably
-         * way to slow to use in filters. That would also require
-         * calls to getcwd() etc. since the current path is not
-         * known in this context.
-         */
+        int is_rar;
+        int is_rxx;
+
+        if (strlen(e->d_name) < 4)
+                return DIR_CLASS_NRM;
+        is_rar = IS_RAR(e->d_name) || IS_CBR(e->d_name) || IS_NNN(e->d_name);
+        is_rxx = !is_rar && IS_RXX(e->d_name);
 #ifdef _DIRENT_HAVE_D_TYPE
-        if (e->d_type != DT_UNKNOWN)
-                return (!(IS_RAR(e->d_name) && e->d_type == DT_REG) &&
-                        !(IS_CBR(e->d_name) && e->d_type == DT_REG) &&
-                        !(IS_NNN(e->d_name) && e->d_type == DT_REG) &&
-                        !(IS_RXX(e->d_name) && e->d_type == DT_REG));
+        if (e->d_type != DT_UNKNOWN && e->d_type != DT_REG)
+                return DIR_CLASS_NRM;
 #endif
-        return !IS_RAR(e->d_name) &&
-                        !IS_CBR(e->d_name) &&
-                        !IS_NNN(e->d_name) &&
-                        !IS_RXX(e->d_name);
+        if (is_rar)
+                return DIR_CLASS_RAR;
+        if (is_rxx)
+                return DIR_CLASS_RXX;
+        return DIR_CLASS_NRM;
 }
 
-static int f1(SCANDIR_ARG3 e)
+struct dir_class {
+        char **names;
+        int n;
+        int n_max;
+};
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __dir_class_add(struct dir_class *dc, const char *name)
 {
-        /*
-         * We could maybe fallback to using lstat() here if
-         * _DIRENT_HAVE_D_TYPE is not defined. But it is probably
-         * way to slow to use in filters. That would also require
-         * calls to getcwd() etc. since the current path is not
-         * known in this context.
-         */
-#ifdef _DIRENT_HAVE_D_TYPE
-        if (e->d_type != DT_UNKNOWN)
-                return (IS_RAR(e->d_name) ||
-                                IS_CBR(e->d_name) ||
-                                IS_NNN(e->d_name)) &&
-                                e->d_type == DT_REG;
-#endif
-        return IS_RAR(e->d_name) ||
-                        IS_NNN(e->d_name) ||
-                        IS_CBR(e->d_name);
+        if (dc->n == dc->n_max) {
+                int n_max = dc->n_max ? dc->n_max * 2 : 64;
+                char **tmp = realloc(dc->names, n_max * sizeof(char *));
+                if (!tmp)
+                        return -1;
+                dc->names = tmp;
+                dc->n_max = n_max;
+        }
+        dc->names[dc->n] = strdup(name);
+        if (!dc->names[dc->n])
+                return -1;
+        ++dc->n;
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __dir_class_free(struct dir_class *dc)
+{
+        int i;
+
+        for (i = 0; i < dc->n; i++)
+                free(dc->names[i]);
+        free(dc->names);
+        dc->names = NULL;
+        dc->n = 0;
+        dc->n_max = 0;
 }
 
-static int f2(SCANDIR_ARG3 e)
+/*!
+ *****************************************************************************
+ * Same collation as alphasort(3).
+ ****************************************************************************/
+static int __dir_class_cmp(const void *a, const void *b)
 {
-        /*
-         * We could maybe fallback to using lstat() here if
-         * _DIRENT_HAVE_D_TYPE is not defined. But it is probably
-         * way to slow to use in filters. That would also require
-         * calls to getcwd() etc. since the current path is not
-         * known in this context.
-         */
-#ifdef _DIRENT_HAVE_D_TYPE
-        if (e->d_type != DT_UNKNOWN)
-                return IS_RXX(e->d_name) && e->d_type == DT_REG;
+        return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/*!
+ *****************************************************************************
+ * Read directory |root| once and split the entries into the classes
+ * requested by |mask|. Each class is sorted as if scandir(3) and
+ * alphasort(3) had been used.
+ ****************************************************************************/
+static int __dir_classify(const char *root, struct dir_class *dc,
+                unsigned int mask)
+{
+        struct dirent *e;
+        DIR *dp;
+        int c;
+
+        dp = opendir(root);
+        if (dp == NULL)
+                return -1;
+        /* Do not use reentrant version of readdir(3) here, each thread
+         * is using its own directory stream. */
+        while ((e = readdir(dp))) {
+                c = __classify(e);
+                if (!(mask & (1 << c)))
+                        continue;
+                if (__dir_class_add(&dc[c], e->d_name)) {
+                        closedir(dp);
+                        return -1;
+                }
+        }
+        closedir(dp);
+
+        for (c = 0; c < 3; c++) {
+                if (dc[c].n > 1)
+                        qsort(dc[c].names, dc[c].n, sizeof(char *),
+                              __dir_class_cmp);
+        }
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __get_file_size(const char *path, off_t *size)
+{
+        struct stat st;
+
+#ifdef HAVE_STATX
+        struct statx stx;
+        if (!statx(AT_FDCWD, path, 0, STATX_SIZE, &stx)) {
+                if (stx.stx_mask & STATX_SIZE) {
+                        *size = stx.stx_size;
+                        return 0;
+                }
+        } else if (errno != ENOSYS) {
+                return -1;
+        }
 #endif
-        return IS_RXX(e->d_name);
+        if (stat(path, &st))
+                return -1;
+        *size = st.st_size;
+        return 0;
 }
 
 struct filter_ops {
-        int (*filter[3]) (SCANDIR_ARG3);
         unsigned int f_end;
         unsigned int f_nrm;
         unsigned int f_rar;
@@ -2909,15 +4660,29 @@ static int __resolve_dir(const char *dir, const char *root,
                 struct dir_entry_list **next2,
                 struct filter_ops *f_ops)
 {
-        struct dirent **namelist = NULL;
+        struct dir_class dc[3];
+        unsigned int mask = 0;
         unsigned int f;
         int error_tot = 0;
         int seek_len = 0;
         char *first_arch = NULL;
         int ret = 0;
 
+        memset(dc, 0, sizeof(dc));
+        if (f_ops->f_nrm < f_ops->f_end)
+                mask |= 1 << DIR_CLASS_NRM;
+        if (f_ops->f_rar < f_ops->f_end)
+                mask |= 1 << DIR_CLASS_RAR;
+        if (f_ops->f_rxx < f_ops->f_end)
+                mask |= 1 << DIR_CLASS_RXX;
+        if (__dir_classify(root, dc, mask)) {
+                perror("readdir");
+                ret = -EIO;
+                goto out;
+        }
+
         for (f = 0; f < f_ops->f_end; f++) {
-                off_t prev_size = 0;
+                off_t prev_size = -1;
                 size_t prev_len = 0;
                 int reset = 1;
                 int error_cnt = 0;
@@ -2925,64 +4690,74 @@ static int __resolve_dir(const char *dir, const char *root,
                 int vno = 0;
                 int vcnt = 0;
                 int i = 0;
-                int n = scandir(root, &namelist, f_ops->filter[f], alphasort);
-                if (n < 0) {
-                        perror("scandir");
-                        ret = -EIO;
-                        goto next_type;
+                int n;
+                char **names;
+
+                if (f == f_ops->f_nrm) {
+                        names = dc[DIR_CLASS_NRM].names;
+                        n = dc[DIR_CLASS_NRM].n;
+                } else if (f == f_ops->f_rar) {
+                        names = dc[DIR_CLASS_RAR].names;
+                        n = dc[DIR_CLASS_RAR].n;
+                } else {
+                        names = dc[DIR_CLASS_RXX].names;
+                        n = dc[DIR_CLASS_RXX].n;
                 }
+
                 while (i < n) {
                         int pos = 0;
                         int pos2 = 0;
                         char *arch = NULL;
 
                         if (f == f_ops->f_nrm && next) {
-                                *next = dir_entry_add(*next, namelist[i]->d_name,
+                                *next = dir_entry_add(*next, names[i],
                                                       NULL, DIR_E_NRM);
                                 goto next_entry;
                         }
 
-                        ABS_MP2(arch, root, namelist[i]->d_name);
+                        ABS_MP2(arch, root, names[i]);
 
                         if (f == f_ops->f_rar || f == f_ops->f_rxx) {
                                 int oldvno = vno;
                                 int len;
-                                const char *d_name = namelist[i]->d_name;
 
-                                vno = get_vformat(d_name, f != f_ops->f_rxx,
+                                vno = get_vformat(names[i], f != f_ops->f_rxx,
                                                         &len, &pos);
                                 pos2 = pos + len;
                                 if (vno <= oldvno)
                                         reset = 1;
                         }
                         if (f == f_ops->f_rar) {
-                                struct stat st;
-                                size_t len = strlen(namelist[i]->d_name);
-                                if (!stat(arch, &st)) {
-                                        if (vcnt && !reset) {
-                                                if (prev_len != len)
-                                                        reset = 1;
-                                                else if (strncmp(namelist[i]->d_name,
-                                                            namelist[i - 1]->d_name,
-                                                            pos))
-                                                        reset = 1;
-                                                else if (strcmp(namelist[i]->d_name
-                                                                    + pos2,
-                                                            namelist[i - 1]->d_name
-                                                                    + pos2))
-                                                        reset = 1;
-                                                else if (prev_len != len)
+                                off_t size = -1;
+                                size_t len = strlen(names[i]);
+                                if (vcnt && !reset) {
+                                        if (prev_len != len)
+                                                reset = 1;
+                                        else if (strncmp(names[i],
+                                                         names[i - 1], pos))
+                                                reset = 1;
+                                        else if (strcmp(names[i] + pos2,
+                                                        names[i - 1] + pos2))
+                                                reset = 1;
+                                        else {
+                                                /* Only now the volume sizes
+                                                 * are really needed. */
+                                                if (prev_size == -1) {
+                                                        char *prev;
+                                                        ABS_MP(prev, root,
+                                                               names[i - 1]);
+                                                        if (__get_file_size(prev,
+                                                                &prev_size))
+                                                                goto size_error;
+                                                }
+                                                if (__get_file_size(arch, &size))
+                                                        goto size_error;
+                                                if (size != prev_size &&
+                                                    is_first_volume_by_name(arch))
                                                         reset = 1;
-                                                else if (st.st_size != (long)prev_size)
-                                                        if (is_first_volume_by_name(arch))
-                                                                reset = 1;
                                         }
-                                        prev_size = st.st_size;
-                                } else {
-                                        free(arch);
-                                        ret = -EIO;
-                                        goto next_type;
                                 }
+                                prev_size = size;
                                 prev_len = len;
                         }
 
@@ -3009,27 +4784,25 @@ static int __resolve_dir(const char *dir, const char *root,
                                 }
                         }
                         if (error_cnt && next)
-                                *next = dir_entry_add(*next, namelist[i]->d_name,
+                                *next = dir_entry_add(*next, names[i],
                                                       NULL, DIR_E_NRM);
                         free(arch);
                         arch = NULL;
 
 next_entry:
                         ++i;
-                }
+                        continue;
 
-next_type:
-                if (namelist) {
-                        for (i = 0; i < n; i++)
-                                free(namelist[i]);
-                        free(namelist);
-                        namelist = NULL;
+size_error:
+                        free(arch);
+                        ret = -EIO;
+                        goto out;
                 }
-
-                if (ret)
-                        break;
         }
 
+out:
+        for (f = 0; f < 3; f++)
+                __dir_class_free(&dc[f]);
         free(first_arch);
 
         return ret < 0 ? ret : error_tot;
@@ -3046,8 +4819,6 @@ static int syncdir_scan(const char *dir, const char *root,
 
         ENTER_("%s", dir);
 
-        f_ops.filter[0] = f1;
-        f_ops.filter[1] = f2;
         f_ops.f_end = 2;
         f_ops.f_nrm = ~0;
         f_ops.f_rar = 0;
@@ -3069,9 +4840,6 @@ static int readdir_scan(const char *dir, const char *root,
         ENTER_("%s", dir);
 
         if (*next2) {
-                f_ops.filter[0] = f0;
-                f_ops.filter[1] = f1;
-                f_ops.filter[2] = f2;
                 f_ops.f_end = 3;
                 f_ops.f_nrm = 0;
                 f_ops.f_rar = 1;
@@ -3083,7 +4851,6 @@ static int readdir_scan(const char *dir, const char *root,
                  * cached. That would however affect the performance in the
                  * normal case too and currently the choice is simply to
                  * ignore such files. */
-                f_ops.filter[0] = f0;
                 f_ops.f_end = 1;
                 f_ops.f_nrm = 0;
                 f_ops.f_rar = ~0;
@@ -3492,6 +5259,7 @@ static int rar2_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
                                 goto dump_buff;
                         }
                 }
+                history_add(path);
                 ABS_ROOT(root, path);
                 ret = readdir_scan(path, root, &next, &next2);
                 if (ret) {
@@ -3652,6 +5420,45 @@ static int rar2_releasedir2(const char *path, struct fuse_file_info *fi)
         return 0;
 }
 
+/*!
+ *****************************************************************************
+ * Called from an I/O thread when a request has been posted or when the
+ * pipe from the extracting child becomes readable.
+ ****************************************************************************/
+static void __reader_cb(void *arg, int events)
+{
+        struct io_context *op = (struct io_context *)arg;
+        int status = IOB_DONE;
+        int req;
+
+        (void)events;
+
+        pthread_mutex_lock(&op->rd_req_mutex);
+        req = op->rd_req;
+        pthread_mutex_unlock(&op->rd_req_mutex);
+        if (req == RD_IDLE)
+                return;
+
+        printd(4, "Reader wakeup (fd:%d)\n", op->pfd);
+        if (req != RD_SYNC_NOREAD && !op->eof) {
+                (void)iob_write(op->buf, op->pfd, IOB_SAVE_HIST, &status);
+                if (status == IOB_EOF)
+                        op->eof = 1;
+        }
+
+        /* Continue when the child has produced more data */
+        ioloop_arm(op->ioh, status == IOB_AGAIN);
+        qos_update(op->qos, 0, op->buf->offset - op->pos,
+                   status == IOB_AGAIN);
+        if (status == IOB_AGAIN)
+                return;
+
+        pthread_mutex_lock(&op->rd_req_mutex);
+        op->rd_req = RD_IDLE;
+        pthread_cond_signal(&op->rd_req_cond); /* sync */
+        pthread_mutex_unlock(&op->rd_req_mutex);
+}
+
 /*!
  *****************************************************************************
  *
@@ -3675,53 +5482,6 @@ static int rar2_releasedir(const char *path, struct fuse_file_info *fi)
         return 0;
 }
 
-/*!
- *****************************************************************************
- *
- ****************************************************************************/
-static void *reader_task(void *arg)
-{
-        struct io_context *op = (struct io_context *)arg;
-
-        printd(4, "Reader thread started (fp:%p)\n", op->fp);
-
-        for (;;) {
-                int req;
-                struct timespec ts;
-                pthread_mutex_lock(&op->rd_req_mutex);
-restart:
-                clock_gettime(CLOCK_REALTIME, &ts);
-                ts.tv_sec += 1;
-                while (op->rd_req == RD_IDLE) {
-                        if (pthread_cond_timedwait(&op->rd_req_cond,
-                                        &op->rd_req_mutex, &ts) == ETIMEDOUT) {
-                                if (fs_terminated) {
-                                        pthread_mutex_unlock(&op->rd_req_mutex);
-                                        goto out;
-                                }
-                                goto restart;
-                        }
-                        continue;
-                }
-                req = op->rd_req;
-                pthread_mutex_unlock(&op->rd_req_mutex);
-
-                if (req == RD_TERM)
-                        goto out;
-                printd(4, "Reader thread wakeup (fp:%p)\n", op->fp);
-                if (req != RD_SYNC_NOREAD && !feof(op->fp))
-                        (void)iob_write(op->buf, op->fp, IOB_SAVE_HIST);
-                pthread_mutex_lock(&op->rd_req_mutex);
-                op->rd_req = RD_IDLE;
-                pthread_cond_signal(&op->rd_req_cond); /* sync */
-                pthread_mutex_unlock(&op->rd_req_mutex);
-        }
-
-out:
-        printd(4, "Reader thread stopped (fp:%p)\n", op->fp);
-        return NULL;
-}
-
 /*!
  *****************************************************************************
  *
@@ -3902,63 +5662,667 @@ static int extract_rar_file_info(struct filecache_entry *entry_p, struct RARWcb
         return 0;
 }
 
+/* Admission control of decompression streams */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int max;                        /* 0 = unlimited */
+        int tmo;                        /* seconds */
+        int active;
+        int queued;
+        uint64_t admitted;
+        uint64_t waited;
+        uint64_t rejected;
+        uint64_t wait_us;
+        uint64_t wait_max_us;
+} admit = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .tmo = 60,
+};
+
 /*!
  *****************************************************************************
- *
+ * Give back the slot held by a stream.
  ****************************************************************************/
-static int rar2_open(const char *path, struct fuse_file_info *fi)
+static void __admit_put()
 {
-        ENTER_("%s", path);
+        pthread_mutex_lock(&admit.lock);
+        --admit.active;
+        pthread_cond_signal(&admit.cond);
+        pthread_mutex_unlock(&admit.lock);
+}
 
-        printd(3, "(%05d) %-8s%s [0x%" PRIu64 "][called from %05d]\n", getpid(),
-                        "OPEN", path, fi->fh, fuse_get_context()->pid);
-        struct filecache_entry *entry_p;
-        char *root;
+/* Max number of released streams kept for reuse */
+#define LINGER_MAX 4
 
-        /* When using WinFSP/cygfuse the O_CREAT and O_EXCL flags sometimes
-         * seems to be added to fi->flags in the open callback function.
-         * This is not according to the legacy FUSE API implementation for
-         * which these flags bits are never set. As a workaround, make sure
-         * to clear flag bits that are not expected in calls to open. */
-#ifdef FSP_FUSE_API
-        fi->flags &= ~(O_CREAT | O_EXCL);
-#endif
-        errno = 0;
-        pthread_rwlock_rdlock(&file_access_lock);
-        entry_p = path_lookup(path, NULL);
+/* Seconds a released stream is kept before it is stopped */
+#define LINGER_TMO 10
 
-        if (entry_p == NULL) {
-#if RARVER_MAJOR > 4
-                int cmd = 0;
-                while (file_cmd[cmd]) {
-                        if (!strcmp(&path[strlen(path) - 5], "#info")) {
-                                char *tmp = strdup(path);
-                                tmp[strlen(path) - 5] = 0;
-                                entry_p = path_lookup(tmp, NULL);
-                                free(tmp);
-                                if (entry_p == NULL ||
-                                    entry_p == LOCAL_FS_ENTRY) {
-                                        pthread_rwlock_unlock(&file_access_lock);
-                                        return -EIO;
-                                }
-                                break;
-                        }
-                        ++cmd;
-                }
-#endif
-                if (entry_p == NULL) {
-                        pthread_rwlock_unlock(&file_access_lock);
-                        return -ENOENT;
-                }
-                struct io_handle *io = malloc(sizeof(struct io_handle));
-                if (!io) {
-                        pthread_rwlock_unlock(&file_access_lock);
-                        return -EIO;
-                }
+/* Released stream waiting to be adopted by a new open of the same file */
+struct linger_stream {
+        char *path;
+        struct io_context *op;
+        time_t when;
+        struct linger_stream *next;
+};
 
-                struct filecache_entry *e_p = filecache_clone(entry_p);
-                pthread_rwlock_unlock(&file_access_lock);
-                struct RARWcb *wcb = malloc(sizeof(struct RARWcb));
+static struct linger_stream *linger_list = NULL;
+static int linger_cnt = 0;
+static pthread_mutex_t linger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t linger_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t linger_thread;
+static int linger_thread_up = 0;
+static int linger_stop = 0;
+
+/*!
+ *****************************************************************************
+ * Return the nice value of the calling client, or 0 if not applicable.
+ ****************************************************************************/
+static int __client_nice()
+{
+        int nice = 0;
+
+#ifdef HAVE_SYS_RESOURCE_H
+        if (rar2fs_mount_opts.qos_client) {
+                errno = 0;
+                nice = getpriority(PRIO_PROCESS, fuse_get_context()->pid);
+                if (errno)
+                        nice = 0;
+        }
+#endif
+        return nice;
+}
+
+/*!
+ *****************************************************************************
+ * Stop the decompression stream of |op| and free its buffer. The stream
+ * must already be detached from the I/O threads.
+ ****************************************************************************/
+static void __stream_stop(struct io_context *op)
+{
+        __tail_close(op);
+        if (pclose_(op->pfd, op->pid))
+                printd(4, "child closed abnormally\n");
+        printd(4, "PIPE %d closed towards child %05d\n", op->pfd, op->pid);
+        op->pfd = -1;
+#ifdef DEBUG_READ
+        fclose(op->dbg_fp);
+#endif
+
+#ifdef HAVE_MMAP
+        if (op->buf->idx.data_p != MAP_FAILED && op->buf->idx.mmap)
+                munmap((void *)op->buf->idx.data_p,
+                       P_ALIGN_(ntoh64(op->buf->idx.data_p->head.size)));
+#endif
+        if (op->buf->idx.data_p != MAP_FAILED && !op->buf->idx.mmap)
+                free(op->buf->idx.data_p);
+        if (op->buf->idx.fd != -1)
+                close(op->buf->idx.fd);
+        iob_free(op->buf);
+        op->buf = NULL;
+        affinity_put_group(op->cpu_group);
+        op->cpu_group = -1;
+        __admit_put();
+}
+
+/*!
+ *****************************************************************************
+ * Stop a lingering stream and free what is left of its context.
+ ****************************************************************************/
+static void __linger_free(struct linger_stream *l)
+{
+        struct io_context *op = l->op;
+
+        printd(3, "Dropping lingering stream for %s\n", l->path);
+        __stream_stop(op);
+        pthread_mutex_destroy(&op->start_mutex);
+        filecache_freeclone(op->entry_p);
+        free(op);
+        free(l->path);
+        free(l);
+}
+
+/*!
+ *****************************************************************************
+ * Unlink expired entries and append them to |dead|. Caller must hold
+ * linger_lock.
+ ****************************************************************************/
+static void __linger_expire(struct linger_stream **dead, time_t now)
+{
+        struct linger_stream **pp = &linger_list;
+
+        while (*pp) {
+                struct linger_stream *l = *pp;
+                if (now - l->when >= LINGER_TMO) {
+                        *pp = l->next;
+                        l->next = *dead;
+                        *dead = l;
+                        --linger_cnt;
+                } else {
+                        pp = &l->next;
+                }
+        }
+}
+
+/*!
+ *****************************************************************************
+ * Free all entries in |dead|. Must be called without linger_lock held
+ * since stopping a child may block.
+ ****************************************************************************/
+static void __linger_reap(struct linger_stream *dead)
+{
+        while (dead) {
+                struct linger_stream *l = dead;
+                dead = l->next;
+                __linger_free(l);
+        }
+}
+
+/*!
+ *****************************************************************************
+ * Stop lingering streams as they expire. Without this a stream parked
+ * when there is no further activity would keep its child, buffer and
+ * admission slot forever.
+ ****************************************************************************/
+static void *__linger_reaper(void *data)
+{
+        struct linger_stream *dead;
+        struct linger_stream *l;
+        struct timespec ts;
+        time_t next;
+
+        (void)data;             /* touch */
+
+        pthread_mutex_lock(&linger_lock);
+        while (!linger_stop) {
+                dead = NULL;
+                __linger_expire(&dead, time(NULL));
+                if (dead) {
+                        pthread_mutex_unlock(&linger_lock);
+                        __linger_reap(dead);
+                        pthread_mutex_lock(&linger_lock);
+                        continue;
+                }
+                if (!linger_list) {
+                        pthread_cond_wait(&linger_cond, &linger_lock);
+                        continue;
+                }
+                next = linger_list->when;
+                for (l = linger_list->next; l; l = l->next) {
+                        if (l->when < next)
+                                next = l->when;
+                }
+                ts.tv_sec = next + LINGER_TMO;
+                ts.tv_nsec = 0;
+                (void)pthread_cond_timedwait(&linger_cond, &linger_lock, &ts);
+        }
+        pthread_mutex_unlock(&linger_lock);
+
+        return NULL;
+}
+
+/*!
+ *****************************************************************************
+ * Park the stream of a released |op| for later reuse. On success the
+ * pool takes ownership of |op|. The stream must already be detached from
+ * the I/O threads and QoS.
+ ****************************************************************************/
+static int __linger_park(const char *path, struct io_context *op)
+{
+        struct linger_stream *l;
+        struct linger_stream *dead = NULL;
+        time_t now = time(NULL);
+        int queued;
+
+        /* The slot is better given to someone waiting for it */
+        pthread_mutex_lock(&admit.lock);
+        queued = admit.queued;
+        pthread_mutex_unlock(&admit.lock);
+        if (op->start_failed || queued)
+                return -1;
+        l = malloc(sizeof(struct linger_stream));
+        if (!l)
+                return -1;
+        l->path = strdup(path);
+        if (!l->path) {
+                free(l);
+                return -1;
+        }
+        l->op = op;
+        l->when = now;
+
+        pthread_mutex_lock(&linger_lock);
+        __linger_expire(&dead, now);
+        /* Evict the oldest entry, which is always last in the list */
+        if (linger_cnt == LINGER_MAX) {
+                struct linger_stream **pp = &linger_list;
+                while ((*pp)->next)
+                        pp = &(*pp)->next;
+                (*pp)->next = dead;
+                dead = *pp;
+                *pp = NULL;
+                --linger_cnt;
+        }
+        l->next = linger_list;
+        linger_list = l;
+        ++linger_cnt;
+        if (!linger_thread_up && !linger_stop)
+                linger_thread_up = !pthread_create(&linger_thread, NULL,
+                                                   __linger_reaper, NULL);
+        pthread_cond_signal(&linger_cond);
+        pthread_mutex_unlock(&linger_lock);
+
+        __linger_reap(dead);
+        printd(3, "Parked stream for %s @ %" PRIu64 "\n", path, op->pos);
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Take a lingering stream of |path| able to serve a read at |offset|.
+ * That is, |offset| is still covered by the history window or is ahead
+ * of the stream position. The stream must also belong to the same
+ * version of the file as |e_p|.
+ ****************************************************************************/
+static struct io_context *__linger_take(const char *path,
+                                        const struct filecache_entry *e_p,
+                                        off_t offset)
+{
+        struct linger_stream **pp;
+        struct linger_stream *dead = NULL;
+        struct io_context *op = NULL;
+
+        pthread_mutex_lock(&linger_lock);
+        __linger_expire(&dead, time(NULL));
+        for (pp = &linger_list; *pp; pp = &(*pp)->next) {
+                struct linger_stream *l = *pp;
+                const struct filecache_entry *l_p = l->op->entry_p;
+                if (strcmp(l->path, path) ||
+                    l_p->stat.st_size != e_p->stat.st_size ||
+                    l_p->stat.st_mtime != e_p->stat.st_mtime ||
+                    strcmp(l_p->rar_p, e_p->rar_p) ||
+                    strcmp(l_p->file_p, e_p->file_p))
+                        continue;
+                if (offset + (off_t)IOB_HIST_SZ < l->op->pos)
+                        continue;
+                *pp = l->next;
+                --linger_cnt;
+                op = l->op;
+                free(l->path);
+                free(l);
+                break;
+        }
+        pthread_mutex_unlock(&linger_lock);
+
+        __linger_reap(dead);
+        return op;
+}
+
+/*!
+ *****************************************************************************
+ * Stop the oldest lingering stream. Returns 0 if there was one.
+ ****************************************************************************/
+static int __linger_evict()
+{
+        struct linger_stream **pp;
+        struct linger_stream *l = NULL;
+
+        pthread_mutex_lock(&linger_lock);
+        if (linger_list) {
+                pp = &linger_list;
+                while ((*pp)->next)
+                        pp = &(*pp)->next;
+                l = *pp;
+                *pp = NULL;
+                --linger_cnt;
+        }
+        pthread_mutex_unlock(&linger_lock);
+
+        if (!l)
+                return -1;
+        __linger_free(l);
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Take a slot for a background stream without waiting. Fails if all
+ * slots are taken or if someone is already waiting for one.
+ ****************************************************************************/
+static int __admit_try()
+{
+        int res = -1;
+
+        pthread_mutex_lock(&admit.lock);
+        if (!admit.queued && (!admit.max || admit.active < admit.max)) {
+                ++admit.active;
+                res = 0;
+        }
+        pthread_mutex_unlock(&admit.lock);
+        return res;
+}
+
+/*!
+ *****************************************************************************
+ * Take a slot for a new stream. Lingering streams are stopped first to
+ * make room, after that the caller is queued until a slot is freed or
+ * the timeout expires. Returns 0 if admitted.
+ ****************************************************************************/
+static int __admit_get()
+{
+        struct timeval t1;
+        struct timeval t2;
+        struct timespec ts;
+        int64_t wait;
+
+        pthread_mutex_lock(&admit.lock);
+        while (admit.max && admit.active >= admit.max) {
+                pthread_mutex_unlock(&admit.lock);
+                if (__linger_evict()) {
+                        pthread_mutex_lock(&admit.lock);
+                        break;
+                }
+                pthread_mutex_lock(&admit.lock);
+        }
+        if (admit.max && admit.active >= admit.max) {
+                ++admit.queued;
+                gettimeofday(&t1, NULL);
+                ts.tv_sec = t1.tv_sec + admit.tmo;
+                ts.tv_nsec = t1.tv_usec * 1000;
+                while (admit.active >= admit.max) {
+                        if (pthread_cond_timedwait(&admit.cond, &admit.lock,
+                                                   &ts) == ETIMEDOUT &&
+                            admit.active >= admit.max)
+                                break;
+                }
+                --admit.queued;
+                gettimeofday(&t2, NULL);
+                wait = TV_DIFF_US(t2, t1);
+                if (admit.active >= admit.max) {
+                        ++admit.rejected;
+                        pthread_mutex_unlock(&admit.lock);
+                        syslog(LOG_DEBUG, "stream rejected after waiting "
+                               "%d s for a free slot", admit.tmo);
+                        return -1;
+                }
+                ++admit.waited;
+                admit.wait_us += wait;
+                if ((uint64_t)wait > admit.wait_max_us)
+                        admit.wait_max_us = wait;
+        }
+        ++admit.active;
+        ++admit.admitted;
+        pthread_mutex_unlock(&admit.lock);
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Adopt a lingering stream and its history window instead of starting a
+ * new one. Returns 0 if a stream was adopted.
+ ****************************************************************************/
+static int __stream_adopt(struct io_context *op, const char *path,
+                          off_t offset)
+{
+        struct io_context *p = __linger_take(path, op->entry_p, offset);
+
+        if (!p)
+                return -1;
+
+        op->buf = p->buf;
+        op->pfd = p->pfd;
+        op->pid = p->pid;
+        op->eof = p->eof;
+        op->pos = p->pos;
+        op->cpu_group = p->cpu_group;
+        op->tail = p->tail;
+#ifdef DEBUG_READ
+        op->dbg_fp = p->dbg_fp;
+#endif
+        op->seq = 0;
+        pthread_mutex_destroy(&p->start_mutex);
+        filecache_freeclone(p->entry_p);
+        free(p);
+
+        pthread_mutex_init(&op->rd_req_mutex, NULL);
+        pthread_cond_init(&op->rd_req_cond, NULL);
+        op->rd_req = RD_IDLE;
+        op->qos = qos_register(path, op->pid, __client_nice());
+
+        op->ioh = ioloop_add(op->pfd, __reader_cb, op, op->cpu_group);
+        if (!op->ioh) {
+                qos_unregister(op->qos, NULL);
+                op->qos = NULL;
+                pthread_cond_destroy(&op->rd_req_cond);
+                pthread_mutex_destroy(&op->rd_req_mutex);
+                __stream_stop(op);
+                return -1;
+        }
+
+        printd(3, "Adopted lingering stream for %s @ %" PRIu64 "\n", path,
+               op->pos);
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void linger_destroy()
+{
+        struct linger_stream *dead;
+
+        pthread_mutex_lock(&linger_lock);
+        linger_stop = 1;
+        pthread_cond_signal(&linger_cond);
+        pthread_mutex_unlock(&linger_lock);
+        if (linger_thread_up)
+                pthread_join(linger_thread, NULL);
+
+        pthread_mutex_lock(&linger_lock);
+        linger_thread_up = 0;
+        dead = linger_list;
+        linger_list = NULL;
+        linger_cnt = 0;
+        pthread_mutex_unlock(&linger_lock);
+
+        __linger_reap(dead);
+}
+
+/*!
+ *****************************************************************************
+ * Start decompression of the file behind |op|. This is deferred until the
+ * first read and is performed without holding any global lock.
+ ****************************************************************************/
+static int __stream_start(struct io_context *op, const char *path)
+{
+        struct filecache_entry *entry_p;
+        struct filecache_entry *e_p = op->entry_p;
+        struct iob *buf;
+        int group;
+        int pfd = -1;
+        pid_t pid = 0;
+
+        if (__admit_get())
+                return -EBUSY;
+
+        /* Keep buffer, I/O thread and child on the same CPUs */
+        group = affinity_get_group();
+        buf = iob_alloc(P_ALIGN_(sizeof(struct iob) + IOB_SZ), group);
+        if (!buf)
+                goto start_error;
+        op->buf = buf;
+        op->cpu_group = group;
+
+        /* Open PIPE(s) and create child process */
+        if (OPT_SET(OPT_KEY_SOLID_DECODER) && e_p->flags.solid &&
+            !e_p->flags.encrypted)
+                pfd = popen_solid_(e_p);
+        if (pfd == -1)
+                pfd = popen_(e_p, &pid, group);
+        if (pfd == -1)
+                goto start_error;
+        op->seq = 0;
+        op->pos = 0;
+        op->pfd = pfd;
+        op->eof = 0;
+        op->pid = pid;
+        printd(4, "PIPE %d created towards child %d\n", op->pfd, pid);
+
+        pthread_mutex_init(&op->rd_req_mutex, NULL);
+        pthread_cond_init(&op->rd_req_cond, NULL);
+        op->rd_req = RD_IDLE;
+
+        op->qos = qos_register(path, pid, __client_nice());
+
+        /* Hand over the pipe to the I/O threads */
+        op->ioh = ioloop_add(op->pfd, __reader_cb, op, op->cpu_group);
+        if (!op->ioh)
+                goto start_error;
+        if (sync_thread_noread(op))
+                goto start_error;
+
+        buf->idx.data_p = MAP_FAILED;
+        buf->idx.fd = -1;
+        if (!preload_index(buf, path)) {
+                e_p->flags.save_eof = 0;
+                e_p->flags.direct_io = 0;
+        } else {
+                /* Was the file removed ? */
+                if (get_save_eof(e_p->rar_p) && !e_p->flags.save_eof) {
+                        e_p->flags.save_eof = 1;
+                        e_p->flags.avi_tested = 0;
+                }
+        }
+
+        if (e_p->flags.save_eof && !e_p->flags.avi_tested) {
+                if (check_avi_type(op))
+                        e_p->flags.save_eof = 0;
+                e_p->flags.avi_tested = 1;
+        }
+
+        /* Publish to the cache entry, if still there. If it was
+         * invalidated and re-created meanwhile the results belong to an
+         * older version of the archive and are dropped. */
+        pthread_rwlock_wrlock(&file_access_lock);
+        entry_p = filecache_get(path);
+        if (entry_p && entry_p->gen == e_p->gen) {
+                entry_p->flags.dry_run_done = e_p->flags.dry_run_done;
+                entry_p->flags.save_eof = e_p->flags.save_eof;
+                entry_p->flags.direct_io = e_p->flags.direct_io;
+                entry_p->flags.avi_tested = e_p->flags.avi_tested;
+        }
+        pthread_rwlock_unlock(&file_access_lock);
+
+#ifdef DEBUG_READ
+        char out_file[32];
+        sprintf(out_file, "%s.%d", "output", pid);
+        op->dbg_fp = fopen(out_file, "w");
+#endif
+        return 0;
+
+start_error:
+        if (op->ioh)
+                ioloop_del(op->ioh);
+        op->ioh = NULL;
+        qos_unregister(op->qos, NULL);
+        op->qos = NULL;
+        if (pfd != -1) {
+                pthread_cond_destroy(&op->rd_req_cond);
+                pthread_mutex_destroy(&op->rd_req_mutex);
+                pclose_(pfd, pid);
+        }
+        op->pfd = -1;
+        affinity_put_group(group);
+        op->cpu_group = -1;
+        iob_free(buf);
+        op->buf = NULL;
+        __admit_put();
+        printd(1, "open: I/O error\n");
+        return -EIO;
+}
+
+/*!
+ *****************************************************************************
+ * Start decompression on first read, preferably by adopting a lingering
+ * stream able to serve |offset|. Returns 0 if the stream is running. If
+ * no slot could be had the start is attempted again at the next read.
+ ****************************************************************************/
+static int stream_start(struct io_context *op, const char *path,
+                        off_t offset)
+{
+        int res = 0;
+
+        pthread_mutex_lock(&op->start_mutex);
+        if (op->start_failed) {
+                res = -EIO;
+        } else if (!op->buf && __stream_adopt(op, path, offset)) {
+                res = __stream_start(op, path);
+                if (res == -EIO)
+                        op->start_failed = 1;
+        }
+        pthread_mutex_unlock(&op->start_mutex);
+        return res;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __rar2_open(const char *path, struct fuse_file_info *fi)
+{
+        ENTER_("%s", path);
+
+        printd(3, "(%05d) %-8s%s [0x%" PRIu64 "][called from %05d]\n", getpid(),
+                        "OPEN", path, fi->fh, fuse_get_context()->pid);
+        struct filecache_entry *entry_p;
+        char *root;
+
+        /* When using WinFSP/cygfuse the O_CREAT and O_EXCL flags sometimes
+         * seems to be added to fi->flags in the open callback function.
+         * This is not according to the legacy FUSE API implementation for
+         * which these flags bits are never set. As a workaround, make sure
+         * to clear flag bits that are not expected in calls to open. */
+#ifdef FSP_FUSE_API
+        fi->flags &= ~(O_CREAT | O_EXCL);
+#endif
+        errno = 0;
+        pthread_rwlock_rdlock(&file_access_lock);
+        entry_p = path_lookup(path, NULL);
+
+        if (entry_p == NULL) {
+#if RARVER_MAJOR > 4
+                int cmd = 0;
+                while (file_cmd[cmd]) {
+                        if (!strcmp(&path[strlen(path) - 5], "#info")) {
+                                char *tmp = strdup(path);
+                                tmp[strlen(path) - 5] = 0;
+                                entry_p = path_lookup(tmp, NULL);
+                                free(tmp);
+                                if (entry_p == NULL ||
+                                    entry_p == LOCAL_FS_ENTRY) {
+                                        pthread_rwlock_unlock(&file_access_lock);
+                                        return -EIO;
+                                }
+                                break;
+                        }
+                        ++cmd;
+                }
+#endif
+                if (entry_p == NULL) {
+                        pthread_rwlock_unlock(&file_access_lock);
+                        return -ENOENT;
+                }
+                struct io_handle *io = malloc(sizeof(struct io_handle));
+                if (!io) {
+                        pthread_rwlock_unlock(&file_access_lock);
+                        return -EIO;
+                }
+
+                struct filecache_entry *e_p = filecache_clone(entry_p);
+                pthread_rwlock_unlock(&file_access_lock);
+                struct RARWcb *wcb = malloc(sizeof(struct RARWcb));
                 memset(wcb, 0, sizeof(struct RARWcb));
                 FH_SETIO(fi->fh, io);
                 FH_SETTYPE(fi->fh, IO_TYPE_INFO);
@@ -3975,6 +6339,13 @@ static int rar2_open(const char *path, struct fuse_file_info *fi)
                 ABS_ROOT(root, path);
                 return lopen(root, fi);
         }
+        if (mount_type == MOUNT_FOLDER) {
+                char *tmp = strdup(path);
+                if (tmp) {
+                        history_add(__gnu_dirname(tmp));
+                        free(tmp);
+                }
+        }
         /*
          * For files inside RAR archives open for exclusive write access
          * is not permitted. That implicity includes also O_TRUNC.
@@ -3986,33 +6357,42 @@ static int rar2_open(const char *path, struct fuse_file_info *fi)
                 return -EPERM;
         }
 
-        FILE *fp = NULL;
-        struct iob *buf = NULL;
         struct io_context *op = NULL;
         struct io_handle* io = NULL;
-        pid_t pid = 0;
+        struct filecache_entry *e_p;    /* private copy of cache entry */
+
+        /*
+         * Nothing below is performed while holding the global lock. It
+         * would otherwise stall every other open and getattr while waiting
+         * for disk or for the child. Work is done on a private copy of the
+         * cache entry and what was learnt is published at the end.
+         */
+        e_p = filecache_clone(entry_p);
+        pthread_rwlock_unlock(&file_access_lock);
+        if (!e_p)
+                return -EIO;
 
         if (!FH_ISSET(fi->fh)) {
-                if (entry_p->flags.raw) {
-                        fp = fopen(entry_p->rar_p, "r");
-                        if (fp != NULL) {
+                if (e_p->flags.raw) {
+                        if (!access(e_p->rar_p, R_OK)) {
                                 io = malloc(sizeof(struct io_handle));
                                 op = calloc(1, sizeof(struct io_context));
                                 if (!op || !io)
                                         goto open_error;
-                                printd(3, "Opened %s\n", entry_p->rar_p);
+                                printd(3, "Opened %s\n", e_p->rar_p);
                                 FH_SETIO(fi->fh, io);
                                 FH_SETTYPE(fi->fh, IO_TYPE_RAW);
                                 FH_SETCONTEXT(fi->fh, op);
                                 printd(3, "(%05d) %-8s%s [%-16p]\n", getpid(), "ALLOC", path, FH_TOCONTEXT(fi->fh));
                                 pthread_mutex_init(&op->raw_read_mutex, NULL);
-                                op->fp = fp;
+                                op->pfd = -1;
                                 op->pid = 0;
                                 op->seq = 0;
                                 op->buf = NULL;
-                                op->entry_p = NULL;
+                                op->entry_p = e_p;
                                 op->pos = 0;
                                 op->vno = -1;   /* force a miss 1:st time */
+                                op->cpu_group = -1;
 
                                 /*
                                  * Disable flushing the kernel cache of the file contents on
@@ -4026,12 +6406,8 @@ static int rar2_open(const char *path, struct fuse_file_info *fi)
                                 fi->keep_cache = 1;
 #endif
 
-                                /*
-                                 * Make sure cache entry is filled in completely
-                                 * before cloning it
-                                 */
-                                op->entry_p = filecache_clone(entry_p);
-                                if (!op->entry_p)
+                                op->rio = rawio_open(__rawio_open_vol, op);
+                                if (!op->rio)
                                         goto open_error;
                                 goto open_end;
                         }
@@ -4039,113 +6415,46 @@ static int rar2_open(const char *path, struct fuse_file_info *fi)
                         goto open_error;
                 }
 
-                buf = iob_alloc(P_ALIGN_(sizeof(struct iob) + IOB_SZ));
-                if (!buf)
-                        goto open_error;
-
                 io = malloc(sizeof(struct io_handle));
                 op = calloc(1, sizeof(struct io_context));
                 if (!op || !io)
                         goto open_error;
-                op->buf = buf;
-                op->entry_p = NULL;
-
-                /* Open PIPE(s) and create child process */
-                fp = popen_(entry_p, &pid);
-                if (fp != NULL) {
-                        FH_SETIO(fi->fh, io);
-                        FH_SETTYPE(fi->fh, IO_TYPE_RAR);
-                        FH_SETCONTEXT(fi->fh, op);
-                        printd(3, "(%05d) %-8s%s [%-16p]\n", getpid(), "ALLOC",
-                                                path, FH_TOCONTEXT(fi->fh));
-                        op->seq = 0;
-                        op->pos = 0;
-                        op->fp = fp;
-                        op->pid = pid;
-                        printd(4, "PIPE %p created towards child %d\n",
-                                                op->fp, pid);
-
-                        pthread_mutex_init(&op->rd_req_mutex, NULL);
-                        pthread_cond_init(&op->rd_req_cond, NULL);
-                        op->rd_req = RD_IDLE;
-
-                        /*
-                         * The below will take precedence over keep_cache.
-                         * This flag will allow the filesystem to bypass the page cache using
-                         * the "direct_io" flag.  This is not the same as O_DIRECT, it's
-                         * dictated by the filesystem not the application.
-                         * Since compressed archives might sometimes require fake data to be
-                         * returned in read requests, a cache might cause the same faulty
-                         * information to be propagated to sub-sequent reads. Setting this
-                         * flag will force _all_ reads to enter the filesystem.
-                         */
-#if 0 /* disable for now */
-                        if (entry_p->flags.direct_io)
-                                fi->direct_io = 1;
-#endif
 
-                        /* Create reader thread */
-                        if (pthread_create(&op->thread, &thread_attr, reader_task, (void *)op))
-                                goto open_error;
-                        if (sync_thread_noread(op))
-                                goto open_error;
-
-                        /* Promote to a write lock since we might need to
-                         * change the cache entry below. */
-			pthread_rwlock_unlock(&file_access_lock);
-			pthread_rwlock_wrlock(&file_access_lock);
-
-                        buf->idx.data_p = MAP_FAILED;
-                        buf->idx.fd = -1;
-                        if (!preload_index(buf, path)) {
-                                entry_p->flags.save_eof = 0;
-                                entry_p->flags.direct_io = 0;
-                                fi->direct_io = 0;
-                        } else {
-                                /* Was the file removed ? */
-                                if (get_save_eof(entry_p->rar_p) && !entry_p->flags.save_eof) {
-                                        entry_p->flags.save_eof = 1;
-                                        entry_p->flags.avi_tested = 0;
-                                }
-                        }
-
-                        if (entry_p->flags.save_eof && !entry_p->flags.avi_tested) {
-                                if (check_avi_type(op))
-                                        entry_p->flags.save_eof = 0;
-                                entry_p->flags.avi_tested = 1;
-                        }
+                /*
+                 * Decompression is not started until the first read.
+                 * Many clients open and close files without reading.
+                 */
+                op->entry_p = e_p;
+                op->pfd = -1;
+                op->cpu_group = -1;
+                pthread_mutex_init(&op->start_mutex, NULL);
+                FH_SETIO(fi->fh, io);
+                FH_SETTYPE(fi->fh, IO_TYPE_RAR);
+                FH_SETCONTEXT(fi->fh, op);
+                printd(3, "(%05d) %-8s%s [%-16p]\n", getpid(), "ALLOC",
+                                        path, FH_TOCONTEXT(fi->fh));
 
-#ifdef DEBUG_READ
-                        char out_file[32];
-                        sprintf(out_file, "%s.%d", "output", pid);
-                        op->dbg_fp = fopen(out_file, "w");
+                /*
+                 * The below will take precedence over keep_cache.
+                 * This flag will allow the filesystem to bypass the page cache using
+                 * the "direct_io" flag.  This is not the same as O_DIRECT, it's
+                 * dictated by the filesystem not the application.
+                 * Since compressed archives might sometimes require fake data to be
+                 * returned in read requests, a cache might cause the same faulty
+                 * information to be propagated to sub-sequent reads. Setting this
+                 * flag will force _all_ reads to enter the filesystem.
+                 */
+#if 0 /* disable for now */
+                if (e_p->flags.direct_io)
+                        fi->direct_io = 1;
 #endif
-                        /*
-                         * Make sure cache entry is filled in completely
-                         * before cloning it
-                         */
-                        op->entry_p = filecache_clone(entry_p);
-                        if (!op->entry_p)
-                                goto open_error;
-                        goto open_end;
-                }
+                goto open_end;
         }
 
 open_error:
-        pthread_rwlock_unlock(&file_access_lock);
-        if (fp) {
-                if (entry_p->flags.raw)
-                        fclose(fp);
-                else
-                        pclose_(fp, pid);
-        }
 	free(io);
-        if (op) {
-                if (op->entry_p)
-                        filecache_freeclone(op->entry_p);
-                free(op);
-        }
-        iob_free(buf);
+        free(op);
+        filecache_freeclone(e_p);
 
         /*
          * This is the best we can return here. So many different things
@@ -4158,10 +6467,28 @@ open_error:
 open_end:
         FH_SETPATH(fi->fh, strdup(path));
         op->entry_p->flags.check_atime = 1;
-        pthread_rwlock_unlock(&file_access_lock);
         return 0;
 }
 
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int rar2_open(const char *path, struct fuse_file_info *fi)
+{
+        struct timeval t1;
+        int res;
+
+        if (!warmup_active)
+                return __rar2_open(path, fi);
+
+        /* Sample latency to let a running cache warmup back off */
+        gettimeofday(&t1, NULL);
+        res = __rar2_open(path, fi);
+        __warmup_fg_update(&t1);
+        return res;
+}
+
 /*!
  *****************************************************************************
  *
@@ -4198,149 +6525,811 @@ static inline int access_chk(const char *path, int new_file)
         return e && !e->flags.unresolved ? 1 : 0;
 }
 
+/* Foreground latency above which warmup backs off */
+#define WARMUP_FG_LATENCY_US 20000
+/* Foreground samples older than this are considered stale */
+#define WARMUP_FG_IDLE_US 1000000
+#define WARMUP_BACKOFF_MIN_US 10000
+#define WARMUP_BACKOFF_MAX_US 500000
+
+static struct {
+        pthread_mutex_t lock;
+        unsigned long lat_avg;          /* moving average (us) */
+        struct timeval last;
+        double tokens;                  /* directories */
+        double io_tokens;               /* bytes */
+        double cpu_tokens;              /* CPU time (us) */
+        struct timeval refill;
+} warmup_budget = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*!
+ *****************************************************************************
+ * Account latency of a foreground operation that started at |t1|.
+ ****************************************************************************/
+static void __warmup_fg_update(const struct timeval *t1)
+{
+        struct timeval t2;
+        int64_t lat;
+
+        gettimeofday(&t2, NULL);
+        lat = TV_DIFF_US(t2, *t1);
+        if (lat < 0)
+                return;
+        pthread_mutex_lock(&warmup_budget.lock);
+        if (TV_DIFF_US(t2, warmup_budget.last) > WARMUP_FG_IDLE_US)
+                warmup_budget.lat_avg = lat;
+        else
+                warmup_budget.lat_avg = (warmup_budget.lat_avg * 7 + lat) / 8;
+        warmup_budget.last = t2;
+        pthread_mutex_unlock(&warmup_budget.lock);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __warmup_fg_busy()
+{
+        struct timeval now;
+        int busy;
+
+        gettimeofday(&now, NULL);
+        pthread_mutex_lock(&warmup_budget.lock);
+        busy = warmup_budget.lat_avg > WARMUP_FG_LATENCY_US &&
+               TV_DIFF_US(now, warmup_budget.last) <= WARMUP_FG_IDLE_US;
+        pthread_mutex_unlock(&warmup_budget.lock);
+        return busy;
+}
+
+/* Resources consumed by the calling warmup worker thread */
+struct warmup_usage {
+        uint64_t io;                    /* bytes read */
+        uint64_t cpu;                   /* CPU time (us) */
+};
+
+/*!
+ *****************************************************************************
+ * Sample the resources consumed so far by the calling thread. Only what
+ * is needed by the configured budgets is sampled.
+ ****************************************************************************/
+static void __warmup_usage(struct warmup_usage *u)
+{
+        u->io = 0;
+        u->cpu = 0;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+        if (rar2fs_mount_opts.warmup_cpu > 0) {
+                struct timespec ts;
+                if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+                        u->cpu = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+        }
+#endif
+#ifdef __linux__
+        if (rar2fs_mount_opts.warmup_io > 0) {
+                /* Bytes passed through read(2) and friends by this thread,
+                 * whether served from the page cache or not. */
+                FILE *fp = fopen("/proc/thread-self/io", "r");
+                char line[64];
+                if (fp) {
+                        while (fgets(line, sizeof(line), fp)) {
+                                if (sscanf(line, "rchar: %" SCNu64,
+                                           &u->io) == 1)
+                                        break;
+                        }
+                        fclose(fp);
+                }
+        }
+#endif
+}
+
+/*!
+ *****************************************************************************
+ * Add tokens for the time elapsed since the last refill. Each bucket
+ * allows a burst of at most one second worth of tokens. Must be called
+ * with the budget lock held.
+ ****************************************************************************/
+static void __warmup_refill()
+{
+        double rate = rar2fs_mount_opts.warmup_rate;
+        double io = rar2fs_mount_opts.warmup_io * 1024.0;
+        double cpu = rar2fs_mount_opts.warmup_cpu * 10000.0;
+        struct timeval now;
+        double sec;
+
+        gettimeofday(&now, NULL);
+        sec = (double)TV_DIFF_US(now, warmup_budget.refill) / 1000000;
+        warmup_budget.refill = now;
+        if (sec <= 0)
+                return;
+        warmup_budget.tokens += rate * sec;
+        if (warmup_budget.tokens > rate)
+                warmup_budget.tokens = rate;
+        warmup_budget.io_tokens += io * sec;
+        if (warmup_budget.io_tokens > io)
+                warmup_budget.io_tokens = io;
+        warmup_budget.cpu_tokens += cpu * sec;
+        if (warmup_budget.cpu_tokens > cpu)
+                warmup_budget.cpu_tokens = cpu;
+}
+
+/*!
+ *****************************************************************************
+ * Called before each warmup task. Backs off while foreground operations
+ * suffer from high latency and then waits until every configured budget
+ * allows another task. The I/O and CPU budgets may run into debt since
+ * the cost of a task is not known until it is charged by
+ * __warmup_charge().
+ ****************************************************************************/
+static void __warmup_throttle()
+{
+        useconds_t backoff = WARMUP_BACKOFF_MIN_US;
+        int rate = rar2fs_mount_opts.warmup_rate;
+        int io = rar2fs_mount_opts.warmup_io;
+        int cpu = rar2fs_mount_opts.warmup_cpu;
+        int64_t wait;
+        int64_t w;
+
+        while (!warmup_cancelled && __warmup_fg_busy()) {
+                pthread_mutex_lock(&warmup_lock);
+                ++warmup_progress.backoffs;
+                pthread_mutex_unlock(&warmup_lock);
+                usleep(backoff);
+                if (backoff < WARMUP_BACKOFF_MAX_US)
+                        backoff *= 2;
+        }
+
+        if (rate <= 0 && io <= 0 && cpu <= 0)
+                return;
+
+        while (!warmup_cancelled) {
+                wait = 0;
+                pthread_mutex_lock(&warmup_budget.lock);
+                __warmup_refill();
+                if (rate > 0 && warmup_budget.tokens < 1) {
+                        w = (1 - warmup_budget.tokens) * 1000000 / rate;
+                        wait = w > wait ? w : wait;
+                }
+                if (io > 0 && warmup_budget.io_tokens < 0) {
+                        w = -warmup_budget.io_tokens * 1000000 /
+                                        (io * 1024.0);
+                        wait = w > wait ? w : wait;
+                }
+                if (cpu > 0 && warmup_budget.cpu_tokens < 0) {
+                        w = -warmup_budget.cpu_tokens * 100 / cpu;
+                        wait = w > wait ? w : wait;
+                }
+                if (!wait) {
+                        if (rate > 0)
+                                warmup_budget.tokens -= 1;
+                        pthread_mutex_unlock(&warmup_budget.lock);
+                        return;
+                }
+                pthread_mutex_unlock(&warmup_budget.lock);
+                usleep(wait);
+        }
+}
+
+/*!
+ *****************************************************************************
+ * Charge the I/O and CPU budgets for what the calling thread consumed
+ * since |u0| was sampled.
+ ****************************************************************************/
+static void __warmup_charge(const struct warmup_usage *u0)
+{
+        struct warmup_usage u1;
+
+        if (rar2fs_mount_opts.warmup_io <= 0 &&
+            rar2fs_mount_opts.warmup_cpu <= 0)
+                return;
+        __warmup_usage(&u1);
+        pthread_mutex_lock(&warmup_budget.lock);
+        __warmup_refill();
+        if (u1.io > u0->io)
+                warmup_budget.io_tokens -= u1.io - u0->io;
+        if (u1.cpu > u0->cpu)
+                warmup_budget.cpu_tokens -= u1.cpu - u0->cpu;
+        pthread_mutex_unlock(&warmup_budget.lock);
+}
+
+/*!
+ *****************************************************************************
+ * Lower the CPU and I/O priority of the calling warmup worker thread.
+ ****************************************************************************/
+static void __warmup_worker_init()
+{
+#if defined ( __linux__ ) && defined ( SYS_gettid )
+        pid_t tid = syscall(SYS_gettid);
+#ifdef SYS_ioprio_set
+        /* From linux/ioprio.h */
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+                printd(3, "ioprio_set: %s\n", strerror(errno));
+#endif
+#ifdef HAVE_SYS_RESOURCE_H
+        /* On Linux the nice value is a per-thread attribute */
+        if (setpriority(PRIO_PROCESS, tid, 19) == -1)
+                printd(3, "setpriority: %s\n", strerror(errno));
+#endif
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __warmup_sync_task(void *data)
+{
+        char *dname = data;
+        const char *root = &dname[warmup_src_len];
+        struct warmup_usage u;
+
+        if (warmup_cancelled)
+                goto out;
+        if (*root == '\0')
+                root = "/";
+        __warmup_throttle();
+        __warmup_usage(&u);
+        syncdir(root);
+        __warmup_charge(&u);
+
+        pthread_mutex_lock(&warmup_lock);
+        if (!(++warmup_progress.dirs_synced % 10000))
+                syslog(LOG_DEBUG, "cache warmup: %u of %u directories synced",
+                       warmup_progress.dirs_synced,
+                       warmup_progress.dirs_found);
+        pthread_mutex_unlock(&warmup_lock);
+
+out:
+        free(dname);
+}
+
+/*!
+ *****************************************************************************
+ * Sync a directory from the access history. Since the path might be
+ * inside an archive, use the closest ancestor that exists in the source
+ * folder.
+ ****************************************************************************/
+static void __warmup_hot_task(void *data)
+{
+        char *path = data;
+        char *root;
+        struct stat st;
+        struct warmup_usage u;
+
+        while (!warmup_cancelled) {
+                ABS_ROOT(root, path);
+                if (!stat(root, &st) && S_ISDIR(st.st_mode)) {
+                        __warmup_throttle();
+                        __warmup_usage(&u);
+                        syncdir(path);
+                        __warmup_charge(&u);
+                        break;
+                }
+                if (!strcmp(path, "/"))
+                        break;
+                path = __gnu_dirname(path);
+        }
+
+        free(data);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __warmup_submit(void (*fn)(void *), const char *dname)
+{
+        char *tmp = strdup(dname);
+
+        if (tmp && threadpool_submit(warmup_pool, fn, tmp))
+                free(tmp);
+}
+
+/*!
+ *****************************************************************************
+ * Enumerate sub-directories of |data| and queue each of them as a new
+ * task. The directory itself is queued for a syncdir() task.
+ ****************************************************************************/
+static void __warmup_walk_task(void *data)
+{
+        char *dname = data;
+        struct dirent *dent;
+        DIR *dir = NULL;
+        char *fn = NULL;
+        struct stat st;
+        struct warmup_usage u;
+        int charge = 0;
+        int len;
+
+        if (warmup_cancelled)
+                goto out;
+
+        pthread_mutex_lock(&warmup_lock);
+        ++warmup_progress.dirs_found;
+        pthread_mutex_unlock(&warmup_lock);
+        __warmup_submit(__warmup_sync_task, dname);
+        __warmup_throttle();
+        __warmup_usage(&u);
+        charge = 1;
+
+        len = strlen(dname);
+        if (len >= FILENAME_MAX - 1)
+                goto out;
+
+        dir = opendir(dname);
+        if (dir == NULL)
+                goto out;
+
+        /* From www.gnu.org:
+         *   Macro: int FILENAME_MAX
+         *     The value of this macro is an integer constant expression that
+         *     represents the maximum length of a file name string. It is
+         *     defined in stdio.h.
+         *
+         *     Unlike PATH_MAX, this macro is defined even if there is no actual
+         *     limit imposed. In such a case, its value is typically a very
+         *     large number. This is always the case on GNU/Hurd systems.
+         *
+         *     Usage Note: Don't use FILENAME_MAX as the size of an array in
+         *     which to store a file name! You can't possibly make an array that
+         *     big! Use dynamic allocation instead.
+         */
+        fn = malloc(FILENAME_MAX);
+        if (fn == NULL)
+                goto out;
+
+        strcpy(fn, dname);
+        fn[len++] = '/';
+
+        /* Do not use reentrant version of readdir(3) here, each task
+         * is using its own directory stream. */
+        while ((dent = readdir(dir))) {
+                if (warmup_cancelled)
+                        break;
+                /* Skip '.' and '..' */
+                if (dent->d_name[0] == '.') {
+                        if (dent->d_name[1] == 0 ||
+                                        (dent->d_name[1] == '.' &&
+                                        dent->d_name[2] == 0))
+                                continue;
+                }
+
+                strncpy(fn + len, dent->d_name, FILENAME_MAX - len);
+#ifdef _DIRENT_HAVE_D_TYPE
+                if (dent->d_type != DT_UNKNOWN) {
+                        if (dent->d_type == DT_DIR)
+                                __warmup_submit(__warmup_walk_task, fn);
+                        continue;
+                }
+#endif
+                if (lstat(fn, &st) == -1)
+                        continue;
+                /* will be false for symlinked dirs */
+                if (S_ISDIR(st.st_mode))
+                        __warmup_submit(__warmup_walk_task, fn);
+        }
+
+out:
+        free(fn);
+        if (dir)
+                closedir(dir);
+        if (charge)
+                __warmup_charge(&u);
+        free(dname);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void *warmup_task(void *data)
+{
+        (void)data;
+        const char *dir = OPT_STR(OPT_KEY_SRC, 0);
+        struct threadpool_stats stats;
+        struct timeval t1;
+        struct timeval t2;
+        char **hot;
+        int n;
+        int i;
+
+        pthread_detach(pthread_self());
+
+        syslog(LOG_DEBUG, "cache warmup started");
+        gettimeofday(&t1, NULL);
+
+        memset(&warmup_progress, 0, sizeof(warmup_progress));
+        warmup_src_len = strlen(dir);
+        gettimeofday(&warmup_budget.refill, NULL);
+        warmup_budget.tokens = 0;
+        warmup_pool = threadpool_create(rar2fs_mount_opts.warmup,
+                                        __warmup_worker_init);
+        if (!warmup_pool)
+                goto out;
+
+        /* Start with the directories accessed recently, when all of them
+         * are done continue with the rest of the tree. */
+        n = history_get(&hot);
+        if (n) {
+                for (i = 0; i < n; i++)
+                        __warmup_submit(__warmup_hot_task, hot[i]);
+                history_free(hot, n);
+                threadpool_wait(warmup_pool);
+                gettimeofday(&t2, NULL);
+                syslog(LOG_DEBUG, "cache warmup: %d recently accessed "
+                       "directories synced after %d ms", n,
+                       (int)((t2.tv_sec - t1.tv_sec) * 1000 +
+                             (t2.tv_usec - t1.tv_usec) / 1000));
+        }
+
+        __warmup_submit(__warmup_walk_task, dir);
+        threadpool_wait(warmup_pool);
+        threadpool_get_stats(warmup_pool, &stats);
+        threadpool_destroy(warmup_pool);
+        warmup_pool = NULL;
+
+        if (!warmup_cancelled) {
+                gettimeofday(&t2, NULL);
+                syslog(LOG_DEBUG, "cache warmup completed after %d seconds",
+                       (int)(t2.tv_sec - t1.tv_sec));
+                syslog(LOG_DEBUG, "cache warmup: %u directories, "
+                       "%" PRIu64 " tasks (%" PRIu64 " stolen), "
+                       "%u back-offs", warmup_progress.dirs_synced,
+                       stats.executed, stats.stolen,
+                       warmup_progress.backoffs);
+                __listrar_stats_report();
+        }
+
+out:
+        pthread_mutex_lock(&warmup_lock);
+        --warmup_active;
+        pthread_cond_broadcast(&warmup_cond);
+        pthread_mutex_unlock(&warmup_lock);
+
+        return NULL;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void warmup_start()
+{
+        pthread_t t;
+
+        pthread_mutex_lock(&warmup_lock);
+        ++warmup_active;
+        pthread_mutex_unlock(&warmup_lock);
+        if (pthread_create(&t, NULL, warmup_task, NULL)) {
+                pthread_mutex_lock(&warmup_lock);
+                --warmup_active;
+                pthread_cond_broadcast(&warmup_cond);
+                pthread_mutex_unlock(&warmup_lock);
+        }
+}
+
+struct refresh_work {
+        char *dir;              /* mount relative path of directory */
+        char *arch;             /* single archive, or NULL for all */
+        int recursive;
+        struct refresh_work *next;
+};
+
+/* Refreshes waiting for the background pool, oldest first. Requests
+ * are coalesced here until a worker picks them up. */
+static struct refresh_work *refresh_queue = NULL;
+static volatile int refresh_active = 0;
+static int refresh_cancelled = 0;
+
+/*!
+ *****************************************************************************
+ * Read all headers of an archive volume, which brings them into the
+ * page cache of the host so that a following listing will not need to
+ * touch the disk.
+ ****************************************************************************/
+static void __refresh_prefetch_arch(const char *arch)
+{
+        unsigned int flags = 0;
+        RARArchiveDataEx *arc;
+        void *h;
+
+        h = rarhdr_open(arch, &flags);
+        if (!h)
+                return;
+        while (!refresh_cancelled && rarhdr_list(h, &arc) == ERAR_SUCCESS)
+                ;
+        rarhdr_close(h);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __refresh_walk(const char *dname, size_t src_len, int prefetch,
+                int recursive)
+{
+        struct dirent *dent;
+        DIR *dir;
+        char *fn;
+        struct stat st;
+        size_t len;
+        int is_dir;
+
+        if (!prefetch) {
+                const char *path = &dname[src_len];
+                syncdir(*path ? path : "/");
+                if (!recursive)
+                        return;
+        }
+
+        dir = opendir(dname);
+        if (dir == NULL)
+                return;
+        len = strlen(dname);
+        fn = malloc(len + NAME_MAX + 2);
+        if (fn == NULL) {
+                closedir(dir);
+                return;
+        }
+        strcpy(fn, dname);
+        fn[len++] = '/';
+
+        while (!refresh_cancelled && (dent = readdir(dir))) {
+                /* Skip '.' and '..' */
+                if (dent->d_name[0] == '.') {
+                        if (dent->d_name[1] == 0 ||
+                                        (dent->d_name[1] == '.' &&
+                                        dent->d_name[2] == 0))
+                                continue;
+                }
+                strncpy(fn + len, dent->d_name, NAME_MAX + 1);
+                fn[len + NAME_MAX] = 0;
+#ifdef _DIRENT_HAVE_D_TYPE
+                if (dent->d_type != DT_UNKNOWN) {
+                        is_dir = dent->d_type == DT_DIR;
+                        if (!is_dir && dent->d_type != DT_REG)
+                                continue;
+                } else
+#endif
+                {
+                        if (lstat(fn, &st) == -1)
+                                continue;
+                        is_dir = S_ISDIR(st.st_mode);
+                        if (!is_dir && !S_ISREG(st.st_mode))
+                                continue;
+                }
+                if (is_dir) {
+                        if (recursive)
+                                __refresh_walk(fn, src_len, prefetch, 1);
+                        continue;
+                }
+                if (prefetch && strlen(dent->d_name) >= 4 &&
+                    (IS_RAR(dent->d_name) || IS_CBR(dent->d_name) ||
+                     IS_NNN(dent->d_name) || IS_RXX(dent->d_name)))
+                        __refresh_prefetch_arch(fn);
+        }
+
+        free(fn);
+        closedir(dir);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __refresh_free(struct refresh_work *w)
+{
+        free(w->dir);
+        free(w->arch);
+        free(w);
+}
+
 /*!
  *****************************************************************************
- *
+ * Returns non-zero if |dir| is |parent| or below it.
  ****************************************************************************/
-static void *walkpath_task(void *data)
+static int __refresh_is_below(const char *dir, const char *parent)
 {
-        pthread_detach(pthread_self());
-
-        syncdir(data);
-        free(data);
-
-        pthread_mutex_lock(&warmup_lock);
-        --warmup_threads;
-        pthread_cond_broadcast(&warmup_cond);
-        pthread_mutex_unlock(&warmup_lock);
+        size_t len = strlen(parent);
 
-        return NULL;
+        if (!strcmp(parent, "/"))
+                return 1;
+        return !strncmp(dir, parent, len) &&
+               (dir[len] == '/' || dir[len] == '\0');
 }
 
 /*!
  *****************************************************************************
- *
+ * Merge |w| with the refreshes already queued. Returns non-zero if it is
+ * covered by a queued refresh and should be dropped, otherwise |w| is
+ * appended to the queue. A queued recursive refresh of an ancestor covers
+ * everything below it and a recursive refresh makes queued refreshes of
+ * any descendants redundant. Must be called with warmup_lock held.
  ****************************************************************************/
-static void walkpath(const char *dname, size_t src_len)
+static int __refresh_enqueue(struct refresh_work *w)
 {
-        pthread_t t;
-        struct dirent *dent;
-        DIR *dir = NULL;
-        char *fn = NULL;
-        struct stat st;
-        int len;
-        const char *root = &dname[src_len];
+        struct refresh_work **pp = &refresh_queue;
+        struct refresh_work *q;
 
-        if (*root == '\0')
-              root = "/";
-        root = strdup(root);
-        if (root == NULL)
-                goto out;
+        for (q = refresh_queue; q; q = q->next) {
+                if (q->recursive && __refresh_is_below(w->dir, q->dir))
+                        return 1;
+                if (!strcmp(q->dir, w->dir)) {
+                        /* Same directory, prefetch all of it if the
+                         * requests are for different archives */
+                        if (!w->arch || !q->arch ||
+                            strcmp(w->arch, q->arch)) {
+                                free(q->arch);
+                                q->arch = NULL;
+                        }
+                        q->recursive |= w->recursive;
+                        return 1;
+                }
+        }
 
-        pthread_mutex_lock(&warmup_lock);
-        while (warmup_threads > (rar2fs_mount_opts.warmup - 1))
-                pthread_cond_wait(&warmup_cond, &warmup_lock);
-        ++warmup_threads;
-        pthread_mutex_unlock(&warmup_lock);
-        if (pthread_create(&t, NULL, walkpath_task, (void *)root)) {
-                free((void *)root);
-                goto out;
+        while ((q = *pp)) {
+                if (w->recursive && __refresh_is_below(q->dir, w->dir)) {
+                        *pp = q->next;
+                        __refresh_free(q);
+                        continue;
+                }
+                pp = &q->next;
         }
+        w->next = NULL;
+        *pp = w;
+        return 0;
+}
 
-        len = strlen(dname);
-        if (len >= FILENAME_MAX - 1)
-                return;
+/*!
+ *****************************************************************************
+ * Refresh the caches for a directory (sub-tree) in two passes. The first
+ * pass reads archive headers while the current cache entries are still
+ * in use. The second pass drops the cache entries and immediately
+ * re-lists the directories, which should now be served mostly from
+ * memory. Any request arriving in between is resolved on demand, just as
+ * for any other cache miss.
+ ****************************************************************************/
+static void refresh_task(void *data)
+{
+        struct refresh_work *w;
+        const char *src = OPT_STR(OPT_KEY_SRC, 0);
+        size_t src_len = strlen(src);
+        struct timeval t1;
+        struct timeval t2;
+        char *root;
 
-        dir = opendir(dname);
-        if (dir == NULL)
-                goto out;
+        (void)data;             /* touch */
 
-        /* From www.gnu.org:
-         *   Macro: int FILENAME_MAX
-         *     The value of this macro is an integer constant expression that
-         *     represents the maximum length of a file name string. It is
-         *     defined in stdio.h.
-         *
-         *     Unlike PATH_MAX, this macro is defined even if there is no actual
-         *     limit imposed. In such a case, its value is typically a very
-         *     large number. This is always the case on GNU/Hurd systems.
-         *
-         *     Usage Note: Don't use FILENAME_MAX as the size of an array in
-         *     which to store a file name! You can't possibly make an array that
-         *     big! Use dynamic allocation instead.
-         */
-        fn = malloc(FILENAME_MAX);
-        if (fn == NULL)
+        /* One task is queued per request but requests may have been
+         * coalesced since, in which case there is nothing left to do. */
+        pthread_mutex_lock(&warmup_lock);
+        w = refresh_queue;
+        if (w)
+                refresh_queue = w->next;
+        pthread_mutex_unlock(&warmup_lock);
+        if (!w)
                 goto out;
 
-        strcpy(fn, dname);
-        fn[len++] = '/';
-
-        /* Do not use reentrant version of readdir(3) here.
-         * This needs to be revisted if other threads starts to use it. */
-        while ((dent = readdir(dir))) {
-                if (warmup_cancelled)
-                        break;
-                /* Skip '.' and '..' */
-                if (dent->d_name[0] == '.') {
-                        if (dent->d_name[1] == 0 ||
-                                        (dent->d_name[1] == '.' &&
-                                        dent->d_name[2] == 0))
-                                continue;
-                }
+        gettimeofday(&t1, NULL);
+        ABS_ROOT(root, w->dir);
+        /* Headers are read using the native parser only, there is no
+         * reason to prefetch if it is not used. */
+        if (!OPT_SET(OPT_KEY_NO_NATIVE_LIST)) {
+                if (w->arch)
+                        __refresh_prefetch_arch(w->arch);
+                else
+                        __refresh_walk(root, src_len, 1, w->recursive);
+        }
 
-                strncpy(fn + len, dent->d_name, FILENAME_MAX - len);
-#ifdef _DIRENT_HAVE_D_TYPE
-                if (dent->d_type != DT_UNKNOWN) {
-                        if (dent->d_type == DT_DIR)
-                                walkpath(fn, src_len);
-                        continue;
-                }
-#endif
-                if (lstat(fn, &st) == -1)
-                        continue;
-                /* will be false for symlinked dirs */
-                if (S_ISDIR(st.st_mode))
-                        walkpath(fn, src_len);
+        if (!refresh_cancelled) {
+                __dircache_invalidate(w->dir);
+                __refresh_walk(root, src_len, 0, w->recursive);
+                gettimeofday(&t2, NULL);
+                syslog(LOG_DEBUG, "cache refresh of %s completed after %d ms",
+                       w->dir, (int)((t2.tv_sec - t1.tv_sec) * 1000 +
+                                     (t2.tv_usec - t1.tv_usec) / 1000));
         }
 
+        __refresh_free(w);
+
 out:
-        if (fn)
-                free(fn);
-        if (dir)
-                closedir(dir);
+        pthread_mutex_lock(&warmup_lock);
+        --refresh_active;
+        pthread_cond_broadcast(&warmup_cond);
+        pthread_mutex_unlock(&warmup_lock);
 }
 
 /*!
  *****************************************************************************
- *
+ * Start a background refresh of |path|. A directory in the source folder
+ * is refreshed including all its sub-directories. For an archive only
+ * the directory in which it is located is refreshed. Any other path is
+ * assumed to be inside an archive and the closest directory that exists
+ * in the source folder is refreshed.
  ****************************************************************************/
-static void *warmup_task(void *data)
+static int refresh_start(const char *path)
 {
-        (void)data;
-        const char *dir = OPT_STR(OPT_KEY_SRC, 0);
-        struct timeval t1;
-        struct timeval t2;
+        struct fuse_context *ctx = fuse_get_context();
+        struct refresh_work *w;
+        struct stat st;
+        char *root;
+        char *tmp;
+        int res = -ENOMEM;
 
-        pthread_detach(pthread_self());
+        if (!bg_pool)
+                return -ENOTSUP;
 
-        syslog(LOG_DEBUG, "cache warmup started");
-        gettimeofday(&t1, NULL);
+        w = calloc(1, sizeof(struct refresh_work));
+        if (!w)
+                return -ENOMEM;
+        w->dir = strdup(path);
+        if (!w->dir)
+                goto error;
+
+        ABS_ROOT(root, w->dir);
+        if (!lstat(root, &st)) {
+                if (S_ISDIR(st.st_mode)) {
+                        w->recursive = 1;
+                } else {
+                        w->arch = strdup(root);
+                        if (!w->arch)
+                                goto error;
+                        tmp = strdup(__gnu_dirname(w->dir));
+                        free(w->dir);
+                        w->dir = tmp;
+                }
+        } else {
+                do {
+                        tmp = strdup(__gnu_dirname(w->dir));
+                        free(w->dir);
+                        w->dir = tmp;
+                        if (!w->dir)
+                                goto error;
+                        ABS_ROOT(root, w->dir);
+                } while (strcmp(w->dir, "/") &&
+                         (lstat(root, &st) || !S_ISDIR(st.st_mode)));
+                if (lstat(root, &st))
+                        st.st_uid = 0;
+        }
+        if (!w->dir)
+                goto error;
 
-        walkpath(dir, strlen(dir));
+        /* A refresh is I/O intensive, only allow it for the owner of the
+         * directory or archive in the source folder. */
+        if (ctx && ctx->uid && ctx->uid != st.st_uid) {
+                res = -EPERM;
+                goto error;
+        }
 
         pthread_mutex_lock(&warmup_lock);
-        while (warmup_threads)
-                pthread_cond_wait(&warmup_cond, &warmup_lock);
+        if (__refresh_enqueue(w)) {
+                pthread_mutex_unlock(&warmup_lock);
+                printd(3, "Refresh of %s already queued\n", path);
+                __refresh_free(w);
+                return 0;
+        }
+        ++refresh_active;
         pthread_mutex_unlock(&warmup_lock);
 
-        if (!warmup_cancelled) {
-                gettimeofday(&t2, NULL);
-                syslog(LOG_DEBUG, "cache warmup completed after %d seconds",
-                       (int)(t2.tv_sec - t1.tv_sec));
+        printd(3, "Refreshing cache for %s%s\n", w->dir,
+               w->recursive ? " (recursive)" : "");
+        if (threadpool_submit(bg_pool, refresh_task, NULL)) {
+                /* The request stays queued and is picked up by the
+                 * next task that is successfully submitted. */
+                pthread_mutex_lock(&warmup_lock);
+                --refresh_active;
+                pthread_cond_broadcast(&warmup_cond);
+                pthread_mutex_unlock(&warmup_lock);
         }
+        return 0;
 
-        return NULL;
+error:
+        __refresh_free(w);
+        return res;
 }
 
 /*!
@@ -4395,15 +7384,33 @@ static void *rar2_init(struct fuse_conn_info *conn)
 {
         ENTER_();
 
-        pthread_t t;
+#ifdef FUSE_CAP_SPLICE_WRITE
+        /* Let data of stored files be spliced from the volume files */
+        conn->want |= conn->capable &
+                        (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#else
         (void)conn;             /* touch */
+#endif
 
         filecache_init();
+        arccache_init();
         dircache_init(&dircache_cb);
         iob_init();
+        if (ioloop_init(affinity_n_io(), affinity_io_thread))
+                printd(1, "Failed to start I/O threads\n");
+        if (qos_init(rar2fs_mount_opts.qos, affinity_n_io()))
+                printd(1, "Failed to start stream scheduler\n");
         sighandler_init();
+        /* Background head caching, pre-warming and cache refresh share
+         * a single low priority worker. */
+        if (head_sz || OPT_SET(OPT_KEY_PREWARM) ||
+            mount_type == MOUNT_FOLDER) {
+                bg_pool = threadpool_create(1, __warmup_worker_init);
+                if (!bg_pool)
+                        printd(1, "Failed to start background thread\n");
+        }
         if (mount_type == MOUNT_FOLDER && rar2fs_mount_opts.warmup > 0)
-                pthread_create(&t, NULL, warmup_task, NULL);
+                warmup_start();
 
         return NULL;
 }
@@ -4420,15 +7427,43 @@ static void rar2_destroy(void *data)
 
         if (mount_type == MOUNT_FOLDER && rar2fs_mount_opts.warmup > 0) {
                 pthread_mutex_lock(&warmup_lock);
-                if (warmup_threads)
+                if (warmup_active)
                         printf("shutting down...\n");
-                while (warmup_threads)
+                while (warmup_active)
                         pthread_cond_wait(&warmup_cond, &warmup_lock);
                 pthread_mutex_unlock(&warmup_lock);
         }
 
+        pthread_mutex_lock(&warmup_lock);
+        refresh_cancelled = 1;
+        while (refresh_active)
+                pthread_cond_wait(&warmup_cond, &warmup_lock);
+        while (refresh_queue) {
+                struct refresh_work *w = refresh_queue;
+                refresh_queue = w->next;
+                __refresh_free(w);
+        }
+        pthread_mutex_unlock(&warmup_lock);
+
+        __listrar_stats_report();
+        history_save();
+        history_destroy();
+
+        if (bg_pool) {
+                bg_cancelled = 1;
+                threadpool_destroy(bg_pool);
+                bg_pool = NULL;
+        }
+        headcache_save();
+        headcache_destroy();
+
+        linger_destroy();
+        solid_destroy();
+        ioloop_destroy();
+        qos_destroy();
         iob_destroy();
         dircache_destroy();
+        arccache_destroy();
         filecache_destroy();
         sighandler_destroy();
 }
@@ -4534,40 +7569,46 @@ static int rar2_release(const char *path, struct fuse_file_info *fi)
         if (FH_TOIO(fi->fh)->type == IO_TYPE_RAR ||
                         FH_TOIO(fi->fh)->type == IO_TYPE_RAW) {
                 struct io_context *op = FH_TOCONTEXT(fi->fh);
-                free(FH_TOPATH(fi->fh));
-                if (op->fp && op->entry_p->flags.raw) {
-                        printd(3, "Closing file handle %p\n", op->fp);
-                        fclose(op->fp);
+                if (op->rio) {
+                        printd(3, "Closing raw handle %p\n", op->rio);
+#if FUSE_MAJOR_VERSION > 2 || (FUSE_MAJOR_VERSION == 2 && FUSE_MINOR_VERSION >= 9)
+                        raw_fds_release(op);
+#endif
+                        rawio_close(op->rio);
                         pthread_mutex_destroy(&op->raw_read_mutex);
+                } else {
+                        free(op->head);
+                        op->head = NULL;
                 }
                 printd(3, "(%05d) %s [0x%-16" PRIx64 "]\n", getpid(), "FREE", fi->fh);
                 if (op->buf) {
-                        __wake_thread(op, RD_TERM);
-                        pthread_join(op->thread, NULL);
+                        struct qos_stats st;
+                        ioloop_del(op->ioh);
+                        qos_unregister(op->qos, &st);
+                        if (st.underruns)
+                                syslog(LOG_DEBUG, "%s: %" PRIu64 " reads, "
+                                       "%" PRIu64 " underruns, longest wait "
+                                       "%" PRIu64 " ms", FH_TOPATH(fi->fh),
+                                       st.reads,
+                                       st.underruns, st.wait_max_us / 1000);
                         pthread_cond_destroy(&op->rd_req_cond);
                         pthread_mutex_destroy(&op->rd_req_mutex);
 
-                        if (pclose_(op->fp, op->pid))
-                                printd(4, "child closed abnormally\n");
-                        printd(4, "PIPE %p closed towards child %05d\n",
-                               op->fp, op->pid);
-#ifdef DEBUG_READ
-                        fclose(op->dbg_fp);
-#endif
-
-#ifdef HAVE_MMAP
-                        if (op->buf->idx.data_p != MAP_FAILED &&
-                                        op->buf->idx.mmap)
-                                munmap((void *)op->buf->idx.data_p,
-                                       P_ALIGN_(ntoh64(op->buf->idx.data_p->head.size)));
-#endif
-                        if (op->buf->idx.data_p != MAP_FAILED &&
-                                        !op->buf->idx.mmap)
-                                free(op->buf->idx.data_p);
-                        if (op->buf->idx.fd != -1)
-                                close(op->buf->idx.fd);
-                        iob_free(op->buf);
+                        /* Keep the stream around for a subsequent open.
+                         * The context, including start_mutex, is then
+                         * owned and eventually freed by the pool. */
+                        if (!__linger_park(FH_TOPATH(fi->fh), op)) {
+                                free(FH_TOPATH(fi->fh));
+                                free(FH_TOIO(fi->fh));
+                                FH_ZERO(fi->fh);
+                                return 0;
+                        }
+                        __stream_stop(op);
                 }
+                if (!op->rio)
+                        pthread_mutex_destroy(&op->start_mutex);
+                free(FH_TOPATH(fi->fh));
+                affinity_put_group(op->cpu_group);
                 filecache_freeclone(op->entry_p);
                 free(op);
                 free(FH_TOIO(fi->fh));
@@ -4588,6 +7629,8 @@ static int rar2_read(const char *path, char *buffer, size_t size, off_t offset,
 {
         int res;
         struct io_handle *io;
+        struct timeval t1;
+        int sample;
         assert(FH_ISSET(fi->fh) && "bad I/O handle");
 
         (void)path;             /* touch */
@@ -4598,6 +7641,9 @@ static int rar2_read(const char *path, char *buffer, size_t size, off_t offset,
 
         ENTER_("size=%zu, offset=%" PRIu64 ", fh=%" PRIu64, size, offset, fi->fh);
 
+        sample = warmup_active;
+        if (sample)
+                gettimeofday(&t1, NULL);
         if (io->type == IO_TYPE_NRM) {
                 res = lread(buffer, size, offset, fi);
         } else if (io->type == IO_TYPE_RAW) {
@@ -4608,9 +7654,76 @@ static int rar2_read(const char *path, char *buffer, size_t size, off_t offset,
                 res = lread_rar(buffer, size, offset, fi);
         } else
                 return -EIO;
+        if (res > 0 && bg_pool && OPT_SET(OPT_KEY_PREWARM) &&
+            io->type != IO_TYPE_NRM && io->type != IO_TYPE_INFO)
+                __prewarm_check(FH_TOCONTEXT(fi->fh), FH_TOPATH(fi->fh), res);
+        if (sample)
+                __warmup_fg_update(&t1);
         return res;
 }
 
+#if FUSE_MAJOR_VERSION > 2 || (FUSE_MAJOR_VERSION == 2 && FUSE_MINOR_VERSION >= 9)
+
+/*!
+ *****************************************************************************
+ * Reads from stored files are served straight from the volume files, all
+ * other reads are copied through a memory buffer as by rar2_read(). That
+ * includes stored files when the raw I/O layer reads asynchronously since
+ * its read-ahead can not be used for file descriptor based buffers.
+ ****************************************************************************/
+static int rar2_read_buf(const char *path, struct fuse_bufvec **bufp,
+                size_t size, off_t offset, struct fuse_file_info *fi)
+{
+        struct fuse_bufvec *src;
+        struct io_handle *io;
+        struct timeval t1;
+        int sample;
+        void *mem;
+        int res;
+
+        assert(FH_ISSET(fi->fh) && "bad I/O handle");
+
+        io = FH_TOIO(fi->fh);
+        if (!io)
+               return -EIO;
+
+        if (io->type != IO_TYPE_RAW ||
+            rawio_is_async(FH_TOCONTEXT(fi->fh)->rio)) {
+                src = malloc(sizeof(struct fuse_bufvec));
+                mem = malloc(size);
+                if (!src || !mem) {
+                        free(src);
+                        free(mem);
+                        return -ENOMEM;
+                }
+                res = rar2_read(path, mem, size, offset, fi);
+                if (res < 0) {
+                        free(src);
+                        free(mem);
+                        return res;
+                }
+                *src = FUSE_BUFVEC_INIT(res);
+                src->buf[0].mem = mem;
+                *bufp = src;
+                return 0;
+        }
+
+        ENTER_("size=%zu, offset=%" PRIu64 ", fh=%" PRIu64, size, offset, fi->fh);
+
+        sample = warmup_active;
+        if (sample)
+                gettimeofday(&t1, NULL);
+        res = lread_raw_buf(bufp, size, offset, fi);
+        if (sample)
+                __warmup_fg_update(&t1);
+        if (!res && bg_pool && OPT_SET(OPT_KEY_PREWARM))
+                __prewarm_check(FH_TOCONTEXT(fi->fh), FH_TOPATH(fi->fh),
+                                fuse_buf_size(*bufp));
+        return res;
+}
+
+#endif
+
 /*!
  *****************************************************************************
  *
@@ -4826,6 +7939,92 @@ static const char *xattr[4] = {
 #define XATTR_CACHE_METHOD 0
 #define XATTR_CACHE_FLAGS 1
 
+/* Write-only attribute used to trigger a cache refresh */
+#define XATTR_INVALIDATE "user.rar2fs.invalidate"
+
+/* Read-only attribute reporting stream statistics, for the mount root
+ * totals for all streams are reported */
+#define XATTR_STREAM_STATS "user.rar2fs.stream_stats"
+
+/* Read-only attribute reporting admission control statistics */
+#define XATTR_ADMIT_STATS "user.rar2fs.admit_stats"
+
+/* Read-only attribute reporting I/O buffer pool statistics */
+#define XATTR_IOB_STATS "user.rar2fs.iob_stats"
+
+/*!
+*****************************************************************************
+*
+****************************************************************************/
+static int __getxattr_stream_stats(const char *path, char *value, size_t size)
+{
+        struct qos_stats st;
+        char tmp[256];
+        int n;
+        int len;
+
+        n = qos_get_stats(strcmp(path, "/") ? path : NULL, &st);
+        len = snprintf(tmp, sizeof(tmp), "streams=%d reads=%" PRIu64
+                       " bytes=%" PRIu64 " underruns=%" PRIu64
+                       " wait_ms=%" PRIu64 " max_wait_ms=%" PRIu64,
+                       n, st.reads, st.bytes, st.underruns,
+                       st.wait_us / 1000, st.wait_max_us / 1000);
+        if (size) {
+                if (size < (size_t)len)
+                        return -ERANGE;
+                memcpy(value, tmp, len);
+        }
+        return len;
+}
+
+/*!
+*****************************************************************************
+*
+****************************************************************************/
+static int __getxattr_admit_stats(char *value, size_t size)
+{
+        char tmp[256];
+        int len;
+
+        pthread_mutex_lock(&admit.lock);
+        len = snprintf(tmp, sizeof(tmp), "active=%d max=%d queued=%d "
+                       "admitted=%" PRIu64 " waited=%" PRIu64
+                       " rejected=%" PRIu64 " wait_ms=%" PRIu64
+                       " max_wait_ms=%" PRIu64,
+                       admit.active, admit.max, admit.queued,
+                       admit.admitted, admit.waited, admit.rejected,
+                       admit.wait_us / 1000, admit.wait_max_us / 1000);
+        pthread_mutex_unlock(&admit.lock);
+        if (size) {
+                if (size < (size_t)len)
+                        return -ERANGE;
+                memcpy(value, tmp, len);
+        }
+        return len;
+}
+
+/*!
+*****************************************************************************
+*
+****************************************************************************/
+static int __getxattr_iob_stats(char *value, size_t size)
+{
+        struct iob_stats st;
+        char tmp[256];
+        int len;
+
+        iob_get_stats(&st);
+        len = snprintf(tmp, sizeof(tmp), "pooled=%d max=%d hits=%" PRIu64
+                       " misses=%" PRIu64,
+                       st.pooled, st.max, st.hits, st.misses);
+        if (size) {
+                if (size < (size_t)len)
+                        return -ERANGE;
+                memcpy(value, tmp, len);
+        }
+        return len;
+}
+
 /*!
 *****************************************************************************
 *
@@ -4844,6 +8043,13 @@ static int rar2_getxattr(const char *path, const char *name, char *value,
 
         ENTER_("%s", path);
 
+        if (!strcmp(name, XATTR_STREAM_STATS))
+                return __getxattr_stream_stats(path, value, size);
+        if (!strcmp(name, XATTR_ADMIT_STATS))
+                return __getxattr_admit_stats(value, size);
+        if (!strcmp(name, XATTR_IOB_STATS))
+                return __getxattr_iob_stats(value, size);
+
         if (!access_chk(path, 0)) {
                 char *tmp;
                 ABS_ROOT(tmp, path);
@@ -4965,6 +8171,14 @@ static int rar2_setxattr(const char *path, const char *name, const char *value,
 {
         ENTER_("%s", path);
 
+        /* Request a refresh of the cache for a (sub-)tree. Any value will
+         * do since it is not stored anywhere. */
+        if (!strcmp(name, XATTR_INVALIDATE)) {
+                if (mount_type != MOUNT_FOLDER)
+                        return -ENOTSUP;
+                return refresh_start(path);
+        }
+
         if (!access_chk(path, 0)) {
                 char *tmp;
                 ABS_ROOT(tmp, path);
@@ -5278,6 +8492,9 @@ static struct fuse_operations rar2_operations = {
         .open = rar2_open,
         .release = rar2_release,
         .read = rar2_read,
+#if FUSE_MAJOR_VERSION > 2 || (FUSE_MAJOR_VERSION == 2 && FUSE_MINOR_VERSION >= 9)
+        .read_buf = rar2_read_buf,
+#endif
         .flush = rar2_flush,
         .readlink = rar2_readlink,
 #ifdef HAVE_SETXATTR
@@ -5398,18 +8615,14 @@ static int work(struct fuse_args *args)
         pthread_attr_init(&thread_attr);
         pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
 
-#if defined ( HAVE_SCHED_SETAFFINITY ) && defined ( HAVE_CPU_SET_T )
-        cpu_set_t cpu_mask_saved;
+        /* --no-smp is kept as an alias for pinning everything to CPU #0 */
         if (OPT_SET(OPT_KEY_NO_SMP)) {
-                cpu_set_t cpu_mask;
-                CPU_ZERO(&cpu_mask);
-                CPU_SET(0, &cpu_mask);
-                if (sched_getaffinity(0, sizeof(cpu_set_t), &cpu_mask_saved))
-                        perror("sched_getaffinity");
-                else if (sched_setaffinity(0, sizeof(cpu_set_t), &cpu_mask))
-                        perror("sched_setaffinity");
+                if (affinity_init("0", "0"))
+                        printf("rar2fs: failed to bind to CPU #0\n");
+        } else if (affinity_init(OPT_STR(OPT_KEY_FUSE_CPUS, 0),
+                                 OPT_STR(OPT_KEY_IO_CPUS, 0))) {
+                printf("rar2fs: invalid CPU placement, SMP defaults used\n");
         }
-#endif
 
         /* The below callbacks depend on mount type */
         if (mount_type == MOUNT_FOLDER) {
@@ -5501,7 +8714,6 @@ static int work(struct fuse_args *args)
         if (!wdt.work_task_exited)
                 pthread_kill(t, SIGINT);        /* terminate nicely */
 
-        fs_terminated = 1;
         warmup_cancelled = 1;
         pthread_join(t, NULL);
 
@@ -5512,12 +8724,7 @@ static int work(struct fuse_args *args)
         syslog(LOG_DEBUG, "unmounted %s", mp);
         free(mp);
 
-#if defined ( HAVE_SCHED_SETAFFINITY ) && defined ( HAVE_CPU_SET_T )
-        if (OPT_SET(OPT_KEY_NO_SMP)) {
-                if (sched_setaffinity(0, sizeof(cpu_set_t), &cpu_mask_saved))
-                        perror("sched_setaffinity");
-        }
-#endif
+        affinity_destroy();
 
         pthread_attr_destroy(&thread_attr);
 
@@ -5559,11 +8766,20 @@ static void print_help()
         printf("    --iob-size=n\t    I/O buffer size in 'power of 2' MiB (1,2,4,8, etc.) [4]\n");
         printf("    --hist-size=n\t    I/O buffer history size as a percentage (0-75) of total buffer size [50]\n");
 #endif
+        printf("    --iob-pool=n\t    number of released I/O buffers kept for reuse [2]\n");
+        printf("    --iob-hugetlb\t    use explicit huge pages for I/O buffers if available\n");
+        printf("    --max-streams=n\t    max number of concurrent extraction streams [0=unlimited]\n");
+        printf("    --max-iob-mem=n\t    max memory in MiB used by I/O buffers of streams [0=unlimited]\n");
+        printf("    --admit-timeout=n\t    seconds a read may wait for a free stream [60]\n");
         printf("    --save-eof\t\t    force creation of .r2i files (end-of-file chunk)\n");
         printf("    --no-lib-check\t    disable validation of library version(s)\n");
         printf("    --no-expand-cbr\t    do not expand comic book RAR archives\n");
+        printf("    --solid-decoder\t    keep one decoder per solid archive across opens\n");
+        printf("    --unpack-threads=n\t    threads per stream for RAR5 unpack [0=fair share]\n");
 #if defined ( HAVE_SCHED_SETAFFINITY ) && defined ( HAVE_CPU_SET_T )
         printf("    --no-smp\t\t    disable SMP support (bind to CPU #0)\n");
+        printf("    --fuse-cpus=list\t    CPUs serving FUSE requests (e.g. 0-1)\n");
+        printf("    --io-cpus=list\t    CPUs used for extraction and I/O (e.g. 2-7)\n");
 #endif
         printf("    --relatime\t\t    update file access times relative to modify or change time\n");
 #if defined( HAVE_UTIMENSAT ) && defined( AT_SYMLINK_NOFOLLOW )
@@ -5572,11 +8788,23 @@ static void print_help()
         printf("    --date-rar\t\t    use file date from main archive file(s)\n");
         printf("    --config=file\t    config file name [source/.rarconfig]\n");
         printf("    --no-inherit-perm\t    do not inherit file permission mode from archive\n");
+        printf("    --no-native-list\t    always use libunrar for listing archive contents\n");
+        printf("    --warmup-history=file   keep access history in file to prioritize cache warmup\n");
+        printf("    --head-cache=n\t    keep the first n KiB of compressed files in memory [0=off]\n");
+        printf("    --head-cache-size=n\t    memory limit in MiB for the head cache [64]\n");
+        printf("    --head-cache-ext=E1[;E2...] only keep the head of files with these extensions\n");
+        printf("    --head-cache-file=file  keep the head cache in file across mounts\n");
+        printf("    --prewarm\t\t    prepare the next file in a folder while the current one is read\n");
         printf("\n");
 #ifdef HAVE_SETLOCALE
         printf("    -o locale=LOCALE        set the locale for file names (default: according to LC_*/LC_CTYPE)\n");
 #endif
         printf("    -o warmup[=THREADS]     start background cache warmup threads (default: 5)\n");
+        printf("    -o warmup_rate=N        limit cache warmup to N directories per second (default: 0=unlimited)\n");
+        printf("    -o warmup_io=N          limit cache warmup to reading N KiB per second (default: 0=unlimited)\n");
+        printf("    -o warmup_cpu=N         limit cache warmup to N percent of one CPU (default: 0=unlimited)\n");
+        printf("    -o qos                  schedule decompression towards streams at risk of running dry\n");
+        printf("    -o qos_client           weight streams by the priority (nice value) of the reading process\n");
 }
 
 /* FUSE API specific keys continue where 'optdb' left off */
@@ -5591,6 +8819,11 @@ static struct fuse_opt rar2fs_opts[] = {
 #endif
         RAR2FS_MOUNT_OPT("warmup=%d", warmup, 0),
         RAR2FS_MOUNT_OPT("warmup", warmup, 5),
+        RAR2FS_MOUNT_OPT("warmup_rate=%d", warmup_rate, 0),
+        RAR2FS_MOUNT_OPT("warmup_io=%d", warmup_io, 0),
+        RAR2FS_MOUNT_OPT("warmup_cpu=%d", warmup_cpu, 0),
+        RAR2FS_MOUNT_OPT("qos", qos, 1),
+        RAR2FS_MOUNT_OPT("qos_client", qos_client, 1),
 
         FUSE_OPT_KEY("-V",              OPT_KEY_VERSION),
         FUSE_OPT_KEY("--version",       OPT_KEY_VERSION),
@@ -5608,14 +8841,23 @@ static struct option longopts[] = {
         {"seek-length", required_argument, NULL, OPT_ADDR(OPT_KEY_SEEK_LENGTH)},
 #if defined ( HAVE_SCHED_SETAFFINITY ) && defined ( HAVE_CPU_SET_T )
         {"no-smp",            no_argument, NULL, OPT_ADDR(OPT_KEY_NO_SMP)},
+        {"fuse-cpus",   required_argument, NULL, OPT_ADDR(OPT_KEY_FUSE_CPUS)},
+        {"io-cpus",     required_argument, NULL, OPT_ADDR(OPT_KEY_IO_CPUS)},
 #endif
         {"no-lib-check",      no_argument, NULL, OPT_ADDR(OPT_KEY_NO_LIB_CHECK)},
 #ifndef USE_STATIC_IOB_
         {"hist-size",   required_argument, NULL, OPT_ADDR(OPT_KEY_HIST_SIZE)},
         {"iob-size",    required_argument, NULL, OPT_ADDR(OPT_KEY_BUF_SIZE)},
 #endif
+        {"iob-pool",    required_argument, NULL, OPT_ADDR(OPT_KEY_IOB_POOL)},
+        {"iob-hugetlb",       no_argument, NULL, OPT_ADDR(OPT_KEY_IOB_HUGETLB)},
+        {"max-streams", required_argument, NULL, OPT_ADDR(OPT_KEY_MAX_STREAMS)},
+        {"max-iob-mem", required_argument, NULL, OPT_ADDR(OPT_KEY_MAX_IOB_MEM)},
+        {"admit-timeout", required_argument, NULL, OPT_ADDR(OPT_KEY_ADMIT_TIMEOUT)},
         {"save-eof",          no_argument, NULL, OPT_ADDR(OPT_KEY_SAVE_EOF)},
         {"no-expand-cbr",     no_argument, NULL, OPT_ADDR(OPT_KEY_NO_EXPAND_CBR)},
+        {"solid-decoder",     no_argument, NULL, OPT_ADDR(OPT_KEY_SOLID_DECODER)},
+        {"unpack-threads", required_argument, NULL, OPT_ADDR(OPT_KEY_UNPACK_THREADS)},
         {"relatime",          no_argument, NULL, OPT_ADDR(OPT_KEY_ATIME)},
 #if defined( HAVE_UTIMENSAT ) && defined( AT_SYMLINK_NOFOLLOW )
         {"relatime-rar",      no_argument, NULL, OPT_ADDR(OPT_KEY_ATIME_RAR)},
@@ -5623,6 +8865,13 @@ static struct option longopts[] = {
         {"date-rar",          no_argument, NULL, OPT_ADDR(OPT_KEY_DATE_RAR)},
         {"config",      required_argument, NULL, OPT_ADDR(OPT_KEY_CONFIG)},
         {"no-inherit-perm",   no_argument, NULL, OPT_ADDR(OPT_KEY_NO_INHERIT_PERM)},
+        {"no-native-list",    no_argument, NULL, OPT_ADDR(OPT_KEY_NO_NATIVE_LIST)},
+        {"warmup-history", required_argument, NULL, OPT_ADDR(OPT_KEY_WARMUP_HISTORY)},
+        {"head-cache",  required_argument, NULL, OPT_ADDR(OPT_KEY_HEAD_CACHE)},
+        {"head-cache-size", required_argument, NULL, OPT_ADDR(OPT_KEY_HEAD_CACHE_SIZE)},
+        {"head-cache-ext", required_argument, NULL, OPT_ADDR(OPT_KEY_HEAD_CACHE_EXT)},
+        {"head-cache-file", required_argument, NULL, OPT_ADDR(OPT_KEY_HEAD_CACHE_FILE)},
+        {"prewarm",           no_argument, NULL, OPT_ADDR(OPT_KEY_PREWARM)},
         {NULL,                          0, NULL, 0}
 };
 
@@ -5744,6 +8993,50 @@ int main(int argc, char *argv[])
         rarconfig_init(OPT_STR(OPT_KEY_SRC, 0),
                        OPT_STR(OPT_KEY_CONFIG, 0));
 
+        /* The access history file is saved at unmount. By then the
+         * working directory might have changed so make the path
+         * absolute here. */
+        if (mount_type == MOUNT_FOLDER && OPT_SET(OPT_KEY_WARMUP_HISTORY)) {
+                char *file = OPT_STR(OPT_KEY_WARMUP_HISTORY, 0);
+                char cwd[PATH_MAX];
+                if (*file != '/' && getcwd(cwd, sizeof(cwd))) {
+                        char *tmp = malloc(strlen(cwd) + strlen(file) + 2);
+                        if (tmp) {
+                                sprintf(tmp, "%s/%s", cwd, file);
+                                history_init(tmp);
+                                free(tmp);
+                        }
+                } else {
+                        history_init(file);
+                }
+        }
+
+        /* Same goes for the head cache file */
+        if (OPT_SET(OPT_KEY_HEAD_CACHE) && OPT_INT(OPT_KEY_HEAD_CACHE, 0)) {
+                size_t max = 64;
+                char *file = NULL;
+                char *tmp = NULL;
+                char cwd[PATH_MAX];
+
+                if (OPT_SET(OPT_KEY_HEAD_CACHE_SIZE))
+                        max = OPT_INT(OPT_KEY_HEAD_CACHE_SIZE, 0);
+                if (OPT_SET(OPT_KEY_HEAD_CACHE_FILE)) {
+                        file = OPT_STR(OPT_KEY_HEAD_CACHE_FILE, 0);
+                        if (*file != '/' && getcwd(cwd, sizeof(cwd))) {
+                                tmp = malloc(strlen(cwd) + strlen(file) + 2);
+                                if (tmp)
+                                        sprintf(tmp, "%s/%s", cwd, file);
+                                file = tmp;
+                        }
+                }
+                head_sz = OPT_INT(OPT_KEY_HEAD_CACHE, 0) * 1024;
+                if (max)
+                        headcache_init(max * 1024 * 1024, file);
+                else
+                        head_sz = 0;
+                free(tmp);
+        }
+
         /* Check file collection at archive mount */
         if (mount_type == MOUNT_ARCHIVE) {
                 const int ret = collect_files(src_path_full);
@@ -5759,6 +9052,21 @@ int main(int argc, char *argv[])
         if (check_iob(argv[0], 1))
                 return -1;
 
+        /* The memory limit is expressed in number of streams, since each
+         * of them has an I/O buffer of fixed size */
+        if (OPT_SET(OPT_KEY_MAX_STREAMS))
+                admit.max = OPT_INT(OPT_KEY_MAX_STREAMS, 0);
+        if (OPT_SET(OPT_KEY_MAX_IOB_MEM) && OPT_INT(OPT_KEY_MAX_IOB_MEM, 0)) {
+                int max = ((size_t)OPT_INT(OPT_KEY_MAX_IOB_MEM, 0) *
+                                1024 * 1024) / IOB_SZ;
+                if (!max)
+                        max = 1;
+                if (!admit.max || max < admit.max)
+                        admit.max = max;
+        }
+        if (OPT_SET(OPT_KEY_ADMIT_TIMEOUT))
+                admit.tmo = OPT_INT(OPT_KEY_ADMIT_TIMEOUT, 0);
+
         /* Check library versions */
         if (!OPT_SET(OPT_KEY_NO_LIB_CHECK)) {
                 if (check_libunrar(1) || check_libfuse(1))
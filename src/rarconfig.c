@@ -59,6 +59,7 @@ struct alias_entry {
 struct config_entry {
         int seek_length;
         int save_eof;
+        int unpack_threads;
         wchar_t *password_w;
         char *password;
         struct alias_entry *aliases;
@@ -91,6 +92,10 @@ int rarconfig_getprop_int(const char *path, int prop)
                         pthread_mutex_unlock(&config_mutex);
                         return e->mask & RAR_SAVE_EOF_PROP
                                         ? e->save_eof : -1;
+                case RAR_UNPACK_THREADS_PROP:
+                        pthread_mutex_unlock(&config_mutex);
+                        return e->mask & RAR_UNPACK_THREADS_PROP
+                                        ? e->unpack_threads : -1;
                 }
         }
         pthread_mutex_unlock(&config_mutex);
@@ -421,6 +426,17 @@ static void __entry_set_seek_length(struct config_entry *e,
         e->mask |= RAR_SEEK_LENGTH_PROP;
 }
 
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __entry_set_unpack_threads(struct config_entry *e,
+                        struct child_node *cnode)
+{
+        e->unpack_threads = strtoul(cnode->value, NULL, 0);
+        e->mask |= RAR_UNPACK_THREADS_PROP;
+}
+
 /*!
  *****************************************************************************
  *
@@ -554,6 +570,8 @@ void rarconfig_init(const char *source, const char *cfg)
                                 __entry_set_seek_length(e, cnode);
                         if (!strcasecmp(cnode->name, "password"))
                                 __entry_set_password(e, cnode);
+                        if (!strcasecmp(cnode->name, "unpack-threads"))
+                                __entry_set_unpack_threads(e, cnode);
                         if (!strcasecmp(cnode->name, "alias"))
                                 __entry_set_alias(e, cnode);
                         free_child(cnode_next);
@@ -34,6 +34,7 @@
 #define RAR_SEEK_LENGTH_PROP 0x01
 #define RAR_SAVE_EOF_PROP 0x02
 #define RAR_PASSWORD_PROP 0x04
+#define RAR_UNPACK_THREADS_PROP 0x08
 
 void rarconfig_init(const char *source, const char *cfg);
 void rarconfig_destroy();
@@ -0,0 +1,1407 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+
+#include "platform.h"
+#include <memory.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <wchar.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef HAVE_LANGINFO_H
+# include <langinfo.h>
+#endif
+#include "debug.h"
+#include "rarhdr.h"
+
+/*
+ * This is a light-weight parser for the RAR 1.5-4.x and RAR 5.0 header
+ * formats. It is used only for listing and operates directly on the
+ * archive file using pread(2) without any involvement of libunrar.
+ * Anything it does not understand, e.g. encrypted headers or SFX
+ * archives, is left to libunrar.
+ */
+
+#define RARHDR_BUF_SZ 32768
+
+/* Upper limit for quick open data to load, anything beyond that is
+ * simply ignored and headers are read from the archive as usual. */
+#define RARHDR_QO_MAX_SZ (64 * 1024 * 1024)
+
+#define FMT_RAR4 0
+#define FMT_RAR5 1
+
+/* RAR 1.5-4.x */
+#define RAR4_SIG_SZ             7
+#define RAR4_HEAD_MAIN          0x73
+#define RAR4_HEAD_FILE          0x74
+#define RAR4_HEAD_AV            0x79
+#define RAR4_HEAD_SERVICE       0x7a
+#define RAR4_HEAD_ENDARC        0x7b
+#define RAR4_LONG_BLOCK         0x8000
+#define RAR4_MHD_VOLUME         0x0001
+#define RAR4_MHD_COMMENT        0x0002
+#define RAR4_MHD_LOCK           0x0004
+#define RAR4_MHD_SOLID          0x0008
+#define RAR4_MHD_NEWNUMBERING   0x0010
+#define RAR4_MHD_AV             0x0020
+#define RAR4_MHD_PROTECT        0x0040
+#define RAR4_MHD_PASSWORD       0x0080
+#define RAR4_MHD_FIRSTVOLUME    0x0100
+#define RAR4_LHD_SPLIT_BEFORE   0x0001
+#define RAR4_LHD_SPLIT_AFTER    0x0002
+#define RAR4_LHD_PASSWORD       0x0004
+#define RAR4_LHD_SOLID          0x0010
+#define RAR4_LHD_WINDOWMASK     0x00e0
+#define RAR4_LHD_DIRECTORY      0x00e0
+#define RAR4_LHD_LARGE          0x0100
+#define RAR4_LHD_UNICODE        0x0200
+#define RAR4_LHD_SALT           0x0400
+#define RAR4_LHD_EXTTIME        0x1000
+#define RAR4_HOST_UNIX          3
+#define RAR4_HOST_BEOS          5
+#define RAR4_HOST_MAX           6
+
+/* RAR 5.0 */
+#define RAR5_SIG_SZ             8
+#define RAR5_MAX_HEADER_SIZE    0x200000
+#define RAR5_HEAD_MAIN          1
+#define RAR5_HEAD_FILE          2
+#define RAR5_HEAD_SERVICE       3
+#define RAR5_HEAD_CRYPT         4
+#define RAR5_HEAD_ENDARC        5
+#define RAR5_HFL_EXTRA          0x0001
+#define RAR5_HFL_DATA           0x0002
+#define RAR5_HFL_SPLITBEFORE    0x0008
+#define RAR5_HFL_SPLITAFTER     0x0010
+#define RAR5_MHFL_VOLUME        0x0001
+#define RAR5_MHFL_VOLNUMBER     0x0002
+#define RAR5_MHFL_SOLID         0x0004
+#define RAR5_MHFL_PROTECT       0x0008
+#define RAR5_MHFL_LOCK          0x0010
+#define RAR5_FHFL_DIRECTORY     0x0001
+#define RAR5_FHFL_UTIME         0x0002
+#define RAR5_FHFL_CRC32         0x0004
+#define RAR5_FHFL_UNPUNKNOWN    0x0008
+#define RAR5_FCI_ALGO_MASK      0x003f
+#define RAR5_FCI_SOLID          0x0040
+#define RAR5_FHEXTRA_CRYPT      0x01
+#define RAR5_FHEXTRA_HTIME      0x03
+#define RAR5_FHEXTRA_REDIR      0x05
+#define RAR5_MHEXTRA_LOCATOR    0x01
+#define RAR5_LOCATOR_QLIST      0x01
+#define RAR5_HTIME_UNIXTIME     0x01
+#define RAR5_HTIME_MTIME        0x02
+#define RAR5_HTIME_CTIME        0x04
+#define RAR5_HTIME_ATIME        0x08
+#define RAR5_HTIME_UNIX_NS      0x10
+#define RAR5_REDIR_UNIXSYMLINK  1
+#define RAR5_REDIR_FILECOPY     5
+#define RAR5_HOST_WINDOWS       0
+#define RAR5_HOST_UNIX          1
+
+#define HSYS_WINDOWS_ 0
+#define HSYS_UNIX_    1
+#define HSYS_UNKNOWN_ 2
+
+/* Difference between Windows FILETIME epoch and UNIX epoch in 100ns units */
+#define WIN_EPOCH_DIFF 116444736000000000ULL
+
+static const uint8_t rar4_sig[RAR4_SIG_SZ] =
+        {0x52, 0x61, 0x72, 0x21, 0x1a, 0x07, 0x00};
+static const uint8_t rar5_sig[RAR5_SIG_SZ] =
+        {0x52, 0x61, 0x72, 0x21, 0x1a, 0x07, 0x01, 0x00};
+
+static uint32_t crc32_tab[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+struct rarhdr {
+        int fd;
+        int format;
+        off_t size;
+        off_t pos;
+        uint8_t *buf;
+        size_t buf_sz;
+        size_t buf_len;
+        off_t buf_off;
+        unsigned int flags;
+        const char *arch;
+        RARArchiveDataEx arc;
+        /* RAR5 quick open data */
+        off_t qo_pos;
+        uint8_t *qo_data;
+        size_t qo_len;
+        size_t qo_idx;
+        off_t qo_hdr_pos;
+        const uint8_t *qo_hdr;
+        size_t qo_hdr_sz;
+        unsigned int qo_hits;
+};
+
+struct cursor {
+        const uint8_t *p;
+        const uint8_t *end;
+        int err;
+};
+
+struct block {
+        unsigned int head_size;
+        unsigned int type;
+        uint64_t flags;
+        uint64_t data_size;
+        struct cursor c;
+        struct cursor extra;
+};
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static inline int __avail(struct cursor *c, size_t n)
+{
+        if (c->err || (size_t)(c->end - c->p) < n) {
+                c->err = 1;
+                return 0;
+        }
+        return 1;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static inline void __skip(struct cursor *c, uint64_t n)
+{
+        if (__avail(c, n))
+                c->p += n;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static inline uint8_t __get1(struct cursor *c)
+{
+        if (!__avail(c, 1))
+                return 0;
+        return *c->p++;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static inline uint16_t __get2(struct cursor *c)
+{
+        uint16_t v;
+
+        if (!__avail(c, 2))
+                return 0;
+        v = c->p[0] | (c->p[1] << 8);
+        c->p += 2;
+        return v;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static inline uint32_t __get4(struct cursor *c)
+{
+        uint32_t v;
+
+        if (!__avail(c, 4))
+                return 0;
+        v = c->p[0] | (c->p[1] << 8) | (c->p[2] << 16) |
+                        ((uint32_t)c->p[3] << 24);
+        c->p += 4;
+        return v;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static inline uint64_t __get8(struct cursor *c)
+{
+        uint64_t lo = __get4(c);
+        return lo | ((uint64_t)__get4(c) << 32);
+}
+
+/*!
+ *****************************************************************************
+ * RAR5 variable length integer.
+ ****************************************************************************/
+static inline uint64_t __getv(struct cursor *c)
+{
+        uint64_t v = 0;
+        int shift;
+
+        for (shift = 0; shift < 64 && __avail(c, 1); shift += 7) {
+                uint8_t b = *c->p++;
+                v |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                        return v;
+        }
+        c->err = 1;
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Return a pointer to 'len' bytes of archive data starting at 'off'.
+ * Data is read in chunks of RARHDR_BUF_SZ bytes so that headers of
+ * adjacent (small) files can be served from the same read.
+ ****************************************************************************/
+static const uint8_t *__fetch(struct rarhdr *h, off_t off, size_t len)
+{
+        ssize_t n;
+
+        if (off >= h->buf_off &&
+            (off + (off_t)len) <= (h->buf_off + (off_t)h->buf_len))
+                return h->buf + (off - h->buf_off);
+
+        if (len > h->buf_sz) {
+                uint8_t *tmp = realloc(h->buf, len);
+                if (!tmp)
+                        return NULL;
+                h->buf = tmp;
+                h->buf_sz = len;
+        }
+        n = pread(h->fd, h->buf, h->buf_sz, off);
+        if (n < 0) {
+                h->buf_len = 0;
+                return NULL;
+        }
+        h->buf_off = off;
+        h->buf_len = n;
+        if ((size_t)n < len)
+                return NULL;
+        return h->buf;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __crc32_init()
+{
+        uint32_t i;
+        int j;
+
+        for (i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (j = 0; j < 8; j++)
+                        c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+                crc32_tab[i] = c;
+        }
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static uint32_t __crc32(const uint8_t *p, size_t len)
+{
+        uint32_t c = 0xffffffff;
+
+        pthread_once(&crc32_once, __crc32_init);
+        while (len--)
+                c = crc32_tab[(c ^ *p++) & 0xff] ^ (c >> 8);
+        return c ^ 0xffffffff;
+}
+
+/*!
+ *****************************************************************************
+ * Step to the next cached header in the quick open data. Each record holds
+ * a verbatim copy of a header and its position relative to the quick open
+ * service header.
+ ****************************************************************************/
+static void __qo_next(struct rarhdr *h)
+{
+        struct cursor c;
+        const uint8_t *s;
+        uint64_t size;
+        uint64_t offset;
+        uint64_t hdr_sz;
+        uint32_t crc;
+
+        h->qo_hdr = NULL;
+        c.p = h->qo_data + h->qo_idx;
+        c.end = h->qo_data + h->qo_len;
+        c.err = 0;
+        if (c.p >= c.end)
+                return;
+
+        crc = __get4(&c);
+        s = c.p;
+        size = __getv(&c);
+        if (c.err || size > (uint64_t)(c.end - c.p))
+                goto stop;
+        c.end = c.p + size;
+        if (__crc32(s, c.end - s) != crc)
+                goto stop;
+        h->qo_idx = c.end - h->qo_data;
+
+        (void)__getv(&c);               /* flags */
+        offset = __getv(&c);
+        hdr_sz = __getv(&c);
+        if (c.err || hdr_sz > (uint64_t)(c.end - c.p) ||
+            offset > (uint64_t)h->qo_pos)
+                goto stop;
+        h->qo_hdr_pos = h->qo_pos - offset;
+        h->qo_hdr = c.p;
+        h->qo_hdr_sz = hdr_sz;
+        return;
+
+stop:
+        /* Corrupt data, do not trust anything that follows */
+        h->qo_idx = h->qo_len;
+}
+
+/*!
+ *****************************************************************************
+ * Look up a header at 'pos' in the quick open data. Headers are cached in
+ * archive order so the search never needs to go backwards.
+ ****************************************************************************/
+static const uint8_t *__qo_lookup(struct rarhdr *h, off_t pos, size_t *len)
+{
+        if (!h->qo_data)
+                return NULL;
+        while (h->qo_hdr && h->qo_hdr_pos < pos)
+                __qo_next(h);
+        if (h->qo_hdr && h->qo_hdr_pos == pos) {
+                *len = h->qo_hdr_sz;
+                return h->qo_hdr;
+        }
+        return NULL;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __read_block4(struct rarhdr *h, off_t pos, struct block *b)
+{
+        const uint8_t *p;
+        struct cursor c;
+        uint16_t crc;
+
+        p = __fetch(h, pos, 7);
+        if (!p)
+                return ERAR_EREAD;
+        c.p = p;
+        c.end = p + 7;
+        c.err = 0;
+        crc = __get2(&c);
+        b->type = __get1(&c);
+        b->flags = __get2(&c);
+        b->head_size = __get2(&c);
+        if (b->head_size < 7)
+                return ERAR_BAD_DATA;
+
+        p = __fetch(h, pos, b->head_size);
+        if (!p)
+                return ERAR_EREAD;
+
+        /* Old style archive comments and AV headers are not covered by
+         * the header CRC as a whole, leave those to libunrar. */
+        if (b->type == RAR4_HEAD_AV ||
+            (b->type == RAR4_HEAD_MAIN && (b->flags & RAR4_MHD_COMMENT)))
+                return ERAR_BAD_DATA;
+        if ((__crc32(p + 2, b->head_size - 2) & 0xffff) != crc)
+                return ERAR_BAD_DATA;
+
+        c.p = p + 7;
+        c.end = p + b->head_size;
+        b->c = c;
+
+        b->data_size = 0;
+        if (b->type == RAR4_HEAD_FILE || b->type == RAR4_HEAD_SERVICE) {
+                b->data_size = __get4(&c);
+                if (b->flags & RAR4_LHD_LARGE) {
+                        __skip(&c, 21);
+                        b->data_size |= (uint64_t)__get4(&c) << 32;
+                }
+        } else if (b->flags & RAR4_LONG_BLOCK) {
+                b->data_size = __get4(&c);
+        }
+        if (c.err)
+                return ERAR_BAD_DATA;
+        return ERAR_SUCCESS;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __read_block5(struct rarhdr *h, off_t pos, struct block *b)
+{
+        const uint8_t *p;
+        struct cursor c;
+        uint64_t size;
+        uint64_t extra_size;
+        unsigned int size_bytes;
+        uint32_t crc;
+        size_t qo_len = 0;
+        const uint8_t *qo_p = __qo_lookup(h, pos, &qo_len);
+
+        p = qo_p && qo_len >= 7 ? qo_p : __fetch(h, pos, 7);
+        if (!p)
+                return ERAR_EREAD;
+        c.p = p;
+        c.end = p + 7;
+        c.err = 0;
+        crc = __get4(&c);
+        size = __getv(&c);
+        if (c.err || !size || size > RAR5_MAX_HEADER_SIZE)
+                return ERAR_BAD_DATA;
+        size_bytes = c.p - (p + 4);
+        b->head_size = 4 + size_bytes + size;
+
+        if (p == qo_p && qo_len == b->head_size) {
+                ++h->qo_hits;
+        } else {
+                p = __fetch(h, pos, b->head_size);
+                if (!p)
+                        return ERAR_EREAD;
+        }
+        if (__crc32(p + 4, b->head_size - 4) != crc)
+                return ERAR_BAD_DATA;
+        c.p = p + 4 + size_bytes;
+        c.end = p + b->head_size;
+        b->type = __getv(&c);
+        b->flags = __getv(&c);
+        extra_size = (b->flags & RAR5_HFL_EXTRA) ? __getv(&c) : 0;
+        b->data_size = (b->flags & RAR5_HFL_DATA) ? __getv(&c) : 0;
+        if (c.err || extra_size > (uint64_t)(c.end - c.p))
+                return ERAR_BAD_DATA;
+
+        /* Extra area is always located at the end of the header */
+        b->extra.p = c.end - extra_size;
+        b->extra.end = c.end;
+        b->extra.err = 0;
+        c.end = b->extra.p;
+        b->c = c;
+        return ERAR_SUCCESS;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static inline int __read_block(struct rarhdr *h, off_t pos, struct block *b)
+{
+        if (h->format == FMT_RAR5)
+                return __read_block5(h, pos, b);
+        return __read_block4(h, pos, b);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static size_t __utf8_put(char *dst, size_t size, size_t n, uint32_t c)
+{
+        uint8_t tmp[4];
+        size_t len;
+
+        if (c < 0x80) {
+                tmp[0] = c;
+                len = 1;
+        } else if (c < 0x800) {
+                tmp[0] = 0xc0 | (c >> 6);
+                tmp[1] = 0x80 | (c & 0x3f);
+                len = 2;
+        } else if (c < 0x10000) {
+                tmp[0] = 0xe0 | (c >> 12);
+                tmp[1] = 0x80 | ((c >> 6) & 0x3f);
+                tmp[2] = 0x80 | (c & 0x3f);
+                len = 3;
+        } else {
+                tmp[0] = 0xf0 | ((c >> 18) & 0x07);
+                tmp[1] = 0x80 | ((c >> 12) & 0x3f);
+                tmp[2] = 0x80 | ((c >> 6) & 0x3f);
+                tmp[3] = 0x80 | (c & 0x3f);
+                len = 4;
+        }
+        /* Always leave room for the terminating null character */
+        if (n + len >= size)
+                return n;
+        memcpy(dst + n, tmp, len);
+        return n + len;
+}
+
+/*!
+ *****************************************************************************
+ * Decode an UTF-8 string of 'len' bytes to a null terminated wide string.
+ * Invalid sequences are mapped byte-by-byte.
+ ****************************************************************************/
+static void __utf8_to_wide(const uint8_t *src, size_t len, wchar_t *dst,
+                size_t size)
+{
+        const uint8_t *end = src + len;
+        size_t n = 0;
+
+        while (src < end && n < (size - 1)) {
+                uint32_t c = *src++;
+                int more = 0;
+
+                if (c >= 0xf0 && c < 0xf8) {
+                        c &= 0x07;
+                        more = 3;
+                } else if (c >= 0xe0) {
+                        c &= 0x0f;
+                        more = 2;
+                } else if (c >= 0xc0) {
+                        c &= 0x1f;
+                        more = 1;
+                }
+                if (more && (end - src) >= more) {
+                        int i;
+                        for (i = 0; i < more; i++) {
+                                if ((src[i] & 0xc0) != 0x80)
+                                        break;
+                                c = (c << 6) | (src[i] & 0x3f);
+                        }
+                        if (i == more)
+                                src += more;
+                        else
+                                c = src[-1];
+                } else if (more) {
+                        c = src[-1];
+                }
+                dst[n++] = c;
+        }
+        dst[n] = 0;
+}
+
+/*!
+ *****************************************************************************
+ * Decode the RAR 2.x-4.x compressed UNICODE file name representation.
+ * 'name' is the ASCII version of the file name and 'enc' the encoded
+ * UNICODE data following it in the header.
+ ****************************************************************************/
+static void __decode_name4(const uint8_t *name, size_t name_sz,
+                const uint8_t *enc, size_t enc_sz, wchar_t *dst, size_t size)
+{
+        size_t ep = 0;
+        size_t dp = 0;
+        uint8_t high = ep < enc_sz ? enc[ep++] : 0;
+        uint8_t flags = 0;
+        int bits = 0;
+
+        while (ep < enc_sz && dp < size - 1) {
+                if (!bits) {
+                        flags = enc[ep++];
+                        bits = 8;
+                }
+                switch (flags >> 6) {
+                case 0:
+                        if (ep >= enc_sz)
+                                break;
+                        dst[dp++] = enc[ep++];
+                        break;
+                case 1:
+                        if (ep >= enc_sz)
+                                break;
+                        dst[dp++] = enc[ep++] + (high << 8);
+                        break;
+                case 2:
+                        if (ep + 1 >= enc_sz)
+                                break;
+                        dst[dp++] = enc[ep] + (enc[ep + 1] << 8);
+                        ep += 2;
+                        break;
+                case 3:
+                {
+                        int len;
+                        if (ep >= enc_sz)
+                                break;
+                        len = enc[ep++];
+                        if (len & 0x80) {
+                                uint8_t corr;
+                                if (ep >= enc_sz)
+                                        break;
+                                corr = enc[ep++];
+                                for (len = (len & 0x7f) + 2;
+                                     len > 0 && dp < size - 1 && dp < name_sz;
+                                     len--, dp++)
+                                        dst[dp] = ((name[dp] + corr) & 0xff) +
+                                                        (high << 8);
+                        } else {
+                                for (len += 2;
+                                     len > 0 && dp < size - 1 && dp < name_sz;
+                                     len--, dp++)
+                                        dst[dp] = name[dp];
+                        }
+                        break;
+                }
+                }
+                flags <<= 2;
+                bits -= 2;
+        }
+        dst[dp] = 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static time_t __dos_to_unix(uint32_t dos_time)
+{
+        struct tm t;
+
+        memset(&t, 0, sizeof(struct tm));
+        t.tm_sec = (dos_time & 0x1f) * 2;
+        t.tm_min = (dos_time >> 5) & 0x3f;
+        t.tm_hour = (dos_time >> 11) & 0x1f;
+        t.tm_mday = (dos_time >> 16) & 0x1f;
+        t.tm_mon = ((dos_time >> 21) & 0x0f) - 1;
+        t.tm_year = ((dos_time >> 25) & 0x7f) + 80;
+        t.tm_isdst = -1;
+        return mktime(&t);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static uint32_t __unix_to_dos(time_t tt)
+{
+        struct tm t;
+
+        if (!localtime_r(&tt, &t) || t.tm_year < 80)
+                return 0;
+        return ((uint32_t)(t.tm_year - 80) << 25) |
+                        ((t.tm_mon + 1) << 21) | (t.tm_mday << 16) |
+                        (t.tm_hour << 11) | (t.tm_min << 5) | (t.tm_sec / 2);
+}
+
+/*!
+ *****************************************************************************
+ * Convert a nanosecond resolution UNIX timestamp to the representation
+ * provided by RARListArchiveEx() for the libunrar version in use.
+ ****************************************************************************/
+static uint64_t __raw_time(uint64_t ns)
+{
+#if RARVER_MAJOR > 5 || (RARVER_MAJOR == 5 && RARVER_MINOR >= 50)
+        return ns;
+#elif RARVER_MAJOR > 4
+        return ns / 100;
+#else
+        (void)ns;
+        return 0;
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static unsigned int __host_os(int hsys, unsigned int host_os)
+{
+#if RARVER_MAJOR > 4
+        (void)host_os;
+        return hsys == HSYS_WINDOWS_ ? HOST_WIN32 : HOST_UNIX;
+#else
+        (void)hsys;
+        return host_os;
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __parse_file4(struct rarhdr *h, off_t pos, struct block *b,
+                RARArchiveDataEx *arc)
+{
+        struct cursor c = b->c;
+        uint64_t pack_size;
+        uint64_t unp_size;
+        unsigned int host_os;
+        uint32_t ftime;
+        unsigned int name_sz;
+        const uint8_t *name;
+        uint64_t mtime;
+        uint64_t ctime = 0;
+        uint64_t atime = 0;
+        int hsys;
+
+        pack_size = __get4(&c);
+        unp_size = __get4(&c);
+        host_os = __get1(&c);
+        arc->hdr.FileCRC = __get4(&c);
+        ftime = __get4(&c);
+        arc->hdr.UnpVer = __get1(&c);
+        arc->hdr.Method = __get1(&c);
+        name_sz = __get2(&c);
+        arc->hdr.FileAttr = __get4(&c);
+        if (b->flags & RAR4_LHD_LARGE) {
+                pack_size |= (uint64_t)__get4(&c) << 32;
+                unp_size |= (uint64_t)__get4(&c) << 32;
+        }
+        name = c.p;
+        __skip(&c, name_sz);
+        if (c.err)
+                return ERAR_BAD_DATA;
+
+        if (host_os == RAR4_HOST_UNIX || host_os == RAR4_HOST_BEOS)
+                hsys = HSYS_UNIX_;
+        else if (host_os < RAR4_HOST_MAX)
+                hsys = HSYS_WINDOWS_;
+        else
+                hsys = HSYS_UNKNOWN_;
+
+        arc->hdr.PackSize = pack_size & 0xffffffff;
+        arc->hdr.PackSizeHigh = pack_size >> 32;
+        arc->hdr.UnpSize = unp_size & 0xffffffff;
+        arc->hdr.UnpSizeHigh = unp_size >> 32;
+        arc->hdr.HostOS = __host_os(hsys, host_os);
+        arc->hdr.FileTime = ftime;
+
+        if (b->flags & RAR4_LHD_UNICODE) {
+                const uint8_t *z = memchr(name, 0, name_sz);
+                if (z) {
+                        size_t i;
+                        size_t n = 0;
+                        size_t len = z - name;
+                        __decode_name4(name, len, z + 1, name_sz - len - 1,
+                                       arc->hdr.FileNameW,
+                                       sizeof(arc->hdr.FileNameW) /
+                                                sizeof(wchar_t));
+                        for (i = 0; arc->hdr.FileNameW[i]; i++)
+                                n = __utf8_put(arc->hdr.FileName,
+                                               sizeof(arc->hdr.FileName), n,
+                                               arc->hdr.FileNameW[i]);
+                        arc->hdr.FileName[n] = 0;
+                        goto name_done;
+                }
+                /* No encoded part means the name is stored as UTF-8 */
+                __utf8_to_wide(name, name_sz, arc->hdr.FileNameW,
+                               sizeof(arc->hdr.FileNameW) / sizeof(wchar_t));
+        }
+        if (name_sz >= sizeof(arc->hdr.FileName))
+                name_sz = sizeof(arc->hdr.FileName) - 1;
+        memcpy(arc->hdr.FileName, name, name_sz);
+        arc->hdr.FileName[name_sz] = 0;
+
+name_done:
+        if (b->flags & RAR4_LHD_SALT)
+                __skip(&c, 8);
+
+        mtime = (uint64_t)__dos_to_unix(ftime) * 1000000000ULL;
+        if (b->flags & RAR4_LHD_EXTTIME) {
+                uint64_t *tbl[4] = {&mtime, &ctime, &atime, NULL};
+                unsigned int tflags = __get2(&c);
+                int i;
+
+                for (i = 0; i < 4 && !c.err; i++) {
+                        unsigned int rmode = tflags >> ((3 - i) * 4);
+                        uint64_t sec;
+                        uint32_t rem = 0;
+                        int count;
+                        int j;
+
+                        if (!(rmode & 8))
+                                continue;
+                        sec = __dos_to_unix(i ? __get4(&c) : ftime);
+                        if (rmode & 4)
+                                sec++;
+                        count = rmode & 3;
+                        for (j = 0; j < count; j++)
+                                rem |= (uint32_t)__get1(&c) <<
+                                                ((j + 3 - count) * 8);
+                        if (tbl[i])
+                                *tbl[i] = sec * 1000000000ULL + rem * 100ULL;
+                }
+                /* Broken extended time is not fatal, use what we got */
+        }
+        arc->RawTime.mtime = __raw_time(mtime);
+        arc->RawTime.ctime = __raw_time(ctime);
+        arc->RawTime.atime = __raw_time(atime);
+
+        if ((b->flags & RAR4_LHD_WINDOWMASK) == RAR4_LHD_DIRECTORY ||
+            (arc->hdr.UnpVer < 20 && (arc->hdr.FileAttr & 0x10)))
+                arc->hdr.Flags |= RHDF_DIRECTORY;
+        if (b->flags & RAR4_LHD_SPLIT_BEFORE)
+                arc->hdr.Flags |= RHDF_SPLITBEFORE;
+        if (b->flags & RAR4_LHD_SPLIT_AFTER)
+                arc->hdr.Flags |= RHDF_SPLITAFTER;
+        if (b->flags & RAR4_LHD_PASSWORD)
+                arc->hdr.Flags |= RHDF_ENCRYPTED;
+        if (b->flags & RAR4_LHD_SOLID)
+                arc->hdr.Flags |= RHDF_SOLID;
+
+        if (hsys == HSYS_UNKNOWN_)
+                arc->hdr.FileAttr = (arc->hdr.Flags & RHDF_DIRECTORY)
+                                        ? 0x10 : 0x20;
+
+        /* Symbolic link target is stored as file data */
+        if (host_os == RAR4_HOST_UNIX &&
+            (arc->hdr.FileAttr & 0xF000) == 0xA000 &&
+            arc->hdr.UnpVer < 50) {
+                size_t sz = sizeof(arc->LinkTarget) - 1;
+                ssize_t n;
+                if (pack_size < sz)
+                        sz = pack_size;
+                n = pread(h->fd, arc->LinkTarget, sz, pos + b->head_size);
+                arc->LinkTarget[n > 0 ? n : 0] = 0;
+        }
+
+        return ERAR_SUCCESS;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __parse_file5(struct rarhdr *h, struct block *b,
+                RARArchiveDataEx *arc)
+{
+        struct cursor c = b->c;
+        struct cursor x = b->extra;
+        uint64_t file_flags;
+        uint64_t unp_size;
+        uint64_t comp_info;
+        uint64_t host_os;
+        uint64_t name_sz;
+        const uint8_t *name;
+        uint64_t mtime = 0;
+        uint64_t ctime = 0;
+        uint64_t atime = 0;
+        unsigned int algo;
+        size_t i;
+        int hsys;
+
+        (void)h;
+
+        file_flags = __getv(&c);
+        unp_size = __getv(&c);
+        arc->hdr.FileAttr = __getv(&c);
+        if (file_flags & RAR5_FHFL_UTIME)
+                mtime = (uint64_t)__get4(&c) * 1000000000ULL;
+        if (file_flags & RAR5_FHFL_CRC32)
+                arc->hdr.FileCRC = __get4(&c);
+        comp_info = __getv(&c);
+        host_os = __getv(&c);
+        name_sz = __getv(&c);
+        name = c.p;
+        __skip(&c, name_sz);
+        if (c.err)
+                return ERAR_BAD_DATA;
+
+        if (host_os == RAR5_HOST_WINDOWS)
+                hsys = HSYS_WINDOWS_;
+        else if (host_os == RAR5_HOST_UNIX)
+                hsys = HSYS_UNIX_;
+        else
+                hsys = HSYS_UNKNOWN_;
+
+        if (file_flags & RAR5_FHFL_UNPUNKNOWN)
+                unp_size = INT64NDF;
+        arc->hdr.PackSize = b->data_size & 0xffffffff;
+        arc->hdr.PackSizeHigh = b->data_size >> 32;
+        arc->hdr.UnpSize = unp_size & 0xffffffff;
+        arc->hdr.UnpSizeHigh = unp_size >> 32;
+        arc->hdr.HostOS = __host_os(hsys, host_os);
+        arc->hdr.Method = ((comp_info >> 7) & 7) + 0x30;
+        algo = comp_info & RAR5_FCI_ALGO_MASK;
+#if RARVER_MAJOR >= 7
+        arc->hdr.UnpVer = algo == 1 ? 70 : 50 + algo;
+#else
+        arc->hdr.UnpVer = 50 + algo;
+#endif
+
+        if (name_sz >= sizeof(arc->hdr.FileName))
+                name_sz = sizeof(arc->hdr.FileName) - 1;
+        memcpy(arc->hdr.FileName, name, name_sz);
+        arc->hdr.FileName[name_sz] = 0;
+        /* Backslash is not a valid character in Windows file names but
+         * it is a perfectly valid one on UNIX. Do what libunrar does. */
+        if (hsys == HSYS_WINDOWS_) {
+                for (i = 0; i < name_sz; i++)
+                        if (arc->hdr.FileName[i] == '\\')
+                                arc->hdr.FileName[i] = '_';
+        }
+        __utf8_to_wide((uint8_t *)arc->hdr.FileName, name_sz,
+                       arc->hdr.FileNameW,
+                       sizeof(arc->hdr.FileNameW) / sizeof(wchar_t));
+
+        if (file_flags & RAR5_FHFL_DIRECTORY)
+                arc->hdr.Flags |= RHDF_DIRECTORY;
+        if (b->flags & RAR5_HFL_SPLITBEFORE)
+                arc->hdr.Flags |= RHDF_SPLITBEFORE;
+        if (b->flags & RAR5_HFL_SPLITAFTER)
+                arc->hdr.Flags |= RHDF_SPLITAFTER;
+        if (comp_info & RAR5_FCI_SOLID)
+                arc->hdr.Flags |= RHDF_SOLID;
+
+        if (hsys == HSYS_UNKNOWN_)
+                arc->hdr.FileAttr = (arc->hdr.Flags & RHDF_DIRECTORY)
+                                        ? 0x10 : 0x20;
+
+        while (x.p < x.end && !x.err) {
+                uint64_t rec_sz = __getv(&x);
+                struct cursor r;
+
+                if (x.err || rec_sz > (uint64_t)(x.end - x.p))
+                        break;
+                r.p = x.p;
+                r.end = x.p + rec_sz;
+                r.err = 0;
+                x.p += rec_sz;
+
+                switch (__getv(&r)) {
+                case RAR5_FHEXTRA_CRYPT:
+                        arc->hdr.Flags |= RHDF_ENCRYPTED;
+                        break;
+                case RAR5_FHEXTRA_HTIME:
+                {
+                        unsigned int tflags = __getv(&r);
+                        uint64_t *tbl[3] = {&mtime, &ctime, &atime};
+                        unsigned int mask[3] = {RAR5_HTIME_MTIME,
+                                                RAR5_HTIME_CTIME,
+                                                RAR5_HTIME_ATIME};
+                        int j;
+
+                        for (j = 0; j < 3; j++) {
+                                if (!(tflags & mask[j]))
+                                        continue;
+                                if (tflags & RAR5_HTIME_UNIXTIME) {
+                                        *tbl[j] = (uint64_t)__get4(&r) *
+                                                        1000000000ULL;
+                                } else {
+                                        uint64_t ft = __get8(&r);
+                                        *tbl[j] = ft > WIN_EPOCH_DIFF
+                                                ? (ft - WIN_EPOCH_DIFF) * 100
+                                                : 0;
+                                }
+                        }
+                        if ((tflags & RAR5_HTIME_UNIXTIME) &&
+                            (tflags & RAR5_HTIME_UNIX_NS)) {
+                                for (j = 0; j < 3; j++) {
+                                        uint32_t ns;
+                                        if (!(tflags & mask[j]))
+                                                continue;
+                                        ns = __get4(&r) & 0x3fffffff;
+                                        if (ns < 1000000000)
+                                                *tbl[j] += ns;
+                                }
+                        }
+                        break;
+                }
+                case RAR5_FHEXTRA_REDIR:
+                {
+                        uint64_t type = __getv(&r);
+                        uint64_t len;
+
+                        (void)__getv(&r);               /* flags */
+                        len = __getv(&r);
+                        if (!__avail(&r, len))
+                                break;
+                        if (type == RAR5_REDIR_UNIXSYMLINK &&
+                            (arc->hdr.FileAttr & 0xF000) == 0xA000) {
+                                __utf8_to_wide(r.p, len, arc->LinkTargetW,
+                                               sizeof(arc->LinkTargetW) /
+                                                        sizeof(wchar_t));
+                                arc->LinkTargetFlags |= LINK_T_UNICODE;
+                        } else if (type == RAR5_REDIR_FILECOPY) {
+                                __utf8_to_wide(r.p, len, arc->LinkTargetW,
+                                               sizeof(arc->LinkTargetW) /
+                                                        sizeof(wchar_t));
+                                arc->LinkTargetFlags |= LINK_T_FILECOPY;
+                        }
+                        break;
+                }
+                default:
+                        break;
+                }
+        }
+
+        arc->hdr.FileTime = __unix_to_dos(mtime / 1000000000ULL);
+        arc->RawTime.mtime = __raw_time(mtime);
+        arc->RawTime.ctime = __raw_time(ctime);
+        arc->RawTime.atime = __raw_time(atime);
+
+        return ERAR_SUCCESS;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __read_main4(struct rarhdr *h)
+{
+        struct block b;
+        int ret;
+
+        ret = __read_block4(h, h->pos, &b);
+        if (ret)
+                return ret;
+        if (b.type != RAR4_HEAD_MAIN)
+                return ERAR_BAD_ARCHIVE;
+        if (b.flags & RAR4_MHD_PASSWORD)
+                return ERAR_MISSING_PASSWORD;
+
+        if (b.flags & RAR4_MHD_VOLUME)
+                h->flags |= ROADF_VOLUME;
+        if (b.flags & RAR4_MHD_COMMENT)
+                h->flags |= ROADF_COMMENT;
+        if (b.flags & RAR4_MHD_LOCK)
+                h->flags |= ROADF_LOCK;
+        if (b.flags & RAR4_MHD_SOLID)
+                h->flags |= ROADF_SOLID;
+        if (b.flags & RAR4_MHD_NEWNUMBERING)
+                h->flags |= ROADF_NEWNUMBERING;
+        if (b.flags & RAR4_MHD_AV)
+                h->flags |= ROADF_SIGNED;
+        if (b.flags & RAR4_MHD_PROTECT)
+                h->flags |= ROADF_RECOVERY;
+        if (b.flags & RAR4_MHD_FIRSTVOLUME)
+                h->flags |= ROADF_FIRSTVOLUME;
+
+        h->pos += b.head_size + b.data_size;
+        return ERAR_SUCCESS;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __read_main5(struct rarhdr *h)
+{
+        struct block b;
+        uint64_t flags;
+        int ret;
+
+        ret = __read_block5(h, h->pos, &b);
+        if (ret)
+                return ret;
+        if (b.type == RAR5_HEAD_CRYPT)
+                return ERAR_MISSING_PASSWORD;
+        if (b.type != RAR5_HEAD_MAIN)
+                return ERAR_BAD_ARCHIVE;
+
+        flags = __getv(&b.c);
+        if (b.c.err)
+                return ERAR_BAD_DATA;
+
+        while (b.extra.p < b.extra.end && !b.extra.err) {
+                uint64_t rec_sz = __getv(&b.extra);
+                struct cursor r;
+
+                if (b.extra.err ||
+                    rec_sz > (uint64_t)(b.extra.end - b.extra.p))
+                        break;
+                r.p = b.extra.p;
+                r.end = b.extra.p + rec_sz;
+                r.err = 0;
+                b.extra.p += rec_sz;
+                if (__getv(&r) == RAR5_MHEXTRA_LOCATOR) {
+                        uint64_t lflags = __getv(&r);
+                        uint64_t offset = 0;
+                        if (lflags & RAR5_LOCATOR_QLIST)
+                                offset = __getv(&r);
+                        /* Offset is relative to the main archive header */
+                        if (!r.err && offset && offset < (uint64_t)h->size)
+                                h->qo_pos = h->pos + offset;
+                }
+        }
+
+        if (flags & RAR5_MHFL_VOLUME)
+                h->flags |= ROADF_VOLUME;
+        if (flags & RAR5_MHFL_SOLID)
+                h->flags |= ROADF_SOLID;
+        if (flags & RAR5_MHFL_PROTECT)
+                h->flags |= ROADF_RECOVERY;
+        if (flags & RAR5_MHFL_LOCK)
+                h->flags |= ROADF_LOCK;
+        if ((flags & RAR5_MHFL_VOLUME) && !(flags & RAR5_MHFL_VOLNUMBER))
+                h->flags |= ROADF_FIRSTVOLUME;
+        h->flags |= ROADF_NEWNUMBERING;
+
+        h->pos += b.head_size + b.data_size;
+        return ERAR_SUCCESS;
+}
+
+/*!
+ *****************************************************************************
+ * Load the quick open data pointed out by the locator record in the main
+ * archive header. It is stored as the data area of a service header named
+ * "QO" and holds copies of the archive headers. Reading it in one go avoids
+ * scattered reads of individual headers throughout the archive.
+ ****************************************************************************/
+static void __load_quick_open(struct rarhdr *h)
+{
+        struct block b;
+        struct cursor c;
+        uint64_t file_flags;
+        uint64_t comp_info;
+        uint64_t name_sz;
+        off_t qo_pos = h->qo_pos;
+        ssize_t n;
+
+        h->qo_pos = 0;
+        if (!qo_pos || qo_pos >= h->size ||
+            __read_block5(h, qo_pos, &b) ||
+            b.type != RAR5_HEAD_SERVICE ||
+            !b.data_size || b.data_size > RARHDR_QO_MAX_SZ ||
+            (qo_pos + b.head_size + (off_t)b.data_size) > h->size)
+                return;
+
+        c = b.c;
+        file_flags = __getv(&c);
+        (void)__getv(&c);               /* unpacked size */
+        (void)__getv(&c);               /* attributes */
+        if (file_flags & RAR5_FHFL_UTIME)
+                __skip(&c, 4);
+        if (file_flags & RAR5_FHFL_CRC32)
+                __skip(&c, 4);
+        comp_info = __getv(&c);
+        (void)__getv(&c);               /* host os */
+        name_sz = __getv(&c);
+        if (c.err || name_sz != 2 || !__avail(&c, 2) ||
+            memcmp(c.p, "QO", 2))
+                return;
+        /* Only stored (and not encrypted) data can be used as-is */
+        if (((comp_info >> 7) & 7) || (b.flags & RAR5_HFL_EXTRA))
+                return;
+
+        h->qo_data = malloc(b.data_size);
+        if (!h->qo_data)
+                return;
+        n = pread(h->fd, h->qo_data, b.data_size, qo_pos + b.head_size);
+        if (n != (ssize_t)b.data_size) {
+                free(h->qo_data);
+                h->qo_data = NULL;
+                return;
+        }
+        h->qo_pos = qo_pos;
+        h->qo_len = b.data_size;
+        h->qo_idx = 0;
+        __qo_next(h);
+        printd(3, "Loaded %zu bytes of quick open data from %s\n",
+               h->qo_len, h->arch);
+}
+
+/*!
+ *****************************************************************************
+ * Old archive formats did not have the first volume flag set in the main
+ * header. Do the same as libunrar and instead check the split flag of the
+ * first file header. Service headers (comments etc.) are considered as well
+ * until the first file header is found.
+ ****************************************************************************/
+static void __check_first_volume(struct rarhdr *h)
+{
+        unsigned int service = h->format == FMT_RAR5
+                        ? RAR5_HEAD_SERVICE : RAR4_HEAD_SERVICE;
+        unsigned int file = h->format == FMT_RAR5
+                        ? RAR5_HEAD_FILE : RAR4_HEAD_FILE;
+        unsigned int endarc = h->format == FMT_RAR5
+                        ? RAR5_HEAD_ENDARC : RAR4_HEAD_ENDARC;
+        uint64_t split = h->format == FMT_RAR5
+                        ? RAR5_HFL_SPLITBEFORE : RAR4_LHD_SPLIT_BEFORE;
+        off_t pos = h->pos;
+        struct block b;
+
+        if (!(h->flags & ROADF_VOLUME))
+                return;
+
+        while (pos < h->size && !__read_block(h, pos, &b)) {
+                if (b.type == service || b.type == file) {
+                        if (b.flags & split)
+                                h->flags &= ~ROADF_FIRSTVOLUME;
+                        else
+                                h->flags |= ROADF_FIRSTVOLUME;
+                        if (b.type == file)
+                                break;
+                } else if (b.type == endarc) {
+                        break;
+                }
+                pos += b.head_size + b.data_size;
+        }
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __is_utf8_locale()
+{
+#ifdef HAVE_LANGINFO_H
+        const char *cs = nl_langinfo(CODESET);
+        return cs && (!strcasecmp(cs, "UTF-8") || !strcasecmp(cs, "UTF8"));
+#else
+        return 0;
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void *rarhdr_open(const char *arch, unsigned int *flags)
+{
+        struct rarhdr *h;
+        const uint8_t *p;
+        struct stat st;
+        int ret;
+
+        /* File names are passed on as UTF-8 so in any other locale
+         * the conversion needs to be handled by libunrar. */
+        if (!__is_utf8_locale())
+                return NULL;
+
+        h = calloc(1, sizeof(struct rarhdr));
+        if (!h)
+                return NULL;
+        h->fd = open(arch, O_RDONLY);
+        if (h->fd == -1)
+                goto error;
+        if (fstat(h->fd, &st))
+                goto error;
+        h->size = st.st_size;
+        h->buf_sz = RARHDR_BUF_SZ;
+        h->buf = malloc(h->buf_sz);
+        if (!h->buf)
+                goto error;
+        h->arch = arch;
+
+        p = __fetch(h, 0, RAR5_SIG_SZ);
+        if (!p)
+                goto error;
+#if RARVER_MAJOR > 4
+        if (!memcmp(p, rar5_sig, RAR5_SIG_SZ)) {
+                h->format = FMT_RAR5;
+                h->pos = RAR5_SIG_SZ;
+                ret = __read_main5(h);
+        } else
+#endif
+        if (!memcmp(p, rar4_sig, RAR4_SIG_SZ)) {
+                h->format = FMT_RAR4;
+                h->pos = RAR4_SIG_SZ;
+                ret = __read_main4(h);
+        } else {
+                /* SFX or some unsupported format */
+                goto error;
+        }
+        if (ret)
+                goto error;
+
+        if (h->format == FMT_RAR5)
+                __load_quick_open(h);
+        __check_first_volume(h);
+        *flags = h->flags;
+        return h;
+
+error:
+        rarhdr_close(h);
+        return NULL;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+int rarhdr_list(void *h_, RARArchiveDataEx **arc)
+{
+        struct rarhdr *h = h_;
+        unsigned int file = h->format == FMT_RAR5
+                        ? RAR5_HEAD_FILE : RAR4_HEAD_FILE;
+        unsigned int endarc = h->format == FMT_RAR5
+                        ? RAR5_HEAD_ENDARC : RAR4_HEAD_ENDARC;
+        struct block b;
+        off_t next;
+        int ret;
+
+        while (h->pos < h->size) {
+                ret = __read_block(h, h->pos, &b);
+                if (ret)
+                        return ret;
+                next = h->pos + b.head_size + b.data_size;
+                if (next <= h->pos)
+                        return ERAR_BAD_DATA;
+                if (b.type == endarc)
+                        break;
+                if (b.type != file) {
+                        h->pos = next;
+                        continue;
+                }
+
+                memset(&h->arc, 0, sizeof(RARArchiveDataEx));
+                if (h->format == FMT_RAR5)
+                        ret = __parse_file5(h, &b, &h->arc);
+                else
+                        ret = __parse_file4(h, h->pos, &b, &h->arc);
+                if (ret)
+                        return ret;
+                strncpy(h->arc.hdr.ArcName, h->arch,
+                        sizeof(h->arc.hdr.ArcName) - 1);
+                h->arc.HeadSize = b.head_size;
+                h->arc.Offset = h->pos;
+                h->arc.FileDataEnd = next;
+                h->pos = next;
+                *arc = &h->arc;
+                return ERAR_SUCCESS;
+        }
+
+        h->pos = h->size;
+        return ERAR_END_ARCHIVE;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void rarhdr_close(void *h_)
+{
+        struct rarhdr *h = h_;
+
+        if (!h)
+                return;
+        if (h->fd != -1)
+                close(h->fd);
+        free(h->qo_data);
+        free(h->buf);
+        free(h);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+int rarhdr_quick_open(void *h_)
+{
+        struct rarhdr *h = h_;
+
+        return h->qo_hits > 0;
+}
@@ -0,0 +1,597 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "debug.h"
+#include "rawio.h"
+
+/*
+ * I/O layer for reading files that are stored uncompressed in archives
+ * (raw mode). A request is split by the caller into segments, one per
+ * volume file touched. Volume files are opened on demand and a few of
+ * them are kept open. If supported, segments are submitted as one batch
+ * using io_uring and the next chunk of a sequential stream is read ahead
+ * asynchronously into a registered buffer. Otherwise plain pread(2) is
+ * used and read-ahead is left to the kernel through posix_fadvise(2).
+ *
+ * For sequential streams through multi-volume archives the caller also
+ * passes the location of the data in the next volume when the current
+ * one is about to run out. That volume is then opened and read ahead
+ * before it is actually needed, and volumes that have been consumed are
+ * dropped from the page cache.
+ *
+ * A request can also be mapped onto the volume files without reading it,
+ * for the caller to have the data spliced by FUSE. The same sequential
+ * bookkeeping applies but read-ahead is always left to the kernel.
+ */
+
+#define RAWIO_NFDS 4
+#define RAWIO_PF_MAX (1024 * 1024)
+#ifdef HAVE_LIBURING
+#define RAWIO_QD 16
+#define RAWIO_PF_TAG ((uint64_t)-1)
+#endif
+
+struct rawio_fd {
+        int vol;
+        int fd;
+        unsigned int stamp;
+};
+
+struct rawio {
+        rawio_open_fn open_vol;
+        void *ctx;
+        struct rawio_fd fds[RAWIO_NFDS];
+        unsigned int stamp;
+        int last_vol;           /* last volume touched */
+        off_t last_pos;         /* end of last request in file */
+#ifdef HAVE_LIBURING
+        struct io_uring ring;
+        int ring_ok;
+        int fixed_files;
+        int fixed_buf;
+        /* read-ahead state */
+        char *pf_buf;
+        int pf_vol;
+        off_t pf_off;
+        size_t pf_len;
+        ssize_t pf_res;
+        int pf_pending;
+#endif
+};
+
+/*!
+ *****************************************************************************
+ * Get file descriptor slot for volume |vol|, open it if needed.
+ ****************************************************************************/
+static int __get_slot(struct rawio *h, int vol)
+{
+        int i;
+        int lru = 0;
+        int fd;
+
+        for (i = 0; i < RAWIO_NFDS; i++) {
+                if (h->fds[i].fd != -1 && h->fds[i].vol == vol) {
+                        h->fds[i].stamp = ++h->stamp;
+                        return i;
+                }
+                if (h->fds[i].fd == -1 ||
+                    (h->fds[lru].fd != -1 &&
+                     h->fds[i].stamp < h->fds[lru].stamp))
+                        lru = i;
+        }
+
+        fd = h->open_vol(h->ctx, vol);
+        if (fd == -1)
+                return -1;
+#ifdef POSIX_FADV_SEQUENTIAL
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        if (h->fds[lru].fd != -1)
+                close(h->fds[lru].fd);
+        h->fds[lru].fd = fd;
+        h->fds[lru].vol = vol;
+        h->fds[lru].stamp = ++h->stamp;
+#ifdef HAVE_LIBURING
+        if (h->fixed_files &&
+            io_uring_register_files_update(&h->ring, lru, &fd, 1) != 1)
+                h->fixed_files = 0;
+#endif
+        return lru;
+}
+
+/*!
+ *****************************************************************************
+ * Release a volume that has been consumed by a sequential reader.
+ ****************************************************************************/
+static void __drop_slot(struct rawio *h, int slot)
+{
+        int fd = h->fds[slot].fd;
+
+        printd(3, "Dropping consumed volume %d\n", h->fds[slot].vol);
+#ifdef POSIX_FADV_DONTNEED
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+#ifdef HAVE_LIBURING
+        if (h->fixed_files) {
+                int none = -1;
+                if (io_uring_register_files_update(&h->ring, slot,
+                                                   &none, 1) != 1)
+                        h->fixed_files = 0;
+        }
+#endif
+        close(fd);
+        h->fds[slot].fd = -1;
+}
+
+/*!
+ *****************************************************************************
+ * Open volume of |seg| ahead of time and ask the kernel to start reading.
+ ****************************************************************************/
+static void __advise(struct rawio *h, const struct rawio_seg *seg)
+{
+        int slot = __get_slot(h, seg->vol);
+
+#ifdef POSIX_FADV_WILLNEED
+        if (slot != -1)
+                (void)posix_fadvise(h->fds[slot].fd, seg->off, seg->len,
+                                    POSIX_FADV_WILLNEED);
+#else
+        (void)slot;
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static ssize_t __pread_full(int fd, char *buf, size_t len, off_t off)
+{
+        size_t tot = 0;
+        ssize_t n;
+
+        while (tot < len) {
+                n = pread(fd, buf + tot, len - tot, off + tot);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                if (!n)
+                        break;
+                tot += n;
+        }
+        return tot;
+}
+
+#ifdef HAVE_LIBURING
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __pf_reap(struct rawio *h)
+{
+        struct io_uring_cqe *cqe;
+
+        while (h->pf_pending) {
+                if (io_uring_wait_cqe(&h->ring, &cqe))
+                        break;
+                if (cqe->user_data == RAWIO_PF_TAG) {
+                        h->pf_res = cqe->res;
+                        h->pf_pending = 0;
+                }
+                io_uring_cqe_seen(&h->ring, cqe);
+        }
+        if (h->pf_pending) {
+                /* Should not happen, but if it does the ring is no
+                 * longer in a known state. */
+                h->pf_pending = 0;
+                h->pf_res = -1;
+                h->ring_ok = 0;
+        }
+}
+
+/*!
+ *****************************************************************************
+ * Serve |seg| from the read-ahead buffer if completely covered by it.
+ ****************************************************************************/
+static int __pf_hit(struct rawio *h, struct rawio_seg *seg)
+{
+        if (!h->pf_buf || (!h->pf_pending && h->pf_res <= 0))
+                return 0;
+        __pf_reap(h);
+        if (h->pf_res <= 0 || seg->vol != h->pf_vol ||
+            seg->off < h->pf_off ||
+            seg->off + (off_t)seg->len > h->pf_off + h->pf_res)
+                return 0;
+        memcpy(seg->buf, h->pf_buf + (seg->off - h->pf_off), seg->len);
+        return 1;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __pf_submit(struct rawio *h, const struct rawio_seg *next)
+{
+        struct io_uring_sqe *sqe;
+        size_t len = next->len < RAWIO_PF_MAX ? next->len : RAWIO_PF_MAX;
+        int slot;
+
+        slot = __get_slot(h, next->vol);
+        if (slot == -1)
+                return;
+        sqe = io_uring_get_sqe(&h->ring);
+        if (!sqe)
+                return;
+        if (h->fixed_buf)
+                io_uring_prep_read_fixed(sqe, h->fixed_files ? slot :
+                                         h->fds[slot].fd, h->pf_buf, len,
+                                         next->off, 0);
+        else
+                io_uring_prep_read(sqe, h->fixed_files ? slot :
+                                   h->fds[slot].fd, h->pf_buf, len,
+                                   next->off);
+        if (h->fixed_files)
+                sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->user_data = RAWIO_PF_TAG;
+        if (io_uring_submit(&h->ring) != 1)
+                return;
+        h->pf_vol = next->vol;
+        h->pf_off = next->off;
+        h->pf_len = len;
+        h->pf_res = 0;
+        h->pf_pending = 1;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static ssize_t __read_uring(struct rawio *h, struct rawio_seg *segs, int n)
+{
+        struct io_uring_cqe *cqe;
+        int slots[RAWIO_QD];
+        ssize_t got[RAWIO_QD];
+        ssize_t tot = 0;
+        int queued = 0;
+        int i;
+
+        for (i = 0; i < n; i++) {
+                struct io_uring_sqe *sqe;
+
+                if (i == 0 && __pf_hit(h, &segs[i])) {
+                        got[i] = segs[i].len;
+                        continue;
+                }
+                slots[i] = __get_slot(h, segs[i].vol);
+                if (slots[i] == -1)
+                        return -1;
+                sqe = io_uring_get_sqe(&h->ring);
+                if (!sqe)
+                        return -1;
+                if (h->fixed_files) {
+                        io_uring_prep_read(sqe, slots[i], segs[i].buf,
+                                           segs[i].len, segs[i].off);
+                        sqe->flags |= IOSQE_FIXED_FILE;
+                } else {
+                        io_uring_prep_read(sqe, h->fds[slots[i]].fd,
+                                           segs[i].buf, segs[i].len,
+                                           segs[i].off);
+                }
+                sqe->user_data = i;
+                got[i] = -1;
+                ++queued;
+        }
+        if (queued && io_uring_submit_and_wait(&h->ring, queued) < 0) {
+                h->ring_ok = 0;
+                return -1;
+        }
+
+        /* Reap all completions before looking at the result to keep the
+         * completion queue in sync. */
+        while (queued) {
+                uint64_t j;
+
+                if (io_uring_wait_cqe(&h->ring, &cqe)) {
+                        h->ring_ok = 0;
+                        return -1;
+                }
+                j = cqe->user_data;
+                if (j < (uint64_t)n) {
+                        got[j] = cqe->res < 0 ? -1 : cqe->res;
+                        --queued;
+                }
+                io_uring_cqe_seen(&h->ring, cqe);
+        }
+
+        for (i = 0; i < n; i++) {
+                if (got[i] >= 0 && (size_t)got[i] < segs[i].len) {
+                        /* Complete short reads synchronously */
+                        ssize_t r = __pread_full(h->fds[slots[i]].fd,
+                                                 segs[i].buf + got[i],
+                                                 segs[i].len - got[i],
+                                                 segs[i].off + got[i]);
+                        got[i] = r < 0 ? -1 : got[i] + r;
+                }
+                if (got[i] < 0)
+                        return tot ? tot : -1;
+                tot += got[i];
+                /* Nothing beyond a short segment is valid */
+                if ((size_t)got[i] < segs[i].len)
+                        break;
+        }
+        return tot;
+}
+
+#endif
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static ssize_t __read_sync(struct rawio *h, struct rawio_seg *segs, int n)
+{
+        ssize_t tot = 0;
+        ssize_t r;
+        int slot;
+        int i;
+
+        for (i = 0; i < n; i++) {
+                slot = __get_slot(h, segs[i].vol);
+                if (slot == -1)
+                        return tot ? tot : -1;
+                r = __pread_full(h->fds[slot].fd, segs[i].buf, segs[i].len,
+                                 segs[i].off);
+                if (r == -1)
+                        return tot ? tot : -1;
+                tot += r;
+                if ((size_t)r < segs[i].len)
+                        break;
+        }
+        return tot;
+}
+
+/*!
+ *****************************************************************************
+ * Returns non-zero if a request starting at |pos| continues where the
+ * previous one ended. Volumes left behind by a sequential stream will not
+ * be read again any time soon and are released.
+ ****************************************************************************/
+static int __seq_begin(struct rawio *h, off_t pos,
+                const struct rawio_seg *segs)
+{
+        int sequential = pos == h->last_pos;
+        int i;
+
+        if (sequential && segs[0].vol != h->last_vol) {
+                for (i = 0; i < RAWIO_NFDS; i++) {
+                        if (h->fds[i].fd != -1 && h->fds[i].vol < segs[0].vol)
+                                __drop_slot(h, i);
+                }
+        }
+        return sequential;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void __seq_end(struct rawio *h, off_t pos, ssize_t res,
+                const struct rawio_seg *segs, int n)
+{
+        h->last_vol = segs[n - 1].vol;
+        h->last_pos = pos + (res > 0 ? res : 0);
+}
+
+/*!
+ *****************************************************************************
+ * Read all segments of a request starting at |pos| in the file. The
+ * |nnext| segments in |next| describe the location of the data following
+ * the request, which will be read ahead if the access pattern looks
+ * sequential. Returns the number of bytes read or -1 on error.
+ ****************************************************************************/
+ssize_t rawio_read(void *h_, off_t pos, struct rawio_seg *segs, int n,
+                const struct rawio_seg *next, int nnext)
+{
+        struct rawio *h = h_;
+        int sequential;
+        ssize_t res;
+        int i;
+
+        if (!n)
+                return 0;
+        sequential = __seq_begin(h, pos, segs);
+
+#ifdef HAVE_LIBURING
+        if (h->ring_ok && n <= RAWIO_NFDS) {
+                res = __read_uring(h, segs, n);
+                i = 0;
+                if (res >= 0 && h->ring_ok && nnext && next[0].len &&
+                    sequential && h->pf_buf && !h->pf_pending) {
+                        __pf_submit(h, &next[0]);
+                        i = 1;
+                }
+                goto out;
+        }
+#endif
+        res = __read_sync(h, segs, n);
+        i = 0;
+
+#ifdef HAVE_LIBURING
+out:
+#endif
+        if (res >= 0 && sequential) {
+                for (; i < nnext; i++) {
+                        if (next[i].len)
+                                __advise(h, &next[i]);
+                }
+        }
+        __seq_end(h, pos, res, segs, n);
+        return res;
+}
+
+/*!
+ *****************************************************************************
+ * Map all segments of a request starting at |pos| onto the volume files
+ * without reading them. A duplicate of the descriptor of each volume is
+ * stored in |fds| and is owned by the caller, since the descriptors of
+ * the handle may be closed by any later call. The data following the
+ * request is handled as by rawio_read(), except that read-ahead is always
+ * left to the kernel. Returns 0 on success or -1 on error.
+ ****************************************************************************/
+int rawio_map(void *h_, off_t pos, const struct rawio_seg *segs, int n,
+                int *fds, const struct rawio_seg *next, int nnext)
+{
+        struct rawio *h = h_;
+        int sequential;
+        ssize_t tot = 0;
+        int slot;
+        int i;
+
+        if (!n)
+                return 0;
+        if (n > RAWIO_NFDS)
+                return -1;
+        sequential = __seq_begin(h, pos, segs);
+
+        for (i = 0; i < n; i++) {
+                slot = __get_slot(h, segs[i].vol);
+                fds[i] = slot == -1 ? -1 : dup(h->fds[slot].fd);
+                if (fds[i] == -1) {
+                        while (i--)
+                                close(fds[i]);
+                        return -1;
+                }
+                tot += segs[i].len;
+        }
+
+        if (sequential) {
+                for (i = 0; i < nnext; i++) {
+                        if (next[i].len)
+                                __advise(h, &next[i]);
+                }
+        }
+        __seq_end(h, pos, tot, segs, n);
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+int rawio_is_async(void *h_)
+{
+#ifdef HAVE_LIBURING
+        struct rawio *h = h_;
+        return h->ring_ok;
+#else
+        (void)h_;
+        return 0;
+#endif
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void *rawio_open(rawio_open_fn open_vol, void *ctx)
+{
+        struct rawio *h;
+        int i;
+
+        h = calloc(1, sizeof(struct rawio));
+        if (!h)
+                return NULL;
+        h->open_vol = open_vol;
+        h->ctx = ctx;
+        h->last_vol = -1;
+        h->last_pos = -1;
+        for (i = 0; i < RAWIO_NFDS; i++)
+                h->fds[i].fd = -1;
+
+#ifdef HAVE_LIBURING
+        if (io_uring_queue_init(RAWIO_QD, &h->ring, 0) == 0) {
+                int fds[RAWIO_NFDS];
+                struct iovec iov;
+
+                h->ring_ok = 1;
+                for (i = 0; i < RAWIO_NFDS; i++)
+                        fds[i] = -1;
+                /* Sparse registration, slots are updated when opened */
+                if (!io_uring_register_files(&h->ring, fds, RAWIO_NFDS))
+                        h->fixed_files = 1;
+                if (!posix_memalign((void **)&h->pf_buf, 4096,
+                                    RAWIO_PF_MAX)) {
+                        iov.iov_base = h->pf_buf;
+                        iov.iov_len = RAWIO_PF_MAX;
+                        if (!io_uring_register_buffers(&h->ring, &iov, 1))
+                                h->fixed_buf = 1;
+                } else {
+                        h->pf_buf = NULL;
+                }
+        } else {
+                printd(3, "io_uring not available, using pread()\n");
+        }
+#endif
+        return h;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void rawio_close(void *h_)
+{
+        struct rawio *h = h_;
+        int i;
+
+        if (!h)
+                return;
+#ifdef HAVE_LIBURING
+        if (h->ring_ok) {
+                __pf_reap(h);
+                io_uring_queue_exit(&h->ring);
+        }
+        free(h->pf_buf);
+#endif
+        for (i = 0; i < RAWIO_NFDS; i++) {
+                if (h->fds[i].fd != -1)
+                        close(h->fds[i].fd);
+        }
+        free(h);
+}
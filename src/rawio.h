@@ -0,0 +1,53 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+
+#ifndef RAWIO_H_
+#define RAWIO_H_
+
+#include <platform.h>
+#include <sys/types.h>
+
+/* A piece of a read request located in one volume file */
+struct rawio_seg {
+        int vol;
+        off_t off;
+        size_t len;
+        char *buf;
+};
+
+typedef int (*rawio_open_fn)(void *ctx, int vol);
+
+void *rawio_open(rawio_open_fn open_vol, void *ctx);
+ssize_t rawio_read(void *h, off_t pos, struct rawio_seg *segs, int n,
+                const struct rawio_seg *next, int nnext);
+int rawio_map(void *h, off_t pos, const struct rawio_seg *segs, int n,
+                int *fds, const struct rawio_seg *next, int nnext);
+int rawio_is_async(void *h);
+void rawio_close(void *h);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+    Copyright (C) 2009 Hans Beckerus (hans.beckerus@gmail.com)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program take use of the freeware "Unrar C++ Library" (libunrar)
+    by Alexander Roshal and some extensions to it.
+
+    Unrar source may be used in any software to handle RAR archives
+    without limitations free of charge, but cannot be used to re-create
+    the RAR compression algorithm, which is proprietary. Distribution
+    of modified Unrar source in separate form or as a part of other
+    software is permitted, provided that it is clearly stated in
+    the documentation and source comments that the code may not be used
+    to develop a RAR (WinRAR) compatible archiver.
+*/
+
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "debug.h"
+#include "threadpool.h"
+
+/*
+ * A fixed size pool of worker threads with one task deque per worker.
+ * A worker pushes new tasks to and pops tasks from the tail of its own
+ * deque, giving depth first processing with good locality. An idle
+ * worker steals from the head of the other deques, ie. the oldest and
+ * normally largest pieces of work.
+ */
+
+struct task {
+        threadpool_fn fn;
+        void *arg;
+};
+
+struct deque {
+        pthread_mutex_t lock;
+        struct task *tasks;
+        size_t size;            /* always a power of 2 */
+        size_t head;
+        size_t tail;
+};
+
+struct worker {
+        pthread_t t;
+        struct threadpool *pool;
+        int id;
+        struct deque dq;
+};
+
+struct threadpool {
+        struct worker *workers;
+        int n_workers;
+        pthread_mutex_t lock;
+        pthread_cond_t work_cond;
+        pthread_cond_t idle_cond;
+        unsigned int pending;   /* queued + running tasks */
+        unsigned int queued;
+        unsigned int next;      /* round-robin for external submits */
+        int shutdown;
+        void (*init)();
+        struct threadpool_stats stats;
+};
+
+static __thread struct worker *self = NULL;
+
+#define DQ_SZ_INIT 64
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __dq_push(struct deque *dq, threadpool_fn fn, void *arg)
+{
+        pthread_mutex_lock(&dq->lock);
+        if (dq->tail - dq->head == dq->size) {
+                size_t size = dq->size ? dq->size * 2 : DQ_SZ_INIT;
+                struct task *tasks = malloc(size * sizeof(struct task));
+                size_t i;
+                if (!tasks) {
+                        pthread_mutex_unlock(&dq->lock);
+                        return -1;
+                }
+                for (i = dq->head; i != dq->tail; i++)
+                        tasks[i & (size - 1)] = dq->tasks[i & (dq->size - 1)];
+                free(dq->tasks);
+                dq->tasks = tasks;
+                dq->size = size;
+        }
+        dq->tasks[dq->tail & (dq->size - 1)].fn = fn;
+        dq->tasks[dq->tail & (dq->size - 1)].arg = arg;
+        ++dq->tail;
+        pthread_mutex_unlock(&dq->lock);
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Pop from tail (owner) or head (thief) of deque.
+ ****************************************************************************/
+static int __dq_pop(struct deque *dq, struct task *task, int steal)
+{
+        int ret = 0;
+
+        pthread_mutex_lock(&dq->lock);
+        if (dq->tail != dq->head) {
+                if (steal) {
+                        *task = dq->tasks[dq->head & (dq->size - 1)];
+                        ++dq->head;
+                } else {
+                        --dq->tail;
+                        *task = dq->tasks[dq->tail & (dq->size - 1)];
+                }
+                ret = 1;
+        }
+        pthread_mutex_unlock(&dq->lock);
+        return ret;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static int __get_task(struct worker *w, struct task *task)
+{
+        struct threadpool *pool = w->pool;
+        int i;
+
+        if (__dq_pop(&w->dq, task, 0))
+                return 1;
+        for (i = 1; i < pool->n_workers; i++) {
+                struct worker *v = &pool->workers[(w->id + i) % pool->n_workers];
+                if (__dq_pop(&v->dq, task, 1)) {
+                        pthread_mutex_lock(&pool->lock);
+                        ++pool->stats.stolen;
+                        pthread_mutex_unlock(&pool->lock);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+static void *__worker(void *data)
+{
+        struct worker *w = data;
+        struct threadpool *pool = w->pool;
+        struct task task;
+
+        self = w;
+        if (pool->init)
+                pool->init();
+        while (1) {
+                pthread_mutex_lock(&pool->lock);
+                while (!pool->queued && !pool->shutdown)
+                        pthread_cond_wait(&pool->work_cond, &pool->lock);
+                if (!pool->queued && pool->shutdown) {
+                        pthread_mutex_unlock(&pool->lock);
+                        break;
+                }
+                pthread_mutex_unlock(&pool->lock);
+
+                if (!__get_task(w, &task)) {
+                        /* Someone else was faster */
+                        sched_yield();
+                        continue;
+                }
+
+                pthread_mutex_lock(&pool->lock);
+                --pool->queued;
+                pthread_mutex_unlock(&pool->lock);
+
+                task.fn(task.arg);
+
+                pthread_mutex_lock(&pool->lock);
+                ++pool->stats.executed;
+                if (!--pool->pending)
+                        pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->lock);
+        }
+        self = NULL;
+
+        return NULL;
+}
+
+/*!
+ *****************************************************************************
+ * Queue a task. If called from one of the pool's own workers the task is
+ * put on the caller's deque, otherwise deques are picked round-robin.
+ ****************************************************************************/
+int threadpool_submit(void *h, threadpool_fn fn, void *arg)
+{
+        struct threadpool *pool = h;
+        struct worker *w;
+
+        if (self && self->pool == pool) {
+                w = self;
+        } else {
+                pthread_mutex_lock(&pool->lock);
+                w = &pool->workers[pool->next++ % pool->n_workers];
+                pthread_mutex_unlock(&pool->lock);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        ++pool->pending;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (__dq_push(&w->dq, fn, arg)) {
+                pthread_mutex_lock(&pool->lock);
+                if (!--pool->pending)
+                        pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->lock);
+                return -1;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        ++pool->queued;
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+}
+
+/*!
+ *****************************************************************************
+ * Block until all queued tasks, including tasks queued by other tasks,
+ * have finished.
+ ****************************************************************************/
+void threadpool_wait(void *h)
+{
+        struct threadpool *pool = h;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending)
+                pthread_cond_wait(&pool->idle_cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+/*!
+ *****************************************************************************
+ *
+ ****************************************************************************/
+void threadpool_get_stats(void *h, struct threadpool_stats *stats)
+{
+        struct threadpool *pool = h;
+
+        pthread_mutex_lock(&pool->lock);
+        *stats = pool->stats;
+        pthread_mutex_unlock(&pool->lock);
+}
+
+/*!
+ *****************************************************************************
+ * Create a pool of |n_threads| workers. If not NULL, |init| is called by
+ * each worker thread before it starts processing tasks.
+ ****************************************************************************/
+void *threadpool_create(int n_threads, void (*init)())
+{
+        struct threadpool *pool;
+        int i;
+
+        if (n_threads < 1)
+                n_threads = 1;
+        pool = calloc(1, sizeof(struct threadpool));
+        if (!pool)
+                return NULL;
+        pool->workers = calloc(n_threads, sizeof(struct worker));
+        if (!pool->workers) {
+                free(pool);
+                return NULL;
+        }
+        pool->init = init;
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work_cond, NULL);
+        pthread_cond_init(&pool->idle_cond, NULL);
+
+        for (i = 0; i < n_threads; i++) {
+                struct worker *w = &pool->workers[i];
+                w->pool = pool;
+                w->id = i;
+                pthread_mutex_init(&w->dq.lock, NULL);
+        }
+        for (i = 0; i < n_threads; i++) {
+                if (pthread_create(&pool->workers[i].t, NULL, __worker,
+                                   &pool->workers[i]))
+                        break;
+        }
+        pool->n_workers = i;
+        if (!pool->n_workers) {
+                threadpool_destroy(pool);
+                return NULL;
+        }
+        printd(4, "Thread pool %p created with %d workers\n", pool, i);
+        return pool;
+}
+
+/*!
+ *****************************************************************************
+ * Stop all workers once the queues have been drained.
+ ****************************************************************************/
+void threadpool_destroy(void *h)
+{
+        struct threadpool *pool = h;
+        int i;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = 1;
+        pthread_cond_broadcast(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < pool->n_workers; i++)
+                pthread_join(pool->workers[i].t, NULL);
+        for (i = 0; i < pool->n_workers; i++) {
+                pthread_mutex_destroy(&pool->workers[i].dq.lock);
+                free(pool->workers[i].dq.tasks);
+        }
+        pthread_cond_destroy(&pool->idle_cond);
+        pthread_cond_destroy(&pool->work_cond);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->workers);
+        free(pool);
+}